@@ -0,0 +1,103 @@
+/***********************************************************************
+BoundedQueue - Fixed capacity lock-free queue from any number of
+producer threads to one consumer thread.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// A ring of Capacity cells (a power of two), each with a sequence number
+// that tells whether it is free for the producer at a given position or
+// holds a value for the consumer (D. Vyukov's bounded queue). Producers
+// claim a position with one compare-and-swap and never wait for each other
+// or for the consumer; values are copied into preallocated cells, so
+// nothing is allocated after construction. push() fails when the queue is
+// full.
+template <typename T, size_t Capacity>
+class BoundedQueue {
+public:
+	BoundedQueue()
+	:enqueuePos(0),
+	dequeuePos(0)
+	{
+		static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+		for (size_t i = 0; i < Capacity; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	// Any thread. Returns false if the queue is full
+	bool push(const T& value){
+		Cell* cell;
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &cells[pos & (Capacity - 1)];
+			intptr_t diff = static_cast<intptr_t>(cell->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos);
+			if (diff == 0)
+			{
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+		cell->value = value;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer thread only. Returns false if the queue is empty
+	bool pop(T& value){
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		Cell& cell = cells[pos & (Capacity - 1)];
+		if (static_cast<intptr_t>(cell.sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos + 1) < 0)
+			return false;
+		value = cell.value;
+		cell.sequence.store(pos + Capacity, std::memory_order_release);
+		dequeuePos.store(pos + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Number of values waiting, only a snapshot while other threads push or pop
+	size_t size() const {
+		size_t pushed = enqueuePos.load(std::memory_order_relaxed);
+		size_t popped = dequeuePos.load(std::memory_order_relaxed);
+		return pushed > popped ? pushed - popped : 0;
+	}
+
+private:
+	BoundedQueue(const BoundedQueue&);
+	BoundedQueue& operator=(const BoundedQueue&);
+
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	Cell cells[Capacity];
+	alignas(64) std::atomic<size_t> enqueuePos; // Own cache lines, producers and consumer do not share them
+	alignas(64) std::atomic<size_t> dequeuePos;
+};
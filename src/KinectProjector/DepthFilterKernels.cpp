@@ -0,0 +1,775 @@
+/***********************************************************************
+DepthFilterKernels - Row kernels of the KinectGrabber temporal depth
+filter: portable scalar code and SSE4.1 / AVX2 versions.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+--- Adapted from FrameFilter of the Augmented Reality Sandbox
+Copyright (c) 2012-2015 Oliver Kreylos
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "DepthFilterKernels.h"
+#include <algorithm>
+#include <cmath>
+
+#ifdef DEPTH_FILTER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace {
+
+// Reference implementation, one pixel
+inline void filterPixel(const DepthFilterParameters& p, const DepthFilterRow& row, int i)
+{
+	float newVal = static_cast<float>(row.input[i]);
+	float* averagingBufferPtr = row.averagingSlots + row.averagingSlotIndex * p.slotStride + i;
+	float oldVal = *averagingBufferPtr;
+	float& count = row.count[i];
+	float& sum = row.sum[i];
+	float& sumSq = row.sumSq[i];
+
+	if (newVal > p.maxOffset) // we are under the ceiling plane
+	{
+		*averagingBufferPtr = newVal; // Store the value
+		if (p.followBigChange && count > 0) { // Follow big changes
+			float oldFiltered = sum / count; // Compare newVal with average
+			if (oldFiltered - newVal >= p.bigChange || newVal - oldFiltered >= p.bigChange)
+			{
+				for (int s = 0; s < p.numAveragingSlots; s++) // update all averaging slots
+					row.averagingSlots[s * p.slotStride + i] = newVal;
+				count = p.numAveragingSlots; // Update statistics
+				sum = newVal * p.numAveragingSlots;
+				sumSq = newVal * newVal * p.numAveragingSlots;
+			}
+		}
+		/* Update the pixel's statistics: */
+		++count; // Number of valid samples
+		sum += newVal; // Sum of valid samples
+		sumSq += newVal * newVal; // Sum of squares of valid samples
+
+		/* Check if the previous value in the averaging buffer was not initiated */
+		if (oldVal != p.initialValue)
+		{
+			--count;
+			sum -= oldVal;
+			sumSq -= oldVal * oldVal;
+		}
+	}
+	// Check if the pixel is "stable": */
+	if (count >= p.minNumSamples &&
+		sumSq * count <= p.maxVariance * count * count + sum * sum)
+	{
+		/* Check if the new running mean is outside the previous value's envelope: */
+		float newFiltered = sum / count;
+		if (std::abs(newFiltered - row.valid[i]) >= p.hysteresis)
+			row.valid[i] = newFiltered;
+	}
+	row.filtered[i] = row.valid[i];
+}
+
+void filterRowScalar(const DepthFilterParameters& p, const DepthFilterRow& row, int start)
+{
+	for (int i = start; i < row.numPixels; i++)
+		filterPixel(p, row, i);
+}
+
+// The variance test of the fixed point filter compares integers, with the
+// maximum variance in 1/256 units
+const int varianceShift = 8;
+
+struct FixedParameters
+{
+	int maxOffset; // Depth values up to this are ignored
+	int minNumSamples;
+	uint64_t maxVariance; // Scaled by 1 << varianceShift, below 2^32
+};
+
+FixedParameters getFixedParameters(const DepthFilterParameters& p)
+{
+	FixedParameters f;
+	// Integer depths are above maxOffset exactly when they are above its floor
+	f.maxOffset = static_cast<int>(std::floor(std::min(std::max(p.maxOffset, -1.0f), 65535.0f)));
+	f.minNumSamples = static_cast<int>(std::ceil(p.minNumSamples));
+	double maxVariance = std::floor(std::max(p.maxVariance, 0.0f) * (1 << varianceShift) + 0.5);
+	f.maxVariance = static_cast<uint64_t>(std::min(maxVariance, 4294967295.0));
+	return f;
+}
+
+// Reference implementation of the fixed point filter, one pixel. Unlike the
+// float filter, a big change leaves the statistics of the reset slots only,
+// so count, sum and sum of squares always describe the values in the slots
+// and the integer variance can never be negative
+inline void filterPixelFixed(const DepthFilterParameters& p, const FixedParameters& f, const DepthFilterFixedRow& row, int i)
+{
+	uint32_t newVal = row.input[i];
+	uint16_t* averagingBufferPtr = row.averagingSlots + row.averagingSlotIndex * p.slotStride + i;
+	uint32_t oldVal = *averagingBufferPtr;
+	uint32_t count = row.count[i];
+	uint32_t sum = row.sum[i];
+	uint64_t sumSq = row.sumSq[i];
+
+	if (static_cast<int>(newVal) > f.maxOffset && newVal != DEPTH_FILTER_FIXED_EMPTY_SLOT) // we are under the ceiling plane
+	{
+		*averagingBufferPtr = static_cast<uint16_t>(newVal); // Store the value
+		bool reset = false;
+		if (p.followBigChange && count > 0) { // Follow big changes
+			float oldFiltered = static_cast<float>(sum) / static_cast<float>(count);
+			float newValF = static_cast<float>(newVal);
+			reset = oldFiltered - newValF >= p.bigChange || newValF - oldFiltered >= p.bigChange;
+		}
+		if (reset)
+		{
+			for (int s = 0; s < p.numAveragingSlots; s++) // update all averaging slots
+				row.averagingSlots[s * p.slotStride + i] = static_cast<uint16_t>(newVal);
+			count = p.numAveragingSlots;
+			sum = newVal * p.numAveragingSlots;
+			sumSq = static_cast<uint64_t>(newVal) * newVal * p.numAveragingSlots;
+		}
+		else
+		{
+			++count;
+			sum += newVal;
+			sumSq += static_cast<uint64_t>(newVal) * newVal;
+			if (oldVal != DEPTH_FILTER_FIXED_EMPTY_SLOT)
+			{
+				--count;
+				sum -= oldVal;
+				sumSq -= static_cast<uint64_t>(oldVal) * oldVal;
+			}
+		}
+		row.count[i] = static_cast<uint16_t>(count);
+		row.sum[i] = sum;
+		row.sumSq[i] = sumSq;
+	}
+	// Check if the pixel is "stable": count * sumSq - sum^2 is count^2 times the variance
+	if (static_cast<int>(count) >= f.minNumSamples &&
+		((count * sumSq - static_cast<uint64_t>(sum) * sum) << varianceShift) <= f.maxVariance * count * count)
+	{
+		float newFiltered = static_cast<float>(sum) / static_cast<float>(count);
+		if (std::abs(newFiltered - row.valid[i]) >= p.hysteresis)
+			row.valid[i] = newFiltered;
+	}
+	row.filtered[i] = row.valid[i];
+}
+
+void filterRowFixedScalar(const DepthFilterParameters& p, const FixedParameters& f, const DepthFilterFixedRow& row, int start, int end)
+{
+	for (int i = start; i < end; i++)
+		filterPixelFixed(p, f, row, i);
+}
+
+// Reference implementation of the recursive filter, one pixel. The
+// measurement noise is maxVariance: a pixel is stable once its estimate is
+// as good as the mean of minNumSamples depth values
+inline void filterPixelRecursive(const DepthFilterParameters& p, const DepthFilterRecursiveRow& row, int i)
+{
+	float newVal = static_cast<float>(row.input[i]);
+	float estimate = row.estimate[i];
+	float variance = row.variance[i];
+	if (variance > 0)
+		variance += p.processNoise; // The sand may have moved since the last frame
+
+	if (newVal > p.maxOffset) // we are under the ceiling plane
+	{
+		float innovation = newVal - estimate;
+		bool big = p.followBigChange && variance > 0 && (estimate - newVal >= p.bigChange || newVal - estimate >= p.bigChange);
+		if (variance == 0 || big) // First value or a hand: start over from the new value
+		{
+			// Like the averaging filter filling all its slots, a big change
+			// is trusted at once while a first value needs a few more
+			estimate = newVal;
+			variance = big ? p.maxVariance / p.numAveragingSlots : p.maxVariance;
+		}
+		else
+		{
+			// A change the noise does not explain makes the estimate uncertain,
+			// so the filter follows it within a frame or two
+			float innovationSq = innovation * innovation;
+			if (innovationSq > p.gate * (variance + p.maxVariance))
+				variance = variance + innovationSq;
+			float gain = variance / (variance + p.maxVariance);
+			estimate = estimate + gain * innovation;
+			variance = variance - gain * variance;
+		}
+	}
+	row.estimate[i] = estimate;
+	row.variance[i] = variance;
+
+	if (variance > 0 && variance * p.minNumSamples <= p.maxVariance)
+	{
+		if (std::abs(estimate - row.valid[i]) >= p.hysteresis)
+			row.valid[i] = estimate;
+	}
+	row.filtered[i] = row.valid[i];
+}
+
+void filterRowRecursiveScalar(const DepthFilterParameters& p, const DepthFilterRecursiveRow& row, int start)
+{
+	for (int i = start; i < row.numPixels; i++)
+		filterPixelRecursive(p, row, i);
+}
+
+#ifdef DEPTH_FILTER_X86
+
+DEPTH_FILTER_TARGET("sse4.1")
+void filterRowSSE41(const DepthFilterParameters& p, const DepthFilterRow& row)
+{
+	const __m128 maxOffset = _mm_set1_ps(p.maxOffset);
+	const __m128 bigChange = _mm_set1_ps(p.bigChange);
+	const __m128 initialValue = _mm_set1_ps(p.initialValue);
+	const __m128 numSlots = _mm_set1_ps(static_cast<float>(p.numAveragingSlots));
+	const __m128 minNumSamples = _mm_set1_ps(p.minNumSamples);
+	const __m128 maxVariance = _mm_set1_ps(p.maxVariance);
+	const __m128 hysteresis = _mm_set1_ps(p.hysteresis);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	float* slot = row.averagingSlots + row.averagingSlotIndex * p.slotStride;
+
+	int i = 0;
+	for (; i + 4 <= row.numPixels; i += 4)
+	{
+		__m128 newVal = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row.input + i))));
+		__m128 oldVal = _mm_loadu_ps(slot + i);
+		__m128 count = _mm_loadu_ps(row.count + i);
+		__m128 sum = _mm_loadu_ps(row.sum + i);
+		__m128 sumSq = _mm_loadu_ps(row.sumSq + i);
+		__m128 update = _mm_cmpgt_ps(newVal, maxOffset);
+		__m128 newSq = _mm_mul_ps(newVal, newVal);
+		_mm_storeu_ps(slot + i, _mm_blendv_ps(oldVal, newVal, update));
+
+		if (p.followBigChange)
+		{
+			__m128 oldFiltered = _mm_div_ps(sum, count);
+			__m128 big = _mm_or_ps(_mm_cmpge_ps(_mm_sub_ps(oldFiltered, newVal), bigChange), _mm_cmpge_ps(_mm_sub_ps(newVal, oldFiltered), bigChange));
+			big = _mm_and_ps(big, _mm_and_ps(update, _mm_cmpgt_ps(count, zero)));
+			int lanes = _mm_movemask_ps(big);
+			if (lanes) // Rare: a hand or a big change in the sand
+			{
+				float values[4];
+				_mm_storeu_ps(values, newVal);
+				for (int l = 0; l < 4; l++)
+					if (lanes & (1 << l))
+						for (int s = 0; s < p.numAveragingSlots; s++)
+							row.averagingSlots[s * p.slotStride + i + l] = values[l];
+				count = _mm_blendv_ps(count, numSlots, big);
+				sum = _mm_blendv_ps(sum, _mm_mul_ps(newVal, numSlots), big);
+				sumSq = _mm_blendv_ps(sumSq, _mm_mul_ps(newSq, numSlots), big);
+			}
+		}
+
+		__m128 newCount = _mm_add_ps(count, one);
+		__m128 newSum = _mm_add_ps(sum, newVal);
+		__m128 newSumSq = _mm_add_ps(sumSq, newSq);
+		__m128 hadOld = _mm_cmpneq_ps(oldVal, initialValue);
+		newCount = _mm_blendv_ps(newCount, _mm_sub_ps(newCount, one), hadOld);
+		newSum = _mm_blendv_ps(newSum, _mm_sub_ps(newSum, oldVal), hadOld);
+		newSumSq = _mm_blendv_ps(newSumSq, _mm_sub_ps(newSumSq, _mm_mul_ps(oldVal, oldVal)), hadOld);
+		count = _mm_blendv_ps(count, newCount, update);
+		sum = _mm_blendv_ps(sum, newSum, update);
+		sumSq = _mm_blendv_ps(sumSq, newSumSq, update);
+		_mm_storeu_ps(row.count + i, count);
+		_mm_storeu_ps(row.sum + i, sum);
+		_mm_storeu_ps(row.sumSq + i, sumSq);
+
+		__m128 stable = _mm_and_ps(_mm_cmpge_ps(count, minNumSamples),
+			_mm_cmple_ps(_mm_mul_ps(sumSq, count), _mm_add_ps(_mm_mul_ps(_mm_mul_ps(maxVariance, count), count), _mm_mul_ps(sum, sum))));
+		__m128 valid = _mm_loadu_ps(row.valid + i);
+		__m128 newFiltered = _mm_div_ps(sum, count);
+		__m128 moved = _mm_cmpge_ps(_mm_andnot_ps(signMask, _mm_sub_ps(newFiltered, valid)), hysteresis);
+		valid = _mm_blendv_ps(valid, newFiltered, _mm_and_ps(stable, moved));
+		_mm_storeu_ps(row.valid + i, valid);
+		_mm_storeu_ps(row.filtered + i, valid);
+	}
+	filterRowScalar(p, row, i);
+}
+
+DEPTH_FILTER_TARGET("avx2")
+void filterRowAVX2(const DepthFilterParameters& p, const DepthFilterRow& row)
+{
+	const __m256 maxOffset = _mm256_set1_ps(p.maxOffset);
+	const __m256 bigChange = _mm256_set1_ps(p.bigChange);
+	const __m256 initialValue = _mm256_set1_ps(p.initialValue);
+	const __m256 numSlots = _mm256_set1_ps(static_cast<float>(p.numAveragingSlots));
+	const __m256 minNumSamples = _mm256_set1_ps(p.minNumSamples);
+	const __m256 maxVariance = _mm256_set1_ps(p.maxVariance);
+	const __m256 hysteresis = _mm256_set1_ps(p.hysteresis);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	float* slot = row.averagingSlots + row.averagingSlotIndex * p.slotStride;
+
+	int i = 0;
+	for (; i + 8 <= row.numPixels; i += 8)
+	{
+		__m256 newVal = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row.input + i))));
+		__m256 oldVal = _mm256_loadu_ps(slot + i);
+		__m256 count = _mm256_loadu_ps(row.count + i);
+		__m256 sum = _mm256_loadu_ps(row.sum + i);
+		__m256 sumSq = _mm256_loadu_ps(row.sumSq + i);
+		__m256 update = _mm256_cmp_ps(newVal, maxOffset, _CMP_GT_OQ);
+		__m256 newSq = _mm256_mul_ps(newVal, newVal);
+		_mm256_storeu_ps(slot + i, _mm256_blendv_ps(oldVal, newVal, update));
+
+		if (p.followBigChange)
+		{
+			__m256 oldFiltered = _mm256_div_ps(sum, count);
+			__m256 big = _mm256_or_ps(_mm256_cmp_ps(_mm256_sub_ps(oldFiltered, newVal), bigChange, _CMP_GE_OQ),
+				_mm256_cmp_ps(_mm256_sub_ps(newVal, oldFiltered), bigChange, _CMP_GE_OQ));
+			big = _mm256_and_ps(big, _mm256_and_ps(update, _mm256_cmp_ps(count, zero, _CMP_GT_OQ)));
+			int lanes = _mm256_movemask_ps(big);
+			if (lanes) // Rare: a hand or a big change in the sand
+			{
+				float values[8];
+				_mm256_storeu_ps(values, newVal);
+				for (int l = 0; l < 8; l++)
+					if (lanes & (1 << l))
+						for (int s = 0; s < p.numAveragingSlots; s++)
+							row.averagingSlots[s * p.slotStride + i + l] = values[l];
+				count = _mm256_blendv_ps(count, numSlots, big);
+				sum = _mm256_blendv_ps(sum, _mm256_mul_ps(newVal, numSlots), big);
+				sumSq = _mm256_blendv_ps(sumSq, _mm256_mul_ps(newSq, numSlots), big);
+			}
+		}
+
+		__m256 newCount = _mm256_add_ps(count, one);
+		__m256 newSum = _mm256_add_ps(sum, newVal);
+		__m256 newSumSq = _mm256_add_ps(sumSq, newSq);
+		__m256 hadOld = _mm256_cmp_ps(oldVal, initialValue, _CMP_NEQ_UQ);
+		newCount = _mm256_blendv_ps(newCount, _mm256_sub_ps(newCount, one), hadOld);
+		newSum = _mm256_blendv_ps(newSum, _mm256_sub_ps(newSum, oldVal), hadOld);
+		newSumSq = _mm256_blendv_ps(newSumSq, _mm256_sub_ps(newSumSq, _mm256_mul_ps(oldVal, oldVal)), hadOld);
+		count = _mm256_blendv_ps(count, newCount, update);
+		sum = _mm256_blendv_ps(sum, newSum, update);
+		sumSq = _mm256_blendv_ps(sumSq, newSumSq, update);
+		_mm256_storeu_ps(row.count + i, count);
+		_mm256_storeu_ps(row.sum + i, sum);
+		_mm256_storeu_ps(row.sumSq + i, sumSq);
+
+		__m256 stable = _mm256_and_ps(_mm256_cmp_ps(count, minNumSamples, _CMP_GE_OQ),
+			_mm256_cmp_ps(_mm256_mul_ps(sumSq, count), _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(maxVariance, count), count), _mm256_mul_ps(sum, sum)), _CMP_LE_OQ));
+		__m256 valid = _mm256_loadu_ps(row.valid + i);
+		__m256 newFiltered = _mm256_div_ps(sum, count);
+		__m256 moved = _mm256_cmp_ps(_mm256_andnot_ps(signMask, _mm256_sub_ps(newFiltered, valid)), hysteresis, _CMP_GE_OQ);
+		valid = _mm256_blendv_ps(valid, newFiltered, _mm256_and_ps(stable, moved));
+		_mm256_storeu_ps(row.valid + i, valid);
+		_mm256_storeu_ps(row.filtered + i, valid);
+	}
+	_mm256_zeroupper(); // Avoid AVX to SSE transition penalties in the code that follows
+	filterRowScalar(p, row, i);
+}
+
+// The fixed point kernels update the integer statistics with masked adds,
+// keeping the sums of squares as 64 bit lanes. Blocks with a big change
+// are rare and handed to the scalar code. The stability test looks at the
+// sign of maxVariance * count^2 - (count * sumSq - sum^2), all below 2^63
+DEPTH_FILTER_TARGET("sse4.1")
+void filterRowFixedSSE41(const DepthFilterParameters& p, const FixedParameters& f, const DepthFilterFixedRow& row)
+{
+	const __m128i maxOffset = _mm_set1_epi32(f.maxOffset);
+	const __m128i emptySlot = _mm_set1_epi32(DEPTH_FILTER_FIXED_EMPTY_SLOT);
+	const __m128i minNumSamples = _mm_set1_epi32(f.minNumSamples - 1);
+	const __m128i maxVariance = _mm_set1_epi64x(static_cast<long long>(f.maxVariance));
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 bigChange = _mm_set1_ps(p.bigChange);
+	const __m128 hysteresis = _mm_set1_ps(p.hysteresis);
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	uint16_t* slot = row.averagingSlots + row.averagingSlotIndex * p.slotStride;
+
+	int i = 0;
+	for (; i + 4 <= row.numPixels; i += 4)
+	{
+		__m128i newVal = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row.input + i)));
+		__m128i count = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row.count + i)));
+		__m128i sum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row.sum + i));
+		__m128i update = _mm_and_si128(_mm_cmpgt_epi32(newVal, maxOffset), _mm_cmplt_epi32(newVal, emptySlot));
+
+		if (p.followBigChange)
+		{
+			__m128 newValF = _mm_cvtepi32_ps(newVal);
+			__m128 oldFiltered = _mm_div_ps(_mm_cvtepi32_ps(sum), _mm_cvtepi32_ps(count));
+			__m128 big = _mm_or_ps(_mm_cmpge_ps(_mm_sub_ps(oldFiltered, newValF), bigChange), _mm_cmpge_ps(_mm_sub_ps(newValF, oldFiltered), bigChange));
+			big = _mm_and_ps(big, _mm_castsi128_ps(_mm_and_si128(update, _mm_cmpgt_epi32(count, zero))));
+			if (_mm_movemask_ps(big)) // Rare: a hand or a big change in the sand
+			{
+				filterRowFixedScalar(p, f, row, i, i + 4);
+				continue;
+			}
+		}
+
+		__m128i oldVal = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(slot + i)));
+		__m128i remove = _mm_andnot_si128(_mm_cmpeq_epi32(oldVal, emptySlot), update); // The old value leaves the statistics
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(slot + i), _mm_packus_epi32(_mm_blendv_epi8(oldVal, newVal, update), zero));
+		count = _mm_add_epi32(_mm_sub_epi32(count, update), remove); // Masks are -1
+		sum = _mm_sub_epi32(_mm_add_epi32(sum, _mm_and_si128(newVal, update)), _mm_and_si128(oldVal, remove));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(row.count + i), _mm_packus_epi32(count, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(row.sum + i), sum);
+
+		// 64 bit statistics of pixels i, i+1 (lo) and i+2, i+3 (hi)
+		__m128i newValLo = _mm_cvtepu32_epi64(newVal);
+		__m128i newValHi = _mm_cvtepu32_epi64(_mm_srli_si128(newVal, 8));
+		__m128i oldValLo = _mm_cvtepu32_epi64(oldVal);
+		__m128i oldValHi = _mm_cvtepu32_epi64(_mm_srli_si128(oldVal, 8));
+		__m128i updateLo = _mm_cvtepi32_epi64(update);
+		__m128i updateHi = _mm_cvtepi32_epi64(_mm_srli_si128(update, 8));
+		__m128i removeLo = _mm_cvtepi32_epi64(remove);
+		__m128i removeHi = _mm_cvtepi32_epi64(_mm_srli_si128(remove, 8));
+		__m128i sumSqLo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row.sumSq + i));
+		__m128i sumSqHi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row.sumSq + i + 2));
+		sumSqLo = _mm_sub_epi64(_mm_add_epi64(sumSqLo, _mm_and_si128(_mm_mul_epu32(newValLo, newValLo), updateLo)), _mm_and_si128(_mm_mul_epu32(oldValLo, oldValLo), removeLo));
+		sumSqHi = _mm_sub_epi64(_mm_add_epi64(sumSqHi, _mm_and_si128(_mm_mul_epu32(newValHi, newValHi), updateHi)), _mm_and_si128(_mm_mul_epu32(oldValHi, oldValHi), removeHi));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(row.sumSq + i), sumSqLo);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(row.sumSq + i + 2), sumSqHi);
+
+		__m128i countLo = _mm_cvtepu32_epi64(count);
+		__m128i countHi = _mm_cvtepu32_epi64(_mm_srli_si128(count, 8));
+		__m128i sumLo = _mm_cvtepu32_epi64(sum);
+		__m128i sumHi = _mm_cvtepu32_epi64(_mm_srli_si128(sum, 8));
+		__m128i spreadLo = _mm_add_epi64(_mm_mul_epu32(countLo, sumSqLo), _mm_slli_epi64(_mm_mul_epu32(countLo, _mm_srli_epi64(sumSqLo, 32)), 32));
+		__m128i spreadHi = _mm_add_epi64(_mm_mul_epu32(countHi, sumSqHi), _mm_slli_epi64(_mm_mul_epu32(countHi, _mm_srli_epi64(sumSqHi, 32)), 32));
+		spreadLo = _mm_slli_epi64(_mm_sub_epi64(spreadLo, _mm_mul_epu32(sumLo, sumLo)), varianceShift);
+		spreadHi = _mm_slli_epi64(_mm_sub_epi64(spreadHi, _mm_mul_epu32(sumHi, sumHi)), varianceShift);
+		__m128i marginLo = _mm_sub_epi64(_mm_mul_epu32(_mm_mul_epu32(countLo, countLo), maxVariance), spreadLo);
+		__m128i marginHi = _mm_sub_epi64(_mm_mul_epu32(_mm_mul_epu32(countHi, countHi), maxVariance), spreadHi);
+		__m128i negative = _mm_srai_epi32(_mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(marginLo), _mm_castsi128_ps(marginHi), _MM_SHUFFLE(3, 1, 3, 1))), 31);
+		__m128i stable = _mm_andnot_si128(negative, _mm_cmpgt_epi32(count, minNumSamples));
+
+		__m128 valid = _mm_loadu_ps(row.valid + i);
+		__m128 newFiltered = _mm_div_ps(_mm_cvtepi32_ps(sum), _mm_cvtepi32_ps(count));
+		__m128 moved = _mm_cmpge_ps(_mm_andnot_ps(signMask, _mm_sub_ps(newFiltered, valid)), hysteresis);
+		valid = _mm_blendv_ps(valid, newFiltered, _mm_and_ps(_mm_castsi128_ps(stable), moved));
+		_mm_storeu_ps(row.valid + i, valid);
+		_mm_storeu_ps(row.filtered + i, valid);
+	}
+	filterRowFixedScalar(p, f, row, i, row.numPixels);
+}
+
+DEPTH_FILTER_TARGET("avx2")
+inline __m128i packToUInt16(__m256i values)
+{
+	return _mm_packus_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+}
+
+DEPTH_FILTER_TARGET("avx2")
+void filterRowFixedAVX2(const DepthFilterParameters& p, const FixedParameters& f, const DepthFilterFixedRow& row)
+{
+	const __m256i maxOffset = _mm256_set1_epi32(f.maxOffset);
+	const __m256i emptySlot = _mm256_set1_epi32(DEPTH_FILTER_FIXED_EMPTY_SLOT);
+	const __m256i minNumSamples = _mm256_set1_epi32(f.minNumSamples - 1);
+	const __m256i maxVariance = _mm256_set1_epi64x(static_cast<long long>(f.maxVariance));
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256 bigChange = _mm256_set1_ps(p.bigChange);
+	const __m256 hysteresis = _mm256_set1_ps(p.hysteresis);
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	uint16_t* slot = row.averagingSlots + row.averagingSlotIndex * p.slotStride;
+
+	int i = 0;
+	for (; i + 8 <= row.numPixels; i += 8)
+	{
+		__m256i newVal = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row.input + i)));
+		__m256i count = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row.count + i)));
+		__m256i sum = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row.sum + i));
+		__m256i update = _mm256_and_si256(_mm256_cmpgt_epi32(newVal, maxOffset), _mm256_cmpgt_epi32(emptySlot, newVal));
+
+		if (p.followBigChange)
+		{
+			__m256 newValF = _mm256_cvtepi32_ps(newVal);
+			__m256 oldFiltered = _mm256_div_ps(_mm256_cvtepi32_ps(sum), _mm256_cvtepi32_ps(count));
+			__m256 big = _mm256_or_ps(_mm256_cmp_ps(_mm256_sub_ps(oldFiltered, newValF), bigChange, _CMP_GE_OQ),
+				_mm256_cmp_ps(_mm256_sub_ps(newValF, oldFiltered), bigChange, _CMP_GE_OQ));
+			big = _mm256_and_ps(big, _mm256_castsi256_ps(_mm256_and_si256(update, _mm256_cmpgt_epi32(count, zero))));
+			if (_mm256_movemask_ps(big)) // Rare: a hand or a big change in the sand
+			{
+				filterRowFixedScalar(p, f, row, i, i + 8);
+				continue;
+			}
+		}
+
+		__m256i oldVal = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(slot + i)));
+		__m256i remove = _mm256_andnot_si256(_mm256_cmpeq_epi32(oldVal, emptySlot), update); // The old value leaves the statistics
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(slot + i), packToUInt16(_mm256_blendv_epi8(oldVal, newVal, update)));
+		count = _mm256_add_epi32(_mm256_sub_epi32(count, update), remove); // Masks are -1
+		sum = _mm256_sub_epi32(_mm256_add_epi32(sum, _mm256_and_si256(newVal, update)), _mm256_and_si256(oldVal, remove));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(row.count + i), packToUInt16(count));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(row.sum + i), sum);
+
+		// 64 bit statistics of pixels i..i+3 (lo) and i+4..i+7 (hi)
+		__m256i newValLo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(newVal));
+		__m256i newValHi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(newVal, 1));
+		__m256i oldValLo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(oldVal));
+		__m256i oldValHi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(oldVal, 1));
+		__m256i updateLo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(update));
+		__m256i updateHi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(update, 1));
+		__m256i removeLo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(remove));
+		__m256i removeHi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(remove, 1));
+		__m256i sumSqLo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row.sumSq + i));
+		__m256i sumSqHi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row.sumSq + i + 4));
+		sumSqLo = _mm256_sub_epi64(_mm256_add_epi64(sumSqLo, _mm256_and_si256(_mm256_mul_epu32(newValLo, newValLo), updateLo)), _mm256_and_si256(_mm256_mul_epu32(oldValLo, oldValLo), removeLo));
+		sumSqHi = _mm256_sub_epi64(_mm256_add_epi64(sumSqHi, _mm256_and_si256(_mm256_mul_epu32(newValHi, newValHi), updateHi)), _mm256_and_si256(_mm256_mul_epu32(oldValHi, oldValHi), removeHi));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(row.sumSq + i), sumSqLo);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(row.sumSq + i + 4), sumSqHi);
+
+		__m256i countLo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(count));
+		__m256i countHi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(count, 1));
+		__m256i sumLo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(sum));
+		__m256i sumHi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(sum, 1));
+		__m256i spreadLo = _mm256_add_epi64(_mm256_mul_epu32(countLo, sumSqLo), _mm256_slli_epi64(_mm256_mul_epu32(countLo, _mm256_srli_epi64(sumSqLo, 32)), 32));
+		__m256i spreadHi = _mm256_add_epi64(_mm256_mul_epu32(countHi, sumSqHi), _mm256_slli_epi64(_mm256_mul_epu32(countHi, _mm256_srli_epi64(sumSqHi, 32)), 32));
+		spreadLo = _mm256_slli_epi64(_mm256_sub_epi64(spreadLo, _mm256_mul_epu32(sumLo, sumLo)), varianceShift);
+		spreadHi = _mm256_slli_epi64(_mm256_sub_epi64(spreadHi, _mm256_mul_epu32(sumHi, sumHi)), varianceShift);
+		__m256i marginLo = _mm256_sub_epi64(_mm256_mul_epu32(_mm256_mul_epu32(countLo, countLo), maxVariance), spreadLo);
+		__m256i marginHi = _mm256_sub_epi64(_mm256_mul_epu32(_mm256_mul_epu32(countHi, countHi), maxVariance), spreadHi);
+		// The shuffle works within 128 bit lanes, giving pixels 0 1 4 5 2 3 6 7
+		__m256i negative = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(marginLo), _mm256_castsi256_ps(marginHi), _MM_SHUFFLE(3, 1, 3, 1)));
+		negative = _mm256_srai_epi32(_mm256_permute4x64_epi64(negative, _MM_SHUFFLE(3, 1, 2, 0)), 31);
+		__m256i stable = _mm256_andnot_si256(negative, _mm256_cmpgt_epi32(count, minNumSamples));
+
+		__m256 valid = _mm256_loadu_ps(row.valid + i);
+		__m256 newFiltered = _mm256_div_ps(_mm256_cvtepi32_ps(sum), _mm256_cvtepi32_ps(count));
+		__m256 moved = _mm256_cmp_ps(_mm256_andnot_ps(signMask, _mm256_sub_ps(newFiltered, valid)), hysteresis, _CMP_GE_OQ);
+		valid = _mm256_blendv_ps(valid, newFiltered, _mm256_and_ps(_mm256_castsi256_ps(stable), moved));
+		_mm256_storeu_ps(row.valid + i, valid);
+		_mm256_storeu_ps(row.filtered + i, valid);
+	}
+	_mm256_zeroupper(); // Avoid AVX to SSE transition penalties in the code that follows
+	filterRowFixedScalar(p, f, row, i, row.numPixels);
+}
+
+// Both branches of the scalar update are computed and blended
+DEPTH_FILTER_TARGET("sse4.1")
+void filterRowRecursiveSSE41(const DepthFilterParameters& p, const DepthFilterRecursiveRow& row)
+{
+	const __m128 maxOffset = _mm_set1_ps(p.maxOffset);
+	const __m128 bigChange = _mm_set1_ps(p.bigChange);
+	const __m128 measurementNoise = _mm_set1_ps(p.maxVariance);
+	const __m128 settledVariance = _mm_set1_ps(p.maxVariance / p.numAveragingSlots);
+	const __m128 processNoise = _mm_set1_ps(p.processNoise);
+	const __m128 gate = _mm_set1_ps(p.gate);
+	const __m128 minNumSamples = _mm_set1_ps(p.minNumSamples);
+	const __m128 hysteresis = _mm_set1_ps(p.hysteresis);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+
+	int i = 0;
+	for (; i + 4 <= row.numPixels; i += 4)
+	{
+		__m128 newVal = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row.input + i))));
+		__m128 estimate = _mm_loadu_ps(row.estimate + i);
+		__m128 variance = _mm_loadu_ps(row.variance + i);
+		variance = _mm_blendv_ps(variance, _mm_add_ps(variance, processNoise), _mm_cmpgt_ps(variance, zero));
+		__m128 update = _mm_cmpgt_ps(newVal, maxOffset);
+
+		__m128 innovation = _mm_sub_ps(newVal, estimate);
+		__m128 first = _mm_cmpeq_ps(variance, zero);
+		__m128 big = zero;
+		if (p.followBigChange)
+			big = _mm_andnot_ps(first, _mm_or_ps(_mm_cmpge_ps(_mm_sub_ps(estimate, newVal), bigChange), _mm_cmpge_ps(_mm_sub_ps(newVal, estimate), bigChange)));
+		__m128 restart = _mm_or_ps(first, big);
+		__m128 innovationSq = _mm_mul_ps(innovation, innovation);
+		__m128 motion = _mm_cmpgt_ps(innovationSq, _mm_mul_ps(gate, _mm_add_ps(variance, measurementNoise)));
+		__m128 gated = _mm_blendv_ps(variance, _mm_add_ps(variance, innovationSq), motion);
+		__m128 gain = _mm_div_ps(gated, _mm_add_ps(gated, measurementNoise));
+		__m128 newEstimate = _mm_blendv_ps(_mm_add_ps(estimate, _mm_mul_ps(gain, innovation)), newVal, restart);
+		__m128 newVariance = _mm_blendv_ps(_mm_sub_ps(gated, _mm_mul_ps(gain, gated)), _mm_blendv_ps(measurementNoise, settledVariance, big), restart);
+		estimate = _mm_blendv_ps(estimate, newEstimate, update);
+		variance = _mm_blendv_ps(variance, newVariance, update);
+		_mm_storeu_ps(row.estimate + i, estimate);
+		_mm_storeu_ps(row.variance + i, variance);
+
+		__m128 stable = _mm_and_ps(_mm_cmpgt_ps(variance, zero), _mm_cmple_ps(_mm_mul_ps(variance, minNumSamples), measurementNoise));
+		__m128 valid = _mm_loadu_ps(row.valid + i);
+		__m128 moved = _mm_cmpge_ps(_mm_andnot_ps(signMask, _mm_sub_ps(estimate, valid)), hysteresis);
+		valid = _mm_blendv_ps(valid, estimate, _mm_and_ps(stable, moved));
+		_mm_storeu_ps(row.valid + i, valid);
+		_mm_storeu_ps(row.filtered + i, valid);
+	}
+	filterRowRecursiveScalar(p, row, i);
+}
+
+DEPTH_FILTER_TARGET("avx2")
+void filterRowRecursiveAVX2(const DepthFilterParameters& p, const DepthFilterRecursiveRow& row)
+{
+	const __m256 maxOffset = _mm256_set1_ps(p.maxOffset);
+	const __m256 bigChange = _mm256_set1_ps(p.bigChange);
+	const __m256 measurementNoise = _mm256_set1_ps(p.maxVariance);
+	const __m256 settledVariance = _mm256_set1_ps(p.maxVariance / p.numAveragingSlots);
+	const __m256 processNoise = _mm256_set1_ps(p.processNoise);
+	const __m256 gate = _mm256_set1_ps(p.gate);
+	const __m256 minNumSamples = _mm256_set1_ps(p.minNumSamples);
+	const __m256 hysteresis = _mm256_set1_ps(p.hysteresis);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+
+	int i = 0;
+	for (; i + 8 <= row.numPixels; i += 8)
+	{
+		__m256 newVal = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row.input + i))));
+		__m256 estimate = _mm256_loadu_ps(row.estimate + i);
+		__m256 variance = _mm256_loadu_ps(row.variance + i);
+		variance = _mm256_blendv_ps(variance, _mm256_add_ps(variance, processNoise), _mm256_cmp_ps(variance, zero, _CMP_GT_OQ));
+		__m256 update = _mm256_cmp_ps(newVal, maxOffset, _CMP_GT_OQ);
+
+		__m256 innovation = _mm256_sub_ps(newVal, estimate);
+		__m256 first = _mm256_cmp_ps(variance, zero, _CMP_EQ_OQ);
+		__m256 big = zero;
+		if (p.followBigChange)
+			big = _mm256_andnot_ps(first, _mm256_or_ps(_mm256_cmp_ps(_mm256_sub_ps(estimate, newVal), bigChange, _CMP_GE_OQ),
+				_mm256_cmp_ps(_mm256_sub_ps(newVal, estimate), bigChange, _CMP_GE_OQ)));
+		__m256 restart = _mm256_or_ps(first, big);
+		__m256 innovationSq = _mm256_mul_ps(innovation, innovation);
+		__m256 motion = _mm256_cmp_ps(innovationSq, _mm256_mul_ps(gate, _mm256_add_ps(variance, measurementNoise)), _CMP_GT_OQ);
+		__m256 gated = _mm256_blendv_ps(variance, _mm256_add_ps(variance, innovationSq), motion);
+		__m256 gain = _mm256_div_ps(gated, _mm256_add_ps(gated, measurementNoise));
+		__m256 newEstimate = _mm256_blendv_ps(_mm256_add_ps(estimate, _mm256_mul_ps(gain, innovation)), newVal, restart);
+		__m256 newVariance = _mm256_blendv_ps(_mm256_sub_ps(gated, _mm256_mul_ps(gain, gated)), _mm256_blendv_ps(measurementNoise, settledVariance, big), restart);
+		estimate = _mm256_blendv_ps(estimate, newEstimate, update);
+		variance = _mm256_blendv_ps(variance, newVariance, update);
+		_mm256_storeu_ps(row.estimate + i, estimate);
+		_mm256_storeu_ps(row.variance + i, variance);
+
+		__m256 stable = _mm256_and_ps(_mm256_cmp_ps(variance, zero, _CMP_GT_OQ),
+			_mm256_cmp_ps(_mm256_mul_ps(variance, minNumSamples), measurementNoise, _CMP_LE_OQ));
+		__m256 valid = _mm256_loadu_ps(row.valid + i);
+		__m256 moved = _mm256_cmp_ps(_mm256_andnot_ps(signMask, _mm256_sub_ps(estimate, valid)), hysteresis, _CMP_GE_OQ);
+		valid = _mm256_blendv_ps(valid, estimate, _mm256_and_ps(stable, moved));
+		_mm256_storeu_ps(row.valid + i, valid);
+		_mm256_storeu_ps(row.filtered + i, valid);
+	}
+	_mm256_zeroupper(); // Avoid AVX to SSE transition penalties in the code that follows
+	filterRowRecursiveScalar(p, row, i);
+}
+
+bool cpuSupports(DepthFilterKernel kernel)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6; // OSXSAVE, AVX, YMM state enabled
+	if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+		return sse41;
+	if (maxLeaf < 7 || !osAvx)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+		return __builtin_cpu_supports("sse4.1");
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+}
+
+DepthFilterKernel getBestDepthFilterKernel()
+{
+#ifdef DEPTH_FILTER_X86
+	static const DepthFilterKernel best = cpuSupports(DEPTH_FILTER_KERNEL_AVX2) ? DEPTH_FILTER_KERNEL_AVX2 :
+		cpuSupports(DEPTH_FILTER_KERNEL_SSE41) ? DEPTH_FILTER_KERNEL_SSE41 : DEPTH_FILTER_KERNEL_SCALAR;
+	return best;
+#else
+	return DEPTH_FILTER_KERNEL_SCALAR;
+#endif
+}
+
+const char* getDepthFilterKernelName(DepthFilterKernel kernel)
+{
+	switch (kernel)
+	{
+	case DEPTH_FILTER_KERNEL_SSE41:
+		return "sse4.1";
+	case DEPTH_FILTER_KERNEL_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+const char* getDepthFilterStorageName(DepthFilterStorage storage)
+{
+	return storage == DEPTH_FILTER_STORAGE_FIXED ? "fixed" : "float";
+}
+
+const char* getDepthFilterModeName(DepthFilterMode mode)
+{
+	return mode == DEPTH_FILTER_MODE_RECURSIVE ? "recursive" : "averaging";
+}
+
+// In steady state the gain k satisfies processNoise = k^2 * measurementNoise / (1 - k),
+// with k = 1 / numSamples the estimate weighs about the last numSamples frames
+float getDepthFilterProcessNoise(float measurementNoise, int numSamples)
+{
+	float gain = 1.0f / std::max(numSamples, 2);
+	return gain * gain * measurementNoise / (1.0f - gain);
+}
+
+void runDepthFilterRow(DepthFilterKernel kernel, const DepthFilterParameters& params, const DepthFilterRow& row)
+{
+#ifdef DEPTH_FILTER_X86
+	if (kernel == DEPTH_FILTER_KERNEL_AVX2)
+	{
+		filterRowAVX2(params, row);
+		return;
+	}
+	if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+	{
+		filterRowSSE41(params, row);
+		return;
+	}
+#endif
+	filterRowScalar(params, row, 0);
+}
+
+void runDepthFilterRowFixed(DepthFilterKernel kernel, const DepthFilterParameters& params, const DepthFilterFixedRow& row)
+{
+	FixedParameters f = getFixedParameters(params);
+#ifdef DEPTH_FILTER_X86
+	if (kernel == DEPTH_FILTER_KERNEL_AVX2)
+	{
+		filterRowFixedAVX2(params, f, row);
+		return;
+	}
+	if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+	{
+		filterRowFixedSSE41(params, f, row);
+		return;
+	}
+#endif
+	filterRowFixedScalar(params, f, row, 0, row.numPixels);
+}
+
+void runDepthFilterRowRecursive(DepthFilterKernel kernel, const DepthFilterParameters& params, const DepthFilterRecursiveRow& row)
+{
+#ifdef DEPTH_FILTER_X86
+	if (kernel == DEPTH_FILTER_KERNEL_AVX2)
+	{
+		filterRowRecursiveAVX2(params, row);
+		return;
+	}
+	if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+	{
+		filterRowRecursiveSSE41(params, row);
+		return;
+	}
+#endif
+	filterRowRecursiveScalar(params, row, 0);
+}
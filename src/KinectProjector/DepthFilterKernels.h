@@ -0,0 +1,140 @@
+/***********************************************************************
+DepthFilterKernels - Row kernels of the KinectGrabber temporal depth
+filter: portable scalar code and SSE4.1 / AVX2 versions.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+--- Adapted from FrameFilter of the Augmented Reality Sandbox
+Copyright (c) 2012-2015 Oliver Kreylos
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define DEPTH_FILTER_X86
+#ifdef _MSC_VER
+#define DEPTH_FILTER_TARGET(isa)
+#else
+// Compile single functions for the instruction set, the rest of the program stays generic
+#define DEPTH_FILTER_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// The SIMD kernels do exactly the same float operations in the same order
+// as the scalar kernel, only for 4 (SSE4.1) or 8 (AVX2) pixels at a time,
+// so all kernels give bit identical results.
+enum DepthFilterKernel
+{
+	DEPTH_FILTER_KERNEL_SCALAR,
+	DEPTH_FILTER_KERNEL_SSE41,
+	DEPTH_FILTER_KERNEL_AVX2
+};
+
+// How the averaging slots and statistics are stored. Fixed point keeps the
+// raw integer depth in uint16 slots with exact integer sums (uint32 sum,
+// uint64 sum of squares): the averaging buffer takes half the memory and the
+// variance test has no rounding drift. Its results are not bit identical to
+// float storage, but all kernels of one storage mode agree with each other.
+enum DepthFilterStorage
+{
+	DEPTH_FILTER_STORAGE_FLOAT,
+	DEPTH_FILTER_STORAGE_FIXED
+};
+
+// The averaging filter keeps the last numAveragingSlots depth values of
+// each pixel and their statistics. The recursive filter is a scalar Kalman
+// filter per pixel, keeping only an estimate and its variance (in float
+// whatever the storage): it follows a change as soon as it exceeds the
+// noise and smooths a static pixel as much as numAveragingSlots frames
+enum DepthFilterMode
+{
+	DEPTH_FILTER_MODE_AVERAGING,
+	DEPTH_FILTER_MODE_RECURSIVE
+};
+
+struct DepthFilterParameters
+{
+	int numAveragingSlots;
+	size_t slotStride; // Distance between two averaging slots of the same pixel
+	float minNumSamples; // Minimum number of valid samples needed to consider a pixel stable
+	float maxVariance; // Maximum variance to consider a pixel stable
+	float hysteresis; // Amount by which a new filtered value has to differ from the current value to update the display
+	float maxOffset; // Depth values below this are above the ceiling and ignored
+	float initialValue; // Value of averaging slots that have not been filled yet
+	bool followBigChange;
+	float bigChange; // Amount of change over which the averaging slots are reset to the new value
+	// Recursive filter only. maxVariance is the variance of the depth noise
+	float processNoise; // Variance the depth may drift by from one frame to the next
+	float gate; // Changes of more than gate times their expected variance are taken as motion
+};
+
+// A run of consecutive pixels of one row. The statistics are stored as
+// three separate planes (sample count, sum and sum of squares)
+struct DepthFilterRow
+{
+	const unsigned short* input;
+	float* averagingSlots; // Slot 0 of the first pixel
+	int averagingSlotIndex; // Slot receiving the current frame
+	float* count;
+	float* sum;
+	float* sumSq;
+	float* valid; // Most recent stable value
+	float* filtered;
+	int numPixels;
+};
+
+// Same as DepthFilterRow with fixed point storage. Empty averaging slots
+// hold DEPTH_FILTER_FIXED_EMPTY_SLOT, a value the Kinect never reports
+struct DepthFilterFixedRow
+{
+	const unsigned short* input;
+	uint16_t* averagingSlots; // Slot 0 of the first pixel
+	int averagingSlotIndex; // Slot receiving the current frame
+	uint16_t* count;
+	uint32_t* sum;
+	uint64_t* sumSq;
+	float* valid; // Most recent stable value
+	float* filtered;
+	int numPixels;
+};
+
+static const uint16_t DEPTH_FILTER_FIXED_EMPTY_SLOT = 0xffff;
+
+// A run of consecutive pixels for the recursive filter. A variance of 0
+// means the pixel has no estimate yet
+struct DepthFilterRecursiveRow
+{
+	const unsigned short* input;
+	float* estimate;
+	float* variance;
+	float* valid; // Most recent stable value
+	float* filtered;
+	int numPixels;
+};
+
+// Process noise giving the recursive filter the steady state gain of an
+// average over numSamples frames
+float getDepthFilterProcessNoise(float measurementNoise, int numSamples);
+
+// Fastest kernel supported by the CPU and the compiler
+DepthFilterKernel getBestDepthFilterKernel();
+const char* getDepthFilterKernelName(DepthFilterKernel kernel);
+const char* getDepthFilterStorageName(DepthFilterStorage storage);
+const char* getDepthFilterModeName(DepthFilterMode mode);
+
+void runDepthFilterRow(DepthFilterKernel kernel, const DepthFilterParameters& params, const DepthFilterRow& row);
+void runDepthFilterRowFixed(DepthFilterKernel kernel, const DepthFilterParameters& params, const DepthFilterFixedRow& row);
+void runDepthFilterRowRecursive(DepthFilterKernel kernel, const DepthFilterParameters& params, const DepthFilterRecursiveRow& row);
@@ -0,0 +1,134 @@
+/***********************************************************************
+DepthRecorder - Records the raw Kinect frames seen by KinectGrabber to a
+DepthRecording file on its own thread.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthRecorder.h"
+
+DepthRecorder::DepthRecorder()
+:recording(false),
+colorInterval(0),
+firstTimestamp(0),
+submittedFrames(0),
+produced(0),
+consumed(0),
+recordedFrames(0),
+droppedFrames(0),
+bytesWritten(0)
+{
+}
+
+DepthRecorder::~DepthRecorder()
+{
+	stop();
+}
+
+bool DepthRecorder::start(std::string spath, unsigned int width, unsigned int height, int scolorInterval, ofMatrix4x4 worldMatrix)
+{
+	stop();
+	path = spath;
+	colorInterval = scolorInterval;
+	if (!writer.open(path, width, height, colorInterval > 0,
+		worldMatrix(0, 0), worldMatrix(1, 1), worldMatrix(0, 3), worldMatrix(1, 3),
+		DEPTH_CODEC_DELTA_RICE, 30, colorInterval))
+		return false;
+
+	// Allocate everything up front so the grabber thread never allocates
+	slots.resize(numSlots);
+	for (auto & slot : slots)
+	{
+		slot.depth.resize(static_cast<size_t>(width) * height);
+		slot.color.resize(colorInterval > 0 ? static_cast<size_t>(width) * height * 3 : 0);
+		slot.hasColor = false;
+	}
+	produced = 0;
+	consumed = 0;
+	submittedFrames = 0;
+	firstTimestamp = 0;
+	recordedFrames = 0;
+	droppedFrames = 0;
+	bytesWritten = writer.getBytesWritten();
+
+	recording = true;
+	startThread(true);
+	ofLogVerbose("DepthRecorder") << "start(): recording to " << path;
+	return true;
+}
+
+void DepthRecorder::stop()
+{
+	if (!recording)
+		return;
+	recording = false;
+	frameQueued.notify_all();
+	waitForThread(false);
+	writer.close();
+	bytesWritten = writer.getBytesWritten();
+	ofLogNotice("DepthRecorder") << "stop(): recorded " << recordedFrames << " frames to " << path << ", dropped " << droppedFrames;
+}
+
+void DepthRecorder::addFrame(uint64_t timestamp, const ofShortPixels& depth, const ofPixels& color)
+{
+	if (!recording)
+		return;
+	size_t p = produced.load(std::memory_order_relaxed);
+	if (p - consumed.load(std::memory_order_acquire) >= numSlots)
+	{
+		droppedFrames++;
+		return;
+	}
+	Slot& slot = slots[p % numSlots];
+	if (submittedFrames == 0)
+		firstTimestamp = timestamp;
+	slot.timestamp = timestamp - firstTimestamp;
+	memcpy(slot.depth.data(), depth.getData(), slot.depth.size() * sizeof(uint16_t));
+	// Only copy the colour the writer keeps, it numbers the frames the same way as long as no write fails
+	slot.hasColor = !slot.color.empty() && color.size() == slot.color.size() && writer.storesColor(submittedFrames);
+	if (slot.hasColor)
+		memcpy(slot.color.data(), color.getData(), slot.color.size());
+	submittedFrames++;
+
+	produced.store(p + 1, std::memory_order_release);
+	frameQueued.notify_one();
+}
+
+void DepthRecorder::threadedFunction()
+{
+	while (true)
+	{
+		size_t c = consumed.load(std::memory_order_relaxed);
+		if (c == produced.load(std::memory_order_acquire))
+		{
+			if (!recording)
+				break; // Queue drained
+			lock();
+			frameQueued.wait_for(mutex, std::chrono::milliseconds(10));
+			unlock();
+			continue;
+		}
+		Slot& slot = slots[c % numSlots];
+		if (writer.writeFrame(slot.timestamp, slot.depth.data(), slot.hasColor ? slot.color.data() : nullptr))
+			recordedFrames++;
+		else
+			droppedFrames++;
+		bytesWritten = writer.getBytesWritten();
+		consumed.store(c + 1, std::memory_order_release);
+	}
+}
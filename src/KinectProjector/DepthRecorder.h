@@ -0,0 +1,92 @@
+/***********************************************************************
+DepthRecorder - Records the raw Kinect frames seen by KinectGrabber to a
+DepthRecording file on its own thread.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include <atomic>
+#include <condition_variable>
+
+#include "DepthRecording.h"
+
+// The grabber thread hands frames to addFrame(), which only copies them into
+// a preallocated ring of slots. Encoding and disk writes happen on the
+// recorder thread. When the ring is full (disk too slow) frames are dropped
+// and counted rather than stalling the grabber.
+class DepthRecorder: public ofThread {
+public:
+	DepthRecorder();
+	~DepthRecorder();
+
+	// Open the file and start the recorder thread. colorInterval is the number of
+	// frames between stored colour frames, 0 records depth only
+	bool start(std::string path, unsigned int width, unsigned int height, int colorInterval, ofMatrix4x4 worldMatrix);
+	// Write the queued frames, close the file and stop the thread
+	void stop();
+	bool isRecording() {
+		return recording;
+	}
+
+	// Called from the grabber thread, never blocks on the disk
+	void addFrame(uint64_t timestamp, const ofShortPixels& depth, const ofPixels& color);
+
+	size_t getRecordedFrames() {
+		return recordedFrames;
+	}
+	size_t getDroppedFrames() {
+		return droppedFrames;
+	}
+	uint64_t getBytesWritten() {
+		return bytesWritten;
+	}
+	std::string getPath() {
+		return path;
+	}
+
+private:
+	void threadedFunction() override;
+
+	struct Slot
+	{
+		uint64_t timestamp;
+		std::vector<uint16_t> depth;
+		std::vector<uint8_t> color;
+		bool hasColor;
+	};
+	static const size_t numSlots = 16;
+
+	DepthRecordingWriter writer;
+	std::string path;
+	std::atomic<bool> recording;
+	int colorInterval;
+	uint64_t firstTimestamp;
+	size_t submittedFrames;
+
+	// Single producer (grabber) / single consumer (recorder) ring
+	std::vector<Slot> slots;
+	std::atomic<size_t> produced;
+	std::atomic<size_t> consumed;
+	std::condition_variable_any frameQueued;
+
+	std::atomic<size_t> recordedFrames;
+	std::atomic<size_t> droppedFrames;
+	std::atomic<uint64_t> bytesWritten;
+};
@@ -0,0 +1,582 @@
+/***********************************************************************
+DepthRecording - File format, reader and writer for recorded sessions
+of raw Kinect depth (and optionally colour) frames.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthRecording.h"
+#include <algorithm>
+#include <cstring>
+#include "ofLog.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//--------------------------------------------------------------
+MappedFile::MappedFile()
+:data(nullptr),
+size(0)
+#ifdef _WIN32
+,fileHandle(INVALID_HANDLE_VALUE),
+mappingHandle(nullptr)
+#else
+,fd(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+	close();
+#ifdef _WIN32
+	HANDLE fh = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fh == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fh, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(fh);
+		return false;
+	}
+	HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mh == NULL)
+	{
+		CloseHandle(fh);
+		return false;
+	}
+	void* ptr = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+	if (ptr == NULL)
+	{
+		CloseHandle(mh);
+		CloseHandle(fh);
+		return false;
+	}
+	fileHandle = fh;
+	mappingHandle = mh;
+	data = static_cast<const uint8_t*>(ptr);
+	size = fileSize.QuadPart;
+#else
+	int f = ::open(path.c_str(), O_RDONLY);
+	if (f < 0)
+		return false;
+	struct stat st;
+	if (fstat(f, &st) != 0 || st.st_size == 0)
+	{
+		::close(f);
+		return false;
+	}
+	void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, f, 0);
+	if (ptr == MAP_FAILED)
+	{
+		::close(f);
+		return false;
+	}
+	madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+	fd = f;
+	data = static_cast<const uint8_t*>(ptr);
+	size = st.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (!data)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mappingHandle);
+	CloseHandle(fileHandle);
+	mappingHandle = nullptr;
+	fileHandle = INVALID_HANDLE_VALUE;
+#else
+	munmap(const_cast<uint8_t*>(data), size);
+	::close(fd);
+	fd = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+//--------------------------------------------------------------
+// Adaptive Rice coding of depth prediction residuals
+
+namespace {
+
+// Residuals are Rice coded with a quotient of at most RICE_ESCAPE ones;
+// anything larger is written as an escape followed by the raw value
+const unsigned int RICE_ESCAPE = 24;
+const unsigned int RICE_RAW_BITS = 17; // zigzag of a difference of two uint16
+
+inline uint32_t zigzag(int32_t v)
+{
+	return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+inline int32_t unzigzag(uint32_t v)
+{
+	return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+}
+
+// Running mean of the residual magnitudes, as in LOCO-I
+struct RiceContext
+{
+	uint32_t a;
+	uint32_t n;
+
+	RiceContext() :a(4), n(1) {}
+
+	unsigned int k() const
+	{
+		unsigned int k = 0;
+		while ((n << k) < a && k < 16)
+			k++;
+		return k;
+	}
+	void update(uint32_t value)
+	{
+		a += value;
+		if (++n == 64)
+		{
+			a >>= 1;
+			n >>= 1;
+		}
+	}
+};
+
+class BitWriter
+{
+public:
+	explicit BitWriter(std::vector<uint8_t>& sout) :out(sout), acc(0), bits(0) {}
+
+	void put(uint32_t value, unsigned int count)
+	{
+		acc |= static_cast<uint64_t>(value) << bits;
+		bits += count;
+		while (bits >= 8)
+		{
+			out.push_back(static_cast<uint8_t>(acc));
+			acc >>= 8;
+			bits -= 8;
+		}
+	}
+	void putOnes(unsigned int count)
+	{
+		while (count >= 16)
+		{
+			put(0xFFFF, 16);
+			count -= 16;
+		}
+		put((1u << count) - 1, count);
+	}
+	void flush()
+	{
+		if (bits > 0)
+			out.push_back(static_cast<uint8_t>(acc));
+		acc = 0;
+		bits = 0;
+	}
+
+private:
+	std::vector<uint8_t>& out;
+	uint64_t acc;
+	unsigned int bits;
+};
+
+class BitReader
+{
+public:
+	BitReader(const uint8_t* sdata, size_t ssize) :data(sdata), size(ssize), pos(0), acc(0), bits(0) {}
+
+	uint32_t get(unsigned int count)
+	{
+		refill();
+		uint32_t value = static_cast<uint32_t>(acc & ((1ull << count) - 1));
+		acc >>= count;
+		bits -= count;
+		return value;
+	}
+	// Number of consecutive ones, at most max
+	unsigned int countOnes(unsigned int max)
+	{
+		unsigned int count = 0;
+		while (count < max)
+		{
+			refill();
+			if (!(acc & 1))
+			{
+				acc >>= 1;
+				bits--;
+				return count;
+			}
+			acc >>= 1;
+			bits--;
+			count++;
+		}
+		return count;
+	}
+	// True once more bits were consumed than the payload holds
+	bool overrun() const
+	{
+		return pos * 8 - bits > size * 8;
+	}
+
+private:
+	void refill()
+	{
+		while (bits <= 56)
+		{
+			uint64_t byte = pos < size ? data[pos] : 0;
+			acc |= byte << bits;
+			pos++;
+			bits += 8;
+		}
+	}
+
+	const uint8_t* data;
+	size_t size;
+	size_t pos;
+	uint64_t acc;
+	unsigned int bits;
+};
+
+// Prediction for pixel i: the same pixel of the previous frame, or for
+// keyframes the left neighbour (upper neighbour in the first column)
+inline int32_t predict(const uint16_t* current, const uint16_t* previous, size_t i, unsigned int width)
+{
+	if (previous)
+		return previous[i];
+	if (i % width != 0)
+		return current[i - 1];
+	return i >= width ? current[i - width] : 0;
+}
+
+void encodeDepth(const uint16_t* depth, const uint16_t* previous, unsigned int width, size_t numPixels, std::vector<uint8_t>& out)
+{
+	out.clear();
+	BitWriter writer(out);
+	RiceContext ctx;
+	for (size_t i = 0; i < numPixels; i++)
+	{
+		uint32_t value = zigzag(static_cast<int32_t>(depth[i]) - predict(depth, previous, i, width));
+		unsigned int k = ctx.k();
+		uint32_t q = value >> k;
+		if (q < RICE_ESCAPE)
+		{
+			writer.putOnes(q);
+			writer.put(0, 1);
+			writer.put(value & ((1u << k) - 1), k);
+		}
+		else
+		{
+			writer.putOnes(RICE_ESCAPE);
+			writer.put(value, RICE_RAW_BITS);
+		}
+		ctx.update(value);
+	}
+	writer.flush();
+}
+
+bool decodeDepthPayload(const uint8_t* data, size_t bytes, const uint16_t* previous, unsigned int width, size_t numPixels, uint16_t* depth)
+{
+	BitReader reader(data, bytes);
+	RiceContext ctx;
+	for (size_t i = 0; i < numPixels; i++)
+	{
+		unsigned int k = ctx.k();
+		uint32_t q = reader.countOnes(RICE_ESCAPE);
+		uint32_t value = q < RICE_ESCAPE ? (q << k) | reader.get(k) : reader.get(RICE_RAW_BITS);
+		depth[i] = static_cast<uint16_t>(predict(depth, previous, i, width) + unzigzag(value));
+		ctx.update(value);
+	}
+	return !reader.overrun();
+}
+
+}
+
+//--------------------------------------------------------------
+DepthRecordingReader::DepthRecordingReader()
+:decodedFrame(-1)
+{
+	memset(&header, 0, sizeof(header));
+}
+
+bool DepthRecordingReader::open(const std::string& path)
+{
+	close();
+	if (!file.open(path))
+	{
+		ofLogError("DepthRecordingReader") << "open(): could not map " << path;
+		return false;
+	}
+	if (file.getSize() < sizeof(DepthRecordingHeader))
+	{
+		ofLogError("DepthRecordingReader") << "open(): " << path << " is too small to be a recording";
+		close();
+		return false;
+	}
+	memcpy(&header, file.getData(), sizeof(header));
+	if (memcmp(header.magic, DEPTH_RECORDING_MAGIC, sizeof(header.magic)) != 0 || header.version > DEPTH_RECORDING_VERSION)
+	{
+		ofLogError("DepthRecordingReader") << "open(): " << path << " is not a supported depth recording";
+		close();
+		return false;
+	}
+	if (header.codec != DEPTH_CODEC_RAW && header.codec != DEPTH_CODEC_DELTA_RICE)
+	{
+		ofLogError("DepthRecordingReader") << "open(): unknown codec " << header.codec;
+		close();
+		return false;
+	}
+
+	uint64_t indexBytes = static_cast<uint64_t>(header.frameCount) * sizeof(uint64_t);
+	if (header.indexOffset != 0 && header.indexOffset + indexBytes <= file.getSize())
+	{
+		frameOffsets.resize(header.frameCount);
+		if (indexBytes > 0)
+			memcpy(frameOffsets.data(), file.getData() + header.indexOffset, indexBytes);
+	}
+	else
+	{
+		ofLogWarning("DepthRecordingReader") << "open(): " << path << " was not closed properly, rebuilding index";
+		rebuildIndex();
+	}
+	ofLogVerbose("DepthRecordingReader") << "open(): " << path << " " << header.width << "x" << header.height << ", " << frameOffsets.size() << " frames";
+	return true;
+}
+
+void DepthRecordingReader::close()
+{
+	file.close();
+	frameOffsets.clear();
+	decodedFrame = -1;
+}
+
+bool DepthRecordingReader::rebuildIndex()
+{
+	frameOffsets.clear();
+	uint64_t pos = sizeof(DepthRecordingHeader);
+	while (pos + sizeof(DepthFrameHeader) <= file.getSize())
+	{
+		DepthFrameHeader fh;
+		memcpy(&fh, file.getData() + pos, sizeof(fh));
+		uint64_t end = pos + sizeof(fh) + fh.depthBytes + fh.colorBytes;
+		if (end > file.getSize())
+			break; // Truncated last frame
+		frameOffsets.push_back(pos);
+		pos = end;
+	}
+	return !frameOffsets.empty();
+}
+
+DepthFrameHeader DepthRecordingReader::getFrameHeader(size_t frame) const
+{
+	DepthFrameHeader fh;
+	memcpy(&fh, file.getData() + frameOffsets[frame], sizeof(fh));
+	return fh;
+}
+
+uint64_t DepthRecordingReader::getTimestamp(size_t frame) const
+{
+	if (frame >= frameOffsets.size())
+		return 0;
+	return getFrameHeader(frame).timestamp;
+}
+
+bool DepthRecordingReader::decodeDepth(size_t frame, const uint16_t* previous, uint16_t* depth)
+{
+	DepthFrameHeader fh = getFrameHeader(frame);
+	const uint8_t* payload = file.getData() + frameOffsets[frame] + sizeof(fh);
+	size_t numPixels = static_cast<size_t>(header.width) * header.height;
+	if (header.codec == DEPTH_CODEC_RAW)
+	{
+		if (fh.depthBytes != numPixels * sizeof(uint16_t))
+			return false;
+		memcpy(depth, payload, fh.depthBytes);
+		return true;
+	}
+	if (fh.frameFlags & DEPTH_FRAME_KEYFRAME)
+		previous = nullptr;
+	else if (!previous)
+		return false;
+	return decodeDepthPayload(payload, fh.depthBytes, previous, header.width, numPixels, depth);
+}
+
+bool DepthRecordingReader::readFrame(size_t frame, uint16_t* depth, uint8_t* color)
+{
+	if (frame >= frameOffsets.size())
+		return false;
+	size_t numPixels = static_cast<size_t>(header.width) * header.height;
+
+	if (header.codec == DEPTH_CODEC_RAW)
+	{
+		if (!decodeDepth(frame, nullptr, depth))
+			return false;
+	}
+	else
+	{
+		// Decode forward from the closest keyframe, or from the last decoded frame if that is closer
+		size_t start = frame;
+		while (start > 0 && !(getFrameHeader(start).frameFlags & DEPTH_FRAME_KEYFRAME))
+			start--;
+		if (decodedFrame != static_cast<long long>(frame))
+		{
+			bool continuing = decodedFrame >= static_cast<long long>(start) && decodedFrame < static_cast<long long>(frame);
+			size_t f = continuing ? static_cast<size_t>(decodedFrame + 1) : start;
+			decodedDepth.resize(numPixels);
+			scratchDepth.resize(numPixels);
+			decodedFrame = -1;
+			for (; f <= frame; f++)
+			{
+				const uint16_t* previous = (f == start && !continuing) ? nullptr : decodedDepth.data();
+				if (!decodeDepth(f, previous, scratchDepth.data()))
+					return false;
+				decodedDepth.swap(scratchDepth);
+			}
+			decodedFrame = frame;
+		}
+		memcpy(depth, decodedDepth.data(), numPixels * sizeof(uint16_t));
+	}
+
+	if (!color)
+		return true;
+	// Colour is not stored on every frame; use the most recent one, at worst from the keyframe
+	for (size_t f = frame + 1; f-- > 0;)
+	{
+		DepthFrameHeader fh = getFrameHeader(f);
+		if (fh.colorBytes == numPixels * 3)
+		{
+			memcpy(color, file.getData() + frameOffsets[f] + sizeof(fh) + fh.depthBytes, fh.colorBytes);
+			break;
+		}
+		if (fh.frameFlags & DEPTH_FRAME_KEYFRAME)
+			break;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------
+DepthRecordingWriter::DepthRecordingWriter()
+:file(nullptr),
+offset(0),
+keyframeInterval(30),
+colorInterval(1)
+{
+	memset(&header, 0, sizeof(header));
+}
+
+DepthRecordingWriter::~DepthRecordingWriter()
+{
+	close();
+}
+
+bool DepthRecordingWriter::open(const std::string& path, unsigned int width, unsigned int height, bool withColor,
+	float worldScaleX, float worldScaleY, float worldOffsetX, float worldOffsetY,
+	DepthRecordingCodec codec, int skeyframeInterval, int scolorInterval)
+{
+	close();
+	file = fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		ofLogError("DepthRecordingWriter") << "open(): could not create " << path;
+		return false;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DEPTH_RECORDING_MAGIC, sizeof(header.magic));
+	header.version = DEPTH_RECORDING_VERSION;
+	header.width = width;
+	header.height = height;
+	header.flags = withColor ? DEPTH_RECORDING_HAS_COLOR : 0;
+	header.codec = codec;
+	header.worldScaleX = worldScaleX;
+	header.worldScaleY = worldScaleY;
+	header.worldOffsetX = worldOffsetX;
+	header.worldOffsetY = worldOffsetY;
+	frameOffsets.clear();
+	keyframeInterval = std::max(skeyframeInterval, 1);
+	colorInterval = std::max(scolorInterval, 1);
+	previousDepth.assign(static_cast<size_t>(width) * height, 0);
+
+	offset = fwrite(&header, 1, sizeof(header), file);
+	return offset == sizeof(header);
+}
+
+bool DepthRecordingWriter::writeFrame(uint64_t timestamp, const uint16_t* depth, const uint8_t* color)
+{
+	if (!file)
+		return false;
+	size_t numPixels = static_cast<size_t>(header.width) * header.height;
+	size_t frame = frameOffsets.size();
+	bool keyframe = frame % keyframeInterval == 0;
+	bool writeColor = color && storesColor(frame);
+
+	const void* depthPayload = depth;
+	DepthFrameHeader fh;
+	memset(&fh, 0, sizeof(fh));
+	fh.timestamp = timestamp;
+	fh.depthBytes = numPixels * sizeof(uint16_t);
+	fh.colorBytes = writeColor ? numPixels * 3 : 0;
+	fh.frameFlags = keyframe ? DEPTH_FRAME_KEYFRAME : 0;
+	if (header.codec == DEPTH_CODEC_DELTA_RICE)
+	{
+		encodeDepth(depth, keyframe ? nullptr : previousDepth.data(), header.width, numPixels, encoded);
+		memcpy(previousDepth.data(), depth, numPixels * sizeof(uint16_t));
+		depthPayload = encoded.data();
+		fh.depthBytes = encoded.size();
+	}
+
+	size_t written = fwrite(&fh, 1, sizeof(fh), file);
+	written += fwrite(depthPayload, 1, fh.depthBytes, file);
+	if (writeColor)
+		written += fwrite(color, 1, fh.colorBytes, file);
+	if (written != sizeof(fh) + fh.depthBytes + fh.colorBytes)
+	{
+		ofLogError("DepthRecordingWriter") << "writeFrame(): write failed, disk full?";
+		return false;
+	}
+	frameOffsets.push_back(offset);
+	offset += written;
+	return true;
+}
+
+void DepthRecordingWriter::close()
+{
+	if (!file)
+		return;
+	header.frameCount = frameOffsets.size();
+	header.indexOffset = offset;
+	if (!frameOffsets.empty())
+		fwrite(frameOffsets.data(), sizeof(uint64_t), frameOffsets.size(), file);
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, 1, sizeof(header), file);
+	fclose(file);
+	file = nullptr;
+	ofLogVerbose("DepthRecordingWriter") << "close(): wrote " << header.frameCount << " frames";
+}
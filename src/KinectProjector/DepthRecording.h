@@ -0,0 +1,208 @@
+/***********************************************************************
+DepthRecording - File format, reader and writer for recorded sessions
+of raw Kinect depth (and optionally colour) frames.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Layout of a recording file (all values little endian):
+//
+//   DepthRecordingHeader
+//   frame 0: DepthFrameHeader, depth payload, colour payload
+//   frame 1: ...
+//   index:   frameCount x uint64 file offsets of the frame headers
+//
+// Frames are only ever appended. The index and the final frame count are
+// written when the recording is closed; a recording that was not closed
+// properly (crash, power loss) is recovered by scanning the frame headers.
+//
+// With DEPTH_CODEC_DELTA_RICE the depth of a keyframe is predicted from its
+// left (or upper) neighbour and the depth of the other frames from the same
+// pixel in the previous frame. The prediction residuals are Rice coded with
+// a per pixel adaptive parameter. Seeking decodes at most keyframeInterval
+// frames from the closest keyframe. Colour is stored uncompressed, on
+// keyframes and every colorInterval frames.
+
+static const char DEPTH_RECORDING_MAGIC[8] = { 'M', 'S', 'D', 'E', 'P', 'T', 'H', '\0' };
+static const uint32_t DEPTH_RECORDING_VERSION = 1;
+
+enum DepthRecordingCodec
+{
+	DEPTH_CODEC_RAW = 0, // uncompressed uint16 depth and 8 bit RGB
+	DEPTH_CODEC_DELTA_RICE = 1 // temporal delta + Rice coded depth, 8 bit RGB
+};
+
+enum DepthRecordingFlags
+{
+	DEPTH_RECORDING_HAS_COLOR = 1
+};
+
+enum DepthFrameFlags
+{
+	DEPTH_FRAME_KEYFRAME = 1
+};
+
+#pragma pack(push, 1)
+struct DepthRecordingHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t flags;
+	uint32_t codec;
+	float worldScaleX, worldScaleY; // Kinect intrinsics, see KinectGrabber::getWorldMatrix()
+	float worldOffsetX, worldOffsetY;
+	uint32_t frameCount; // Only valid once indexOffset is set
+	uint64_t indexOffset; // 0 while the recording is still open
+	uint8_t reserved[12];
+};
+
+struct DepthFrameHeader
+{
+	uint64_t timestamp; // Microseconds since the start of the recording
+	uint32_t depthBytes;
+	uint32_t colorBytes;
+	uint32_t frameFlags;
+	uint32_t reserved;
+};
+#pragma pack(pop)
+
+// Read only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const std::string& path);
+	void close();
+
+	bool isOpen() const {
+		return data != nullptr;
+	}
+	const uint8_t* getData() const {
+		return data;
+	}
+	uint64_t getSize() const {
+		return size;
+	}
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const uint8_t* data;
+	uint64_t size;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#else
+	int fd;
+#endif
+};
+
+class DepthRecordingReader {
+public:
+	DepthRecordingReader();
+
+	bool open(const std::string& path);
+	void close();
+	bool isOpen() const {
+		return file.isOpen();
+	}
+
+	const DepthRecordingHeader& getHeader() const {
+		return header;
+	}
+	unsigned int getWidth() const {
+		return header.width;
+	}
+	unsigned int getHeight() const {
+		return header.height;
+	}
+	bool hasColor() const {
+		return (header.flags & DEPTH_RECORDING_HAS_COLOR) != 0;
+	}
+	size_t getNumFrames() const {
+		return frameOffsets.size();
+	}
+	uint64_t getTimestamp(size_t frame) const;
+
+	// Decode frame number "frame" into depth (width*height values) and,
+	// if color is not null and the recording has colour, into color (width*height*3 bytes)
+	bool readFrame(size_t frame, uint16_t* depth, uint8_t* color);
+
+private:
+	bool rebuildIndex();
+	bool decodeDepth(size_t frame, const uint16_t* previous, uint16_t* depth);
+	DepthFrameHeader getFrameHeader(size_t frame) const;
+
+	MappedFile file;
+	DepthRecordingHeader header;
+	std::vector<uint64_t> frameOffsets;
+
+	// Last decoded frame, so sequential reading decodes one frame at a time
+	std::vector<uint16_t> decodedDepth;
+	std::vector<uint16_t> scratchDepth;
+	long long decodedFrame;
+};
+
+class DepthRecordingWriter {
+public:
+	DepthRecordingWriter();
+	~DepthRecordingWriter();
+
+	bool open(const std::string& path, unsigned int width, unsigned int height, bool withColor,
+		float worldScaleX, float worldScaleY, float worldOffsetX, float worldOffsetY,
+		DepthRecordingCodec codec = DEPTH_CODEC_DELTA_RICE, int keyframeInterval = 30, int colorInterval = 1);
+	// Append a frame. color may be null, it is ignored when the recording was opened without colour
+	bool writeFrame(uint64_t timestamp, const uint16_t* depth, const uint8_t* color);
+	// Write the index and the final header
+	void close();
+
+	bool isOpen() const {
+		return file != nullptr;
+	}
+	size_t getNumFrames() const {
+		return frameOffsets.size();
+	}
+	uint64_t getBytesWritten() const {
+		return offset;
+	}
+	// Whether the frame with this index is stored with its colour
+	bool storesColor(size_t frame) const {
+		return (header.flags & DEPTH_RECORDING_HAS_COLOR) && (frame % keyframeInterval == 0 || frame % colorInterval == 0);
+	}
+
+private:
+	FILE* file;
+	DepthRecordingHeader header;
+	std::vector<uint64_t> frameOffsets;
+	uint64_t offset;
+	int keyframeInterval;
+	int colorInterval;
+
+	std::vector<uint16_t> previousDepth;
+	std::vector<uint8_t> encoded; // Reused between frames
+};
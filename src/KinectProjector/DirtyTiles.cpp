@@ -0,0 +1,152 @@
+/***********************************************************************
+DirtyTiles - Bitmap of the 16x16 pixel tiles of the filtered depth
+frame that changed since the previous frame.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DirtyTiles.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+int popCount(uint64_t word)
+{
+	int n = 0;
+	for (; word; n++)
+		word &= word - 1;
+	return n;
+}
+
+}
+
+DirtyTiles::DirtyTiles()
+:numTilesX(0),
+numTilesY(0),
+wordsPerRow(0)
+{
+}
+
+void DirtyTiles::resize(int width, int height)
+{
+	numTilesX = (width + tileSize - 1) / tileSize;
+	numTilesY = (height + tileSize - 1) / tileSize;
+	wordsPerRow = (numTilesX + 63) / 64;
+	bits.assign(wordsPerRow * numTilesY, 0);
+}
+
+void DirtyTiles::clear()
+{
+	std::fill(bits.begin(), bits.end(), 0);
+}
+
+void DirtyTiles::setAll()
+{
+	// Only the bits of existing tiles, so count() stays exact
+	for (int tileY = 0; tileY < numTilesY; tileY++)
+		for (int word = 0; word < wordsPerRow; word++)
+		{
+			int numBits = std::min(64, numTilesX - word * 64);
+			bits[tileY * wordsPerRow + word] = numBits == 64 ? ~uint64_t(0) : (uint64_t(1) << numBits) - 1;
+		}
+}
+
+bool DirtyTiles::isDirty(int x0, int y0, int x1, int y1) const
+{
+	int tileX0 = std::max(x0, 0) / tileSize;
+	int tileY0 = std::max(y0, 0) / tileSize;
+	int tileX1 = std::min((x1 + tileSize - 1) / tileSize, numTilesX);
+	int tileY1 = std::min((y1 + tileSize - 1) / tileSize, numTilesY);
+	for (int tileY = tileY0; tileY < tileY1; tileY++)
+		for (int tileX = tileX0; tileX < tileX1; tileX++)
+			if (isDirty(tileX, tileY))
+				return true;
+	return false;
+}
+
+bool DirtyTiles::any() const
+{
+	for (size_t i = 0; i < bits.size(); i++)
+		if (bits[i])
+			return true;
+	return false;
+}
+
+int DirtyTiles::count() const
+{
+	int n = 0;
+	for (size_t i = 0; i < bits.size(); i++)
+		n += popCount(bits[i]);
+	return n;
+}
+
+void DirtyTiles::merge(const DirtyTiles& other)
+{
+	if (other.bits.size() != bits.size())
+	{
+		setAll();
+		return;
+	}
+	for (size_t i = 0; i < bits.size(); i++)
+		bits[i] |= other.bits[i];
+}
+
+void DirtyTiles::upscale(const DirtyTiles& coarse, int factor)
+{
+	clear();
+	for (int tileY = 0; tileY < numTilesY; tileY++)
+	{
+		int y0 = tileY * tileSize / factor - 1;
+		int y1 = ((tileY + 1) * tileSize + factor - 1) / factor + 1;
+		for (int tileX = 0; tileX < numTilesX; tileX++)
+		{
+			int x0 = tileX * tileSize / factor - 1;
+			int x1 = ((tileX + 1) * tileSize + factor - 1) / factor + 1;
+			if (coarse.isDirty(x0, y0, x1, y1))
+				set(tileX, tileY);
+		}
+	}
+}
+
+void DirtyTiles::detectRow(int tileY, const float* frame, float* reference, int stride, int minX, int minY, int maxX, int maxY)
+{
+	int y0 = std::max(tileY * tileSize, minY);
+	int y1 = std::min((tileY + 1) * tileSize, maxY);
+	for (int tileX = minX / tileSize; tileX * tileSize < maxX; tileX++)
+	{
+		int x0 = std::max(tileX * tileSize, minX);
+		size_t rowBytes = (std::min((tileX + 1) * tileSize, maxX) - x0) * sizeof(float);
+		// Compared bitwise: a pixel that stays NaN or 0 is unchanged
+		int y = y0;
+		while (y < y1 && memcmp(frame + y * stride + x0, reference + y * stride + x0, rowBytes) == 0)
+			y++;
+		if (y == y1)
+			continue;
+		set(tileX, tileY);
+		for (; y < y1; y++)
+			memcpy(reference + y * stride + x0, frame + y * stride + x0, rowBytes);
+	}
+}
+
+int DirtyTiles::countTiles(int minX, int minY, int maxX, int maxY)
+{
+	if (maxX <= minX || maxY <= minY)
+		return 0;
+	return ((maxX - 1) / tileSize - minX / tileSize + 1) * ((maxY - 1) / tileSize - minY / tileSize + 1);
+}
@@ -0,0 +1,76 @@
+/***********************************************************************
+DirtyTiles - Bitmap of the 16x16 pixel tiles of the filtered depth
+frame that changed since the previous frame.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// One bit per tile, each row of tiles starting on a new word so rows can
+// be marked from different threads. Copying a map into one of the same
+// size does not allocate.
+class DirtyTiles {
+public:
+	static const int tileSize = 16; // Pixels
+
+	DirtyTiles();
+
+	// Cover a width x height frame, with all tiles clean
+	void resize(int width, int height);
+	void clear();
+	void setAll();
+	void set(int tileX, int tileY) {
+		bits[tileY * wordsPerRow + tileX / 64] |= uint64_t(1) << (tileX % 64);
+	}
+	bool isDirty(int tileX, int tileY) const {
+		return (bits[tileY * wordsPerRow + tileX / 64] >> (tileX % 64)) & 1;
+	}
+	// Any tile overlapping the pixels [x0, x1) x [y0, y1)
+	bool isDirty(int x0, int y0, int x1, int y1) const;
+	bool any() const;
+	int count() const;
+	// Add the dirty tiles of a map of the same size
+	void merge(const DirtyTiles& other);
+	// Mark the tiles of a frame factor times larger than the one of coarse
+	// that an upsampling of it changes: those reaching to within a coarse
+	// pixel of one of its dirty tiles
+	void upscale(const DirtyTiles& coarse, int factor);
+
+	// Compare the pixels of the tile row tileY inside [minX, maxX) x [minY, maxY)
+	// of frame with reference (both stride floats per row). Changed tiles are
+	// marked and copied into reference
+	void detectRow(int tileY, const float* frame, float* reference, int stride, int minX, int minY, int maxX, int maxY);
+
+	int getNumTilesX() const {
+		return numTilesX;
+	}
+	int getNumTilesY() const {
+		return numTilesY;
+	}
+	// Tiles overlapping [minX, maxX) x [minY, maxY)
+	static int countTiles(int minX, int minY, int maxX, int maxY);
+
+private:
+	int numTilesX;
+	int numTilesY;
+	int wordsPerRow;
+	std::vector<uint64_t> bits;
+};
@@ -0,0 +1,177 @@
+/***********************************************************************
+ElevationMap - Elevation above the base plane of every pixel of the
+filtered depth frame, updated in the tiles that changed.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+
+#include "ElevationMap.h"
+#include <algorithm>
+
+#ifdef DEPTH_FILTER_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+void elevationRowScalar(const float* coefficients, const float* depth, float offset, float* elevations, int numPixels, int i)
+{
+	for (; i < numPixels; i++)
+		elevations[i] = coefficients[i] * depth[i] + offset;
+}
+
+#ifdef DEPTH_FILTER_X86
+
+// A multiplication and an addition, never fused, like the scalar code
+DEPTH_FILTER_TARGET("sse4.1")
+void elevationRowSSE41(const float* coefficients, const float* depth, float offset, float* elevations, int numPixels)
+{
+	const __m128 o = _mm_set1_ps(offset);
+	int i = 0;
+	for (; i + 4 <= numPixels; i += 4)
+		_mm_storeu_ps(elevations + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(coefficients + i), _mm_loadu_ps(depth + i)), o));
+	elevationRowScalar(coefficients, depth, offset, elevations, numPixels, i);
+}
+
+DEPTH_FILTER_TARGET("avx2")
+void elevationRowAVX2(const float* coefficients, const float* depth, float offset, float* elevations, int numPixels)
+{
+	const __m256 o = _mm256_set1_ps(offset);
+	int i = 0;
+	for (; i + 8 <= numPixels; i += 8)
+		_mm256_storeu_ps(elevations + i, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(coefficients + i), _mm256_loadu_ps(depth + i)), o));
+	elevationRowScalar(coefficients, depth, offset, elevations, numPixels, i);
+}
+
+#endif
+
+void elevationRow(DepthFilterKernel kernel, const float* coefficients, const float* depth, float offset, float* elevations, int numPixels)
+{
+#ifdef DEPTH_FILTER_X86
+	if (kernel == DEPTH_FILTER_KERNEL_AVX2)
+	{
+		elevationRowAVX2(coefficients, depth, offset, elevations, numPixels);
+		return;
+	}
+	if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+	{
+		elevationRowSSE41(coefficients, depth, offset, elevations, numPixels);
+		return;
+	}
+#endif
+	elevationRowScalar(coefficients, depth, offset, elevations, numPixels, 0);
+}
+
+}
+
+ElevationMap::ElevationMap()
+:width(0),
+height(0),
+offset(0),
+outdated(true),
+planeEq(0, 0, 0, 0),
+minX(0),
+minY(0),
+maxX(0),
+maxY(0),
+version(0)
+{
+}
+
+void ElevationMap::invalidate(const DirtyTiles& changed)
+{
+	dirty.merge(changed);
+}
+
+void ElevationMap::invalidateAll()
+{
+	outdated = true;
+}
+
+bool ElevationMap::update(const float* depth, const KinectRayTable& rays, const ofVec4f& basePlaneEq, const ofRectangle& ROI, DepthFilterKernel kernel)
+{
+	if (width != rays.getWidth() || height != rays.getHeight())
+	{
+		width = rays.getWidth();
+		height = rays.getHeight();
+		coefficients.resize(width * height);
+		elevations.resize(width * height);
+		dirty.resize(width, height);
+		outdated = true;
+	}
+	bool refill = outdated || basePlaneEq != planeEq;
+	if (refill)
+	{
+		planeEq = basePlaneEq;
+		offset = -planeEq.w;
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				ofVec3f ray = rays.getRay(x, y);
+				coefficients[y * width + x] = -(planeEq.x * ray.x + planeEq.y * ray.y + planeEq.z * ray.z);
+			}
+		}
+		outdated = false;
+	}
+	int roiMinX = std::max(static_cast<int>(ROI.getLeft()), 0);
+	int roiMinY = std::max(static_cast<int>(ROI.getTop()), 0);
+	int roiMaxX = std::min(static_cast<int>(ROI.getRight()), width);
+	int roiMaxY = std::min(static_cast<int>(ROI.getBottom()), height);
+	if (refill || roiMinX != minX || roiMinY != minY || roiMaxX != maxX || roiMaxY != maxY)
+	{
+		minX = roiMinX;
+		minY = roiMinY;
+		maxX = roiMaxX;
+		maxY = roiMaxY;
+		std::fill(elevations.begin(), elevations.end(), offset);
+		dirty.setAll();
+	}
+	if (!dirty.any())
+		return false;
+
+	// Runs of dirty tiles along each row of tiles, clipped to the ROI
+	for (int tileY = 0; tileY < dirty.getNumTilesY(); tileY++)
+	{
+		int y0 = std::max(tileY * DirtyTiles::tileSize, minY);
+		int y1 = std::min((tileY + 1) * DirtyTiles::tileSize, maxY);
+		int tileX = 0;
+		while (y0 < y1 && tileX < dirty.getNumTilesX())
+		{
+			if (!dirty.isDirty(tileX, tileY))
+			{
+				tileX++;
+				continue;
+			}
+			int runStart = tileX;
+			while (tileX < dirty.getNumTilesX() && dirty.isDirty(tileX, tileY))
+				tileX++;
+			int x0 = std::max(runStart * DirtyTiles::tileSize, minX);
+			int x1 = std::min(tileX * DirtyTiles::tileSize, maxX);
+			for (int y = y0; y < y1 && x0 < x1; y++)
+			{
+				int idx = y * width + x0;
+				elevationRow(kernel, &coefficients[idx], depth + idx, offset, &elevations[idx], x1 - x0);
+			}
+		}
+	}
+	dirty.clear();
+	version++;
+	return true;
+}
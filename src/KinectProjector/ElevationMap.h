@@ -0,0 +1,78 @@
+/***********************************************************************
+ElevationMap - Elevation above the base plane of every pixel of the
+filtered depth frame, updated in the tiles that changed.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "DirtyTiles.h"
+#include "KinectRayTable.h"
+
+// The elevation of a pixel is linear in its depth: with the world point
+// ray * depth it is -(plane.xyz . ray) * depth - plane.w. The coefficients
+// are computed when the base plane or the rays change, a frame then costs
+// one multiplication and one addition per pixel, only in the tiles of the
+// ROI that changed. Outside the ROI, where the grabber leaves no depth, the
+// elevation is that of depth 0. The SIMD rows give the same floats as the
+// scalar one.
+class ElevationMap {
+public:
+	ElevationMap();
+
+	// The depth of these tiles changed since the last update()
+	void invalidate(const DirtyTiles& changed);
+	// The rays changed, recompute everything
+	void invalidateAll();
+	// Bring the map up to date with the depth frame (of the ray table size),
+	// the base plane and the ROI in kinect pixels. Everything is recomputed
+	// when the plane, the rays or the ROI changed, else only the invalidated
+	// tiles. Returns whether an elevation may have changed
+	bool update(const float* depth, const KinectRayTable& rays, const ofVec4f& basePlaneEq, const ofRectangle& ROI,
+		DepthFilterKernel kernel = getBestDepthFilterKernel());
+
+	// Increases with every update() that changed the map, so consumers can
+	// tell whether what they derived from it is still current
+	uint64_t getVersion() const {
+		return version;
+	}
+	int getWidth() const {
+		return width;
+	}
+	int getHeight() const {
+		return height;
+	}
+	const float* getData() const { // Row major, width x height
+		return elevations.data();
+	}
+	float at(int x, int y) const {
+		return elevations[y * width + x];
+	}
+
+private:
+	int width, height;
+	std::vector<float> coefficients; // Elevation per unit of depth of each pixel
+	float offset; // Elevation at depth 0
+	std::vector<float> elevations;
+	DirtyTiles dirty; // Tiles to recompute
+	bool outdated; // Recompute the coefficients and all tiles
+	ofVec4f planeEq; // Of the coefficients
+	int minX, minY, maxX, maxY; // ROI of the elevations
+	uint64_t version;
+};
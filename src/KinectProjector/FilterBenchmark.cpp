@@ -0,0 +1,544 @@
+/***********************************************************************
+FilterBenchmark - Headless timing of the KinectGrabber depth filtering
+stages over synthetic or recorded frames.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FilterBenchmark.h"
+#include "KinectRayTable.h"
+#include "ElevationMap.h"
+#include "LandMask.h"
+#include "PlaneMoments.h"
+#include "RansacPlaneFit.h"
+#include <chrono>
+#include <random>
+
+namespace {
+
+// Sand bed at about the default base plane distance with a few hills,
+// sensor noise, missing pixels and a hand moving over the sand now and then
+class SyntheticFrameSource: public FrameSource {
+public:
+	SyntheticFrameSource()
+	:width(640),
+	height(480),
+	frameNumber(0),
+	rng(1234)
+	{
+	}
+
+	void setup() override {
+		depth.allocate(width, height, 1);
+		color.allocate(width, height, 3);
+		color.set(0);
+	}
+	bool open() override {
+		return true;
+	}
+	void close() override {
+	}
+	bool isOpen() override {
+		return true;
+	}
+
+	void update() override {
+		std::uniform_int_distribution<int> noise(-3, 3);
+		std::uniform_int_distribution<int> hole(0, 99);
+		float handX = (frameNumber % 64) * width / 32.0f - width / 2;
+		bool handVisible = (frameNumber % 64) >= 16 && (frameNumber % 64) < 48;
+
+		unsigned short* ptr = depth.getData();
+		for (unsigned int y = 0; y < height; y++)
+		{
+			for (unsigned int x = 0; x < width; x++, ptr++)
+			{
+				float dx1 = x - width * 0.3f, dy1 = y - height * 0.4f;
+				float dx2 = x - width * 0.7f, dy2 = y - height * 0.6f;
+				float surface = 870 - 80 * exp(-(dx1*dx1 + dy1*dy1) / 5000.0f) + 60 * exp(-(dx2*dx2 + dy2*dy2) / 8000.0f);
+				if (handVisible && abs(x - handX) < 40 && y > height / 2)
+					surface = 650;
+				int value = static_cast<int>(surface) + noise(rng);
+				if (hole(rng) == 0)
+					value = 0;
+				*ptr = static_cast<unsigned short>(value);
+			}
+		}
+		frameNumber++;
+	}
+	bool isFrameNew() override {
+		return true;
+	}
+	uint64_t getWaitTime() override {
+		return 0;
+	}
+
+	unsigned int getWidth() override {
+		return width;
+	}
+	unsigned int getHeight() override {
+		return height;
+	}
+	const ofShortPixels& getRawDepthPixels() override {
+		return depth;
+	}
+	const ofPixels& getPixels() override {
+		return color;
+	}
+	uint64_t getTimestamp() override {
+		return frameNumber * 33333;
+	}
+	ofVec3f getWorldCoordinateAt(int x, int y, float z) override {
+		return ofVec3f((x - 320.0f) * 0.0017f * z, (y - 240.0f) * 0.0017f * z, z);
+	}
+
+private:
+	unsigned int width, height;
+	int frameNumber;
+	std::mt19937 rng;
+	ofShortPixels depth;
+	ofPixels color;
+};
+
+}
+
+//--------------------------------------------------------------
+FilterBenchmark::FilterBenchmark()
+:outputFile("benchmark.json"),
+numFrames(200),
+numWarmupFrames(20),
+quick(false),
+verify(false),
+storage(DEPTH_FILTER_STORAGE_FLOAT),
+modes({ DEPTH_FILTER_MODE_AVERAGING, DEPTH_FILTER_MODE_RECURSIVE })
+{
+}
+
+int FilterBenchmark::run(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--recording" && i + 1 < argc)
+			recordingFile = argv[++i];
+		else if (arg == "--frames" && i + 1 < argc)
+			numFrames = std::max(1, atoi(argv[++i]));
+		else if (arg == "--output" && i + 1 < argc)
+			outputFile = argv[++i];
+		else if (arg == "--quick")
+			quick = true;
+		else if (arg == "--threads" && i + 1 < argc)
+			grabber.setNumFilterThreads(atoi(argv[++i]));
+		else if (arg == "--verify")
+			verify = true;
+		else if (arg == "--radius" && i + 1 < argc)
+			grabber.setSpatialFilterRadius(static_cast<float>(atof(argv[++i])));
+		else if (arg == "--huge-pages")
+			grabber.setHugePages(true);
+		else if (arg == "--decimation" && i + 1 < argc)
+			grabber.setDecimation(atoi(argv[++i]));
+		else if (arg == "--storage" && i + 1 < argc)
+			storage = std::string(argv[++i]) == getDepthFilterStorageName(DEPTH_FILTER_STORAGE_FIXED) ? DEPTH_FILTER_STORAGE_FIXED : DEPTH_FILTER_STORAGE_FLOAT;
+		else if (arg == "--mode" && i + 1 < argc)
+			modes.assign(1, std::string(argv[++i]) == getDepthFilterModeName(DEPTH_FILTER_MODE_RECURSIVE) ? DEPTH_FILTER_MODE_RECURSIVE : DEPTH_FILTER_MODE_AVERAGING);
+		else if (arg == "--kernel" && i + 1 < argc)
+		{
+			std::string name = argv[++i];
+			for (int k = DEPTH_FILTER_KERNEL_SCALAR; k <= DEPTH_FILTER_KERNEL_AVX2; k++)
+				if (name == getDepthFilterKernelName(static_cast<DepthFilterKernel>(k)))
+					grabber.setFilterKernel(static_cast<DepthFilterKernel>(k));
+		}
+	}
+
+	if (!loadFrames())
+		return 1;
+	if (verify)
+		return verifyFilters() ? 0 : 1;
+	cout << "Filter kernel: " << getDepthFilterKernelName(grabber.getFilterKernel()) << ", threads: " << grabber.getNumFilterThreads()
+		<< ", storage: " << getDepthFilterStorageName(storage) << ", spatial filter radius: " << grabber.getSpatialFilterRadius()
+		<< ", decimation: " << grabber.getDecimation() << endl;
+
+	std::vector<Configuration> configs = buildConfigurations();
+	for (size_t i = 0; i < configs.size(); i++)
+	{
+		results.push_back(runConfiguration(configs[i]));
+		const Result& r = results.back();
+		cout << "[" << i + 1 << "/" << configs.size() << "] " << getDepthFilterModeName(r.config.mode) << " ROI " << r.config.ROI.getWidth() << "x" << r.config.ROI.getHeight()
+			<< " slots " << r.config.numAveragingSlots << " spatial " << r.config.spatialFilter
+			<< " inpaint " << r.config.inpaint << " quick " << r.config.followBigChange
+			<< ": median " << r.total.median << " us, " << r.fps << " fps, " << 100 * r.dirtyFraction << " % dirty" << endl;
+	}
+
+	std::ofstream out(outputFile.c_str());
+	if (!out)
+	{
+		ofLogError("FilterBenchmark") << "run(): could not write " << outputFile;
+		return 1;
+	}
+	writeResults(out);
+	cout << "Results written to " << outputFile << endl;
+	return 0;
+}
+
+bool FilterBenchmark::loadFrames()
+{
+	std::shared_ptr<FrameSource> source;
+	if (recordingFile.empty())
+		source = std::make_shared<SyntheticFrameSource>();
+	else
+		source = std::make_shared<RecordedFrameSource>(recordingFile, RecordedFrameSource::PLAYBACK_FULL_SPEED);
+
+	grabber.setFrameSource(source);
+	if (!grabber.setup())
+	{
+		ofLogError("FilterBenchmark") << "loadFrames(): could not open " << (recordingFile.empty() ? "synthetic frames" : recordingFile);
+		return false;
+	}
+
+	// Keep the frames in memory so decoding a recording is not part of the timings
+	size_t maxFrames = std::min(numFrames + numWarmupFrames, 300);
+	if (!recordingFile.empty())
+		maxFrames = std::min(maxFrames, std::static_pointer_cast<RecordedFrameSource>(source)->getNumFrames());
+	while (frames.size() < maxFrames)
+	{
+		source->update();
+		if (source->isFrameNew())
+			frames.push_back(source->getRawDepthPixels());
+	}
+	return !frames.empty();
+}
+
+std::vector<FilterBenchmark::Configuration> FilterBenchmark::buildConfigurations()
+{
+	ofVec2f size = grabber.getKinectSize();
+	std::vector<float> roiScales = { 1.0f, 0.75f, 0.5f, 0.25f };
+	std::vector<int> slots = { 1, 4, 15, 40 };
+	std::vector<int> flagSets = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	if (quick)
+	{
+		roiScales = { 1.0f, 0.5f };
+		slots = { 1, 15 };
+		flagSets = { 0, 7 };
+	}
+
+	std::vector<Configuration> configs;
+	for (DepthFilterMode mode : modes)
+	{
+		for (float scale : roiScales)
+		{
+			for (int slot : slots)
+			{
+				for (int flags : flagSets)
+				{
+					Configuration config;
+					config.mode = mode;
+					float w = size.x * scale;
+					float h = size.y * scale;
+					config.ROI = ofRectangle((size.x - w) / 2, (size.y - h) / 2, w, h);
+					config.numAveragingSlots = slot;
+					config.spatialFilter = (flags & 1) != 0;
+					config.inpaint = (flags & 2) != 0;
+					config.followBigChange = (flags & 4) != 0;
+					configs.push_back(config);
+				}
+			}
+		}
+	}
+	return configs;
+}
+
+FilterBenchmark::Result FilterBenchmark::runConfiguration(const Configuration& config)
+{
+	grabber.setupFramefilter(10, 570, config.ROI, config.spatialFilter, config.followBigChange, config.numAveragingSlots, storage, config.mode);
+	grabber.setInPainting(config.inpaint);
+
+	std::vector<double> filter, inpaint, spaceFilter, changes, gradient, upsample, total;
+	double inpaintedPixels = 0;
+	double dirtyFraction = 0;
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < numWarmupFrames + numFrames; i++)
+	{
+		if (i == numWarmupFrames)
+			start = Clock::now();
+		grabber.processFrame(frames[i % frames.size()]);
+		if (i < numWarmupFrames)
+			continue;
+		FilterStageTimings t = grabber.getStageTimings();
+		filter.push_back(t.filter);
+		inpaint.push_back(t.inpaint);
+		spaceFilter.push_back(t.spaceFilter);
+		changes.push_back(t.changes);
+		gradient.push_back(t.gradient);
+		upsample.push_back(t.upsample);
+		total.push_back(t.filter + t.inpaint + t.spaceFilter + t.changes + t.gradient + t.upsample);
+		FilterFrameMetrics m = grabber.getFrameMetrics();
+		inpaintedPixels += m.inpaintedLocal + m.inpaintedGlobal;
+		dirtyFraction += m.dirtyFraction;
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+	Result result;
+	result.config = config;
+	result.filter = computeStatistics(filter);
+	result.inpaint = computeStatistics(inpaint);
+	result.spaceFilter = computeStatistics(spaceFilter);
+	result.changes = computeStatistics(changes);
+	result.gradient = computeStatistics(gradient);
+	result.upsample = computeStatistics(upsample);
+	result.total = computeStatistics(total);
+	result.fps = elapsed > 0 ? numFrames / elapsed : 0;
+	result.inpaintedPixels = inpaintedPixels / numFrames;
+	result.dirtyFraction = dirtyFraction / numFrames;
+	return result;
+}
+
+bool FilterBenchmark::verifyFilters()
+{
+	ofVec2f size = grabber.getKinectSize();
+	std::vector<Configuration> configs(2);
+	configs[0].ROI = ofRectangle(0, 0, size.x, size.y);
+	configs[1].ROI = ofRectangle(37, 21, size.x / 2 + 3, size.y / 2 + 5); // Unaligned, odd widths
+	for (auto & config : configs)
+	{
+		config.numAveragingSlots = 15;
+		config.spatialFilter = true;
+		config.inpaint = true;
+		config.followBigChange = true;
+	}
+	std::vector<int> threadCounts = { 1, 2, 3, 4 };
+
+	// The single threaded scalar filter is the reference of each storage,
+	// mode and decimation. The recursive filter keeps float state whatever
+	// the storage
+	struct Variant {
+		DepthFilterStorage storage;
+		DepthFilterMode mode;
+		int decimation;
+		const char* name;
+	};
+	const Variant variants[] = {
+		{ DEPTH_FILTER_STORAGE_FLOAT, DEPTH_FILTER_MODE_AVERAGING, 1, getDepthFilterStorageName(DEPTH_FILTER_STORAGE_FLOAT) },
+		{ DEPTH_FILTER_STORAGE_FIXED, DEPTH_FILTER_MODE_AVERAGING, 1, getDepthFilterStorageName(DEPTH_FILTER_STORAGE_FIXED) },
+		{ DEPTH_FILTER_STORAGE_FLOAT, DEPTH_FILTER_MODE_RECURSIVE, 1, getDepthFilterModeName(DEPTH_FILTER_MODE_RECURSIVE) },
+		{ DEPTH_FILTER_STORAGE_FLOAT, DEPTH_FILTER_MODE_AVERAGING, 2, "decimated" }
+	};
+	int decimation = grabber.getDecimation();
+	bool identical = true;
+	for (const Variant& v : variants)
+	{
+		grabber.setDecimation(v.decimation);
+		for (auto & config : configs)
+		{
+			std::vector<ofFloatPixels> reference;
+			for (int k = DEPTH_FILTER_KERNEL_SCALAR; k <= getBestDepthFilterKernel(); k++)
+			{
+				for (int threads : threadCounts)
+				{
+					grabber.setFilterKernel(static_cast<DepthFilterKernel>(k));
+					grabber.setNumFilterThreads(threads);
+					grabber.setupFramefilter(10, 570, config.ROI, config.spatialFilter, config.followBigChange, config.numAveragingSlots, v.storage, v.mode);
+					grabber.setInPainting(config.inpaint);
+					bool isReference = reference.empty();
+					size_t mismatches = 0;
+					for (int i = 0; i < numWarmupFrames + numFrames; i++)
+					{
+						grabber.processFrame(frames[i % frames.size()]);
+						const ofFloatPixels& out = grabber.getFilteredFrame();
+						if (isReference)
+							reference.push_back(out);
+						else if (memcmp(out.getData(), reference[i].getData(), out.size() * sizeof(float)) != 0)
+							mismatches++;
+					}
+					cout << v.name << " ROI " << config.ROI.getWidth() << "x" << config.ROI.getHeight() << " kernel " << getDepthFilterKernelName(static_cast<DepthFilterKernel>(k))
+						<< " threads " << threads << ": " << (mismatches == 0 ? "identical" : ofToString(mismatches) + " frames differ") << endl;
+					identical = identical && mismatches == 0;
+				}
+			}
+		}
+	}
+	grabber.setDecimation(decimation);
+
+	// Restoring the decimation restarted the filter, the frames after which
+	// are converted below
+	for (int i = 0; i < numWarmupFrames + numFrames; i++)
+		grabber.processFrame(frames[i % frames.size()]);
+
+	// The point clouds of the last frame
+	KinectRayTable rays;
+	rays.setup(grabber.getWorldMatrix(), size.x, size.y);
+	std::vector<ofVec3f> reference, points;
+	for (auto & config : configs)
+	{
+		for (int k = DEPTH_FILTER_KERNEL_SCALAR; k <= getBestDepthFilterKernel(); k++)
+		{
+			int n = rays.toWorld(grabber.getFilteredFrame().getData(), config.ROI.getLeft(), config.ROI.getTop(), config.ROI.getRight(), config.ROI.getBottom(),
+				k == DEPTH_FILTER_KERNEL_SCALAR ? reference : points, static_cast<DepthFilterKernel>(k));
+			if (k == DEPTH_FILTER_KERNEL_SCALAR)
+				continue;
+			bool same = memcmp(points.data(), reference.data(), n * sizeof(ofVec3f)) == 0;
+			cout << "points ROI " << config.ROI.getWidth() << "x" << config.ROI.getHeight() << " kernel " << getDepthFilterKernelName(static_cast<DepthFilterKernel>(k))
+				<< ": " << (same ? "identical" : "differ") << endl;
+			identical = identical && same;
+		}
+	}
+
+	// The per pixel kernels of the sand geometry, on the last frame with
+	// holes, in ROIs with ragged edges, the last one narrower than 32 pixels
+	// across the side of a hill
+	std::vector<float> depth(grabber.getFilteredFrame().getData(), grabber.getFilteredFrame().getData() + rays.getWidth() * rays.getHeight());
+	for (size_t i = 0; i < depth.size(); i += 7)
+		depth[i] = 0;
+	std::vector<float> movedDepth(depth); // The sand a little lower, for the hysteresis
+	for (size_t i = 0; i < movedDepth.size(); i++)
+		movedDepth[i] += movedDepth[i] > 0 ? 1.5f : 0;
+	DirtyTiles allTiles;
+	allTiles.resize(rays.getWidth(), rays.getHeight());
+	allTiles.setAll();
+	std::vector<ofRectangle> ROIs = { configs[0].ROI, configs[1].ROI, ofRectangle(83, 183, 29, 17) };
+	ofVec4f basePlane(0.03f, -0.05f, 0.998f, -860);
+	RansacParameters ransacParameters;
+	ransacParameters.sampleSpacing = 8;
+	ransacParameters.inlierDistance = 8;
+	ransacParameters.timeBudget = 1000; // Ends on the iteration count, so every kernel tries the same planes
+	ransacParameters.maxIterations = 200;
+	ransacParameters.confidence = 0.999f;
+	auto report = [&identical](const char* name, const ofRectangle& ROI, int k, bool same) {
+		cout << name << " ROI " << ROI.getWidth() << "x" << ROI.getHeight() << " kernel " << getDepthFilterKernelName(static_cast<DepthFilterKernel>(k))
+			<< ": " << (same ? "identical" : "differ") << endl;
+		identical = identical && same;
+	};
+	for (const ofRectangle& ROI : ROIs)
+	{
+		ElevationMap referenceElevation;
+		referenceElevation.update(depth.data(), rays, basePlane, ROI, DEPTH_FILTER_KERNEL_SCALAR);
+		for (int k = DEPTH_FILTER_KERNEL_SCALAR + 1; k <= getBestDepthFilterKernel(); k++)
+		{
+			ElevationMap elevation;
+			elevation.update(depth.data(), rays, basePlane, ROI, static_cast<DepthFilterKernel>(k));
+			report("elevation", ROI, k, memcmp(elevation.getData(), referenceElevation.getData(), depth.size() * sizeof(float)) == 0);
+		}
+
+		// Classified against 0 first, then with the hysteresis
+		ElevationMap movedElevation;
+		movedElevation.update(movedDepth.data(), rays, basePlane, ROI, DEPTH_FILTER_KERNEL_SCALAR);
+		LandMask referenceMask;
+		for (int k = DEPTH_FILTER_KERNEL_SCALAR; k <= getBestDepthFilterKernel(); k++)
+		{
+			LandMask landMask;
+			LandMask& mask = k == DEPTH_FILTER_KERNEL_SCALAR ? referenceMask : landMask;
+			mask.update(referenceElevation, ROI, 2, static_cast<DepthFilterKernel>(k));
+			mask.invalidate(allTiles);
+			mask.update(movedElevation, ROI, 2, static_cast<DepthFilterKernel>(k));
+			if (k != DEPTH_FILTER_KERNEL_SCALAR)
+				report("land mask", ROI, k, memcmp(mask.getPixels().getData(), referenceMask.getPixels().getData(), depth.size()) == 0);
+		}
+
+		PlaneFit referenceFit;
+		for (int k = DEPTH_FILTER_KERNEL_SCALAR; k <= getBestDepthFilterKernel(); k++)
+		{
+			PlaneMoments moments;
+			moments.add(depth.data(), rays, ROI.getLeft(), ROI.getTop(), ROI.getRight(), ROI.getBottom(), static_cast<DepthFilterKernel>(k));
+			PlaneFit fit = moments.fit();
+			if (k == DEPTH_FILTER_KERNEL_SCALAR)
+				referenceFit = fit;
+			else
+				report("plane moments", ROI, k, memcmp(&fit, &referenceFit, sizeof(PlaneFit)) == 0);
+		}
+
+		// The points near the sea level, and the robust fit refined with them
+		PlaneFit referenceNearFit, referenceRansacFit;
+		for (int k = DEPTH_FILTER_KERNEL_SCALAR; k <= getBestDepthFilterKernel(); k++)
+		{
+			PlaneMoments moments;
+			moments.addNear(depth.data(), rays, ROI.getLeft(), ROI.getTop(), ROI.getRight(), ROI.getBottom(), basePlane / ofVec3f(basePlane).length(), 8,
+				static_cast<DepthFilterKernel>(k));
+			PlaneFit nearFit = moments.fit();
+			RansacPlaneFit ransac;
+			PlaneFit ransacFit = ransac.fit(depth.data(), rays, ROI.getLeft(), ROI.getTop(), ROI.getRight(), ROI.getBottom(), ransacParameters,
+				static_cast<DepthFilterKernel>(k));
+			if (k == DEPTH_FILTER_KERNEL_SCALAR)
+			{
+				referenceNearFit = nearFit;
+				referenceRansacFit = ransacFit;
+				continue;
+			}
+			report("plane moments near", ROI, k, memcmp(&nearFit, &referenceNearFit, sizeof(PlaneFit)) == 0);
+			report("ransac", ROI, k, memcmp(&ransacFit, &referenceRansacFit, sizeof(PlaneFit)) == 0);
+		}
+	}
+	return identical;
+}
+
+FilterBenchmark::StageStatistics FilterBenchmark::computeStatistics(std::vector<double>& samples)
+{
+	StageStatistics stats;
+	std::sort(samples.begin(), samples.end());
+	stats.min = samples.front();
+	stats.median = samples[samples.size() / 2];
+	stats.p99 = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+	return stats;
+}
+
+void FilterBenchmark::writeResults(std::ostream& out)
+{
+	auto writeStats = [&out](const char* name, const StageStatistics& s, bool last) {
+		out << "        \"" << name << "\": { \"min_us\": " << s.min << ", \"median_us\": " << s.median << ", \"p99_us\": " << s.p99 << " }" << (last ? "\n" : ",\n");
+	};
+
+	ofVec2f size = grabber.getKinectSize();
+	out << "{\n";
+	out << "  \"source\": \"" << (recordingFile.empty() ? "synthetic" : recordingFile) << "\",\n";
+	out << "  \"frame_width\": " << size.x << ",\n";
+	out << "  \"frame_height\": " << size.y << ",\n";
+	out << "  \"frames\": " << numFrames << ",\n";
+	out << "  \"kernel\": \"" << getDepthFilterKernelName(grabber.getFilterKernel()) << "\",\n";
+	out << "  \"threads\": " << grabber.getNumFilterThreads() << ",\n";
+	out << "  \"storage\": \"" << getDepthFilterStorageName(storage) << "\",\n";
+	out << "  \"spatial_filter_radius\": " << grabber.getSpatialFilterRadius() << ",\n";
+	out << "  \"buffer_memory\": " << grabber.getBufferMemory() << ",\n";
+	out << "  \"huge_pages\": " << (grabber.isUsingHugePages() ? "true" : "false") << ",\n";
+	out << "  \"decimation\": " << grabber.getDecimation() << ",\n";
+	out << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		out << "    {\n";
+		out << "      \"mode\": \"" << getDepthFilterModeName(r.config.mode) << "\",\n";
+		out << "      \"roi_width\": " << r.config.ROI.getWidth() << ", \"roi_height\": " << r.config.ROI.getHeight() << ",\n";
+		out << "      \"averaging_slots\": " << r.config.numAveragingSlots << ",\n";
+		out << "      \"spatial_filter\": " << (r.config.spatialFilter ? "true" : "false") << ",\n";
+		out << "      \"inpaint\": " << (r.config.inpaint ? "true" : "false") << ",\n";
+		out << "      \"follow_big_change\": " << (r.config.followBigChange ? "true" : "false") << ",\n";
+		out << "      \"stages\": {\n";
+		writeStats("filter", r.filter, false);
+		writeStats("inpaint", r.inpaint, false);
+		writeStats("space_filter", r.spaceFilter, false);
+		writeStats("changes", r.changes, false);
+		writeStats("gradient", r.gradient, false);
+		writeStats("upsample", r.upsample, false);
+		writeStats("total", r.total, true);
+		out << "      },\n";
+		out << "      \"fps\": " << r.fps << ",\n";
+		out << "      \"inpainted_pixels\": " << r.inpaintedPixels << ",\n";
+		out << "      \"dirty_fraction\": " << r.dirtyFraction << "\n";
+		out << "    }" << (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
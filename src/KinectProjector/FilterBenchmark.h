@@ -0,0 +1,100 @@
+/***********************************************************************
+FilterBenchmark - Headless timing of the KinectGrabber depth filtering
+stages over synthetic or recorded frames.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+#include "KinectGrabber.h"
+
+// Runs every combination of filter mode, ROI size, number of averaging
+// slots and the spatial filtering, inpainting and quick reaction flags through
+// KinectGrabber::processFrame() and writes min/median/p99 latency of each
+// stage, the resulting frame rate, the mean number of inpainted pixels and
+// the mean fraction of the ROI tiles that changed per frame as JSON.
+//
+// With --verify it instead checks that every filter kernel and thread count
+// gives the same output as the single threaded scalar filter, for float
+// and fixed point averaging, for the recursive filter and for 2x2
+// decimated float averaging, and that the SIMD conversions of the
+// filtered frame into world points and elevations, the SIMD land
+// classification, the SIMD plane moments of all points or of those near a
+// plane and the RANSAC fit refined with them match the scalar ones.
+//
+// Command line: Magic-Sand --benchmark [--recording file.msd] [--frames N]
+//                          [--output results.json] [--quick]
+//                          [--kernel scalar|sse4.1|avx2] [--threads N]
+//                          [--storage float|fixed] [--mode averaging|recursive]
+//                          [--radius sigma] [--huge-pages] [--decimation 1|2|4]
+//                          [--verify]
+class FilterBenchmark {
+public:
+	struct Configuration
+	{
+		DepthFilterMode mode;
+		ofRectangle ROI;
+		int numAveragingSlots;
+		bool spatialFilter;
+		bool inpaint;
+		bool followBigChange;
+	};
+
+	struct StageStatistics
+	{
+		double min, median, p99; // Microseconds
+	};
+
+	struct Result
+	{
+		Configuration config;
+		StageStatistics filter, inpaint, spaceFilter, changes, gradient, upsample, total;
+		double fps;
+		double inpaintedPixels; // Mean holes filled per frame
+		double dirtyFraction; // Mean share of the ROI tiles that changed per frame
+	};
+
+	FilterBenchmark();
+
+	// Parse the command line and run all configurations. Returns the process exit code
+	int run(int argc, char* argv[]);
+
+private:
+	bool loadFrames();
+	std::vector<Configuration> buildConfigurations();
+	Result runConfiguration(const Configuration& config);
+	bool verifyFilters();
+	void writeResults(std::ostream& out);
+
+	static StageStatistics computeStatistics(std::vector<double>& samples);
+
+	std::string recordingFile; // Synthetic frames when empty
+	std::string outputFile;
+	int numFrames; // Timed frames per configuration
+	int numWarmupFrames;
+	bool quick; // Reduced set of configurations
+	bool verify;
+	DepthFilterStorage storage;
+	std::vector<DepthFilterMode> modes; // Both unless --mode is given
+
+	KinectGrabber grabber;
+	std::vector<ofShortPixels> frames;
+	std::vector<Result> results;
+};
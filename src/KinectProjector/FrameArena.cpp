@@ -0,0 +1,108 @@
+/***********************************************************************
+FrameArena - One aligned block of memory holding the depth filter
+buffers, handed out as views.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FrameArena.h"
+#include <algorithm>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+static const size_t hugePageSize = 2 * 1024 * 1024;
+#endif
+
+FrameArena::FrameArena()
+:block(nullptr),
+capacity(0),
+used(0),
+hugePages(false),
+blockHugePages(false)
+{
+}
+
+FrameArena::~FrameArena()
+{
+	release();
+}
+
+bool FrameArena::reserve(size_t scapacity)
+{
+	used = 0;
+	if (scapacity <= capacity)
+		return true;
+	release();
+
+	size_t blockAlignment = alignment;
+	size_t size = alignedSize(std::max<size_t>(scapacity, 1));
+#ifdef __linux__
+	// Huge pages must be aligned on their size to be used
+	bool huge = hugePages && size >= hugePageSize;
+	if (huge)
+	{
+		blockAlignment = hugePageSize;
+		size = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+	}
+#endif
+
+	void* memory = nullptr;
+#ifdef _WIN32
+	memory = _aligned_malloc(size, blockAlignment);
+#else
+	if (posix_memalign(&memory, blockAlignment, size) != 0)
+		memory = nullptr;
+#endif
+	if (!memory)
+		return false;
+	block = static_cast<unsigned char*>(memory);
+	capacity = size;
+#ifdef __linux__
+	// Advisory: the kernel may still back the block with normal pages
+	blockHugePages = huge && madvise(block, size, MADV_HUGEPAGE) == 0;
+#endif
+	return true;
+}
+
+void FrameArena::release()
+{
+#ifdef _WIN32
+	_aligned_free(block);
+#else
+	free(block);
+#endif
+	block = nullptr;
+	capacity = 0;
+	used = 0;
+	blockHugePages = false;
+}
+
+void FrameArena::swap(FrameArena& other)
+{
+	std::swap(block, other.block);
+	std::swap(capacity, other.capacity);
+	std::swap(used, other.used);
+	std::swap(hugePages, other.hugePages);
+	std::swap(blockHugePages, other.blockHugePages);
+}
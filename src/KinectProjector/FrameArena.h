@@ -0,0 +1,87 @@
+/***********************************************************************
+FrameArena - One aligned block of memory holding the depth filter
+buffers, handed out as views.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// reserve() gets the block from the system, allocate() carves views out of
+// it by bumping an offset and clear() takes them all back. Every view
+// starts on a cache line, so full planes of float or integer pixels can
+// be read with aligned SIMD loads.
+class FrameArena {
+public:
+	static const size_t alignment = 64;
+
+	FrameArena();
+	~FrameArena();
+
+	// Make room for capacity bytes of views and clear the arena. Only asks
+	// the system for memory when the current block is too small
+	bool reserve(size_t capacity);
+	void release(); // Give the block back to the system
+	void clear() { // Forget the views, keeping the block
+		used = 0;
+	}
+	void swap(FrameArena& other);
+
+	// Uninitialised view of count elements, nullptr when the arena is full
+	template<typename T>
+	T* allocate(size_t count) {
+		size_t size = alignedSize(count * sizeof(T));
+		if (size > capacity - used)
+			return nullptr;
+		T* view = reinterpret_cast<T*>(block + used);
+		used += size;
+		return view;
+	}
+
+	// Ask for transparent huge pages for the next block (Linux only, for
+	// blocks of at least one huge page). Fewer TLB misses on the slot
+	// planes, which are walked once per frame
+	void setHugePages(bool use) {
+		hugePages = use;
+	}
+	bool usesHugePages() const { // The current block was advised to use them
+		return blockHugePages;
+	}
+	size_t getCapacity() const {
+		return capacity;
+	}
+	size_t getUsed() const {
+		return used;
+	}
+
+	static size_t alignedSize(size_t size) {
+		return (size + alignment - 1) & ~(alignment - 1);
+	}
+
+private:
+	FrameArena(const FrameArena&);
+	FrameArena& operator=(const FrameArena&);
+
+	unsigned char* block;
+	size_t capacity;
+	size_t used;
+	bool hugePages;
+	bool blockHugePages;
+};
@@ -0,0 +1,307 @@
+/***********************************************************************
+FrameSource - Where KinectGrabber gets its raw depth and colour frames
+from: a live Kinect or a recorded session.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "FrameSource.h"
+
+//--------------------------------------------------------------
+KinectFrameSource::KinectFrameSource()
+:opened(false),
+timestamp(0)
+{
+}
+
+void KinectFrameSource::setup()
+{
+	kinect.init();
+	kinect.setRegistration(true); // To have correspondance between RGB and depth images
+	kinect.setUseTexture(false);
+}
+
+bool KinectFrameSource::open()
+{
+	opened = kinect.open();
+	return opened;
+}
+
+void KinectFrameSource::close()
+{
+	kinect.close();
+	opened = false;
+}
+
+bool KinectFrameSource::isOpen()
+{
+	return opened;
+}
+
+void KinectFrameSource::update()
+{
+	kinect.update();
+	if (kinect.isFrameNew())
+		timestamp = ofGetElapsedTimeMicros(); // ofxKinect does not expose the USB timestamps
+}
+
+bool KinectFrameSource::isFrameNew()
+{
+	return kinect.isFrameNew();
+}
+
+// ofxKinect keeps its libfreenect frame callbacks to itself, so we cannot be
+// woken by a new frame. Instead sleep until shortly before the next frame
+// of the 30 Hz stream is due and check every millisecond from there
+uint64_t KinectFrameSource::getWaitTime()
+{
+	const uint64_t frameInterval = 33333;
+	const uint64_t pollInterval = 1000;
+	if (!opened)
+		return 100000;
+	uint64_t now = ofGetElapsedTimeMicros();
+	uint64_t nextCheck = timestamp + frameInterval - pollInterval;
+	if (timestamp != 0 && now < nextCheck)
+		return nextCheck - now;
+	return pollInterval;
+}
+
+unsigned int KinectFrameSource::getWidth()
+{
+	return kinect.getWidth();
+}
+
+unsigned int KinectFrameSource::getHeight()
+{
+	return kinect.getHeight();
+}
+
+const ofShortPixels& KinectFrameSource::getRawDepthPixels()
+{
+	return kinect.getRawDepthPixels();
+}
+
+const ofPixels& KinectFrameSource::getPixels()
+{
+	return kinect.getPixels();
+}
+
+uint64_t KinectFrameSource::getTimestamp()
+{
+	return timestamp;
+}
+
+ofVec3f KinectFrameSource::getWorldCoordinateAt(int x, int y, float z)
+{
+	return kinect.getWorldCoordinateAt(x, y, z);
+}
+
+//--------------------------------------------------------------
+RecordedFrameSource::RecordedFrameSource(std::string spath, Playback_mode mode, bool sloop)
+:path(spath),
+opened(false),
+loop(sloop),
+frameNew(false),
+finished(false),
+playbackMode(mode),
+pendingSteps(0),
+pendingSeek(-1),
+currentFrame(0),
+nextFrame(0),
+playbackStart(0),
+timestampBase(0),
+timestamp(0)
+{
+}
+
+void RecordedFrameSource::setup()
+{
+	if (!reader.open(ofToDataPath(path)))
+	{
+		ofLogError("RecordedFrameSource") << "setup(): could not load recording " << path;
+		return;
+	}
+	depthPixels.allocate(reader.getWidth(), reader.getHeight(), 1);
+	depthPixels.set(0);
+	colorPixels.allocate(reader.getWidth(), reader.getHeight(), 3);
+	colorPixels.set(0);
+}
+
+bool RecordedFrameSource::open()
+{
+	opened = reader.isOpen() && reader.getNumFrames() > 0;
+	nextFrame = 0;
+	playbackStart = 0;
+	finished = false;
+	return opened;
+}
+
+void RecordedFrameSource::close()
+{
+	opened = false;
+	reader.close();
+}
+
+bool RecordedFrameSource::isOpen()
+{
+	return opened;
+}
+
+void RecordedFrameSource::setPlaybackMode(Playback_mode mode)
+{
+	playbackMode = mode;
+	notifyFrame();
+}
+
+void RecordedFrameSource::step(int frames)
+{
+	pendingSteps += frames;
+	notifyFrame();
+}
+
+void RecordedFrameSource::seek(size_t frame)
+{
+	pendingSeek = static_cast<long long>(frame);
+	notifyFrame();
+}
+
+void RecordedFrameSource::update()
+{
+	frameNew = false;
+	if (!opened)
+		return;
+
+	long long seekTo = pendingSeek.exchange(-1);
+	if (seekTo >= 0 && static_cast<size_t>(seekTo) < reader.getNumFrames())
+	{
+		nextFrame = seekTo;
+		playbackStart = 0; // Restart the realtime clock from the new position
+		finished = false;
+	}
+
+	if (nextFrame >= reader.getNumFrames())
+	{
+		if (!loop)
+		{
+			finished = true;
+			return;
+		}
+		nextFrame = 0;
+		playbackStart = 0;
+	}
+
+	uint64_t now = ofGetElapsedTimeMicros();
+	switch (playbackMode)
+	{
+	case PLAYBACK_REALTIME:
+		if (playbackStart == 0)
+		{
+			playbackStart = now;
+			timestampBase = reader.getTimestamp(nextFrame);
+		}
+		if (reader.getTimestamp(nextFrame) - timestampBase > now - playbackStart)
+			return; // Not due yet
+		break;
+	case PLAYBACK_FULL_SPEED:
+		break;
+	case PLAYBACK_STEP:
+		if (pendingSteps <= 0)
+			return;
+		pendingSteps--;
+		break;
+	}
+
+	if (loadFrame(nextFrame))
+	{
+		currentFrame = nextFrame;
+		frameNew = true;
+	}
+	nextFrame++;
+}
+
+bool RecordedFrameSource::loadFrame(size_t frame)
+{
+	if (!reader.readFrame(frame, depthPixels.getData(), reader.hasColor() ? colorPixels.getData() : nullptr))
+	{
+		ofLogWarning("RecordedFrameSource") << "loadFrame(): frame " << frame << " is corrupt, skipping";
+		return false;
+	}
+	timestamp = reader.getTimestamp(frame);
+	return true;
+}
+
+bool RecordedFrameSource::isFrameNew()
+{
+	return frameNew;
+}
+
+uint64_t RecordedFrameSource::getWaitTime()
+{
+	const uint64_t idleWait = 100000; // Nothing due until step(), seek() or setPlaybackMode()
+	if (!opened || (finished && pendingSeek < 0))
+		return idleWait;
+	if (pendingSeek >= 0 || nextFrame >= reader.getNumFrames())
+		return 0;
+	switch (playbackMode)
+	{
+	case PLAYBACK_REALTIME:
+	{
+		if (playbackStart == 0)
+			return 0;
+		uint64_t due = reader.getTimestamp(nextFrame) - timestampBase;
+		uint64_t elapsed = ofGetElapsedTimeMicros() - playbackStart;
+		return due > elapsed ? due - elapsed : 0;
+	}
+	case PLAYBACK_STEP:
+		return pendingSteps > 0 ? 0 : idleWait;
+	default:
+		return 0;
+	}
+}
+
+unsigned int RecordedFrameSource::getWidth()
+{
+	return reader.getWidth();
+}
+
+unsigned int RecordedFrameSource::getHeight()
+{
+	return reader.getHeight();
+}
+
+const ofShortPixels& RecordedFrameSource::getRawDepthPixels()
+{
+	return depthPixels;
+}
+
+const ofPixels& RecordedFrameSource::getPixels()
+{
+	return colorPixels;
+}
+
+uint64_t RecordedFrameSource::getTimestamp()
+{
+	return timestamp;
+}
+
+ofVec3f RecordedFrameSource::getWorldCoordinateAt(int x, int y, float z)
+{
+	// Same linear model KinectGrabber::getWorldMatrix() extracts from a live Kinect
+	const DepthRecordingHeader& h = reader.getHeader();
+	return ofVec3f((h.worldOffsetX + x * h.worldScaleX) * z, (h.worldOffsetY + y * h.worldScaleY) * z, z);
+}
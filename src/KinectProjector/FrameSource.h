@@ -0,0 +1,164 @@
+/***********************************************************************
+FrameSource - Where KinectGrabber gets its raw depth and colour frames
+from: a live Kinect or a recorded session.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "ofxKinect.h"
+
+#include "DepthRecording.h"
+
+// Interface modelled on the parts of ofxKinect used by KinectGrabber
+class FrameSource {
+public:
+	virtual ~FrameSource() {}
+
+	// Prepare the source. Width and height are known afterwards
+	virtual void setup() = 0;
+	virtual bool open() = 0;
+	virtual void close() = 0;
+	virtual bool isOpen() = 0;
+
+	// Fetch the next frame if one is due
+	virtual void update() = 0;
+	virtual bool isFrameNew() = 0;
+	// Microseconds the caller may sleep before the next update() without
+	// delaying a frame. Sources woken from another thread (stepping,
+	// seeking) call the frame listener so the sleep can end early
+	virtual uint64_t getWaitTime() = 0;
+	void setFrameListener(std::function<void()> listener) {
+		frameListener = listener;
+	}
+
+	virtual unsigned int getWidth() = 0;
+	virtual unsigned int getHeight() = 0;
+	virtual const ofShortPixels& getRawDepthPixels() = 0;
+	virtual const ofPixels& getPixels() = 0;
+	// Arrival time of the current frame in microseconds
+	virtual uint64_t getTimestamp() = 0;
+
+	virtual ofVec3f getWorldCoordinateAt(int x, int y, float z) = 0;
+
+protected:
+	void notifyFrame() {
+		if (frameListener)
+			frameListener();
+	}
+
+private:
+	std::function<void()> frameListener;
+};
+
+// Live frames from a Kinect through ofxKinect
+class KinectFrameSource: public FrameSource {
+public:
+	KinectFrameSource();
+
+	void setup() override;
+	bool open() override;
+	void close() override;
+	bool isOpen() override;
+
+	void update() override;
+	bool isFrameNew() override;
+	uint64_t getWaitTime() override;
+
+	unsigned int getWidth() override;
+	unsigned int getHeight() override;
+	const ofShortPixels& getRawDepthPixels() override;
+	const ofPixels& getPixels() override;
+	uint64_t getTimestamp() override;
+
+	ofVec3f getWorldCoordinateAt(int x, int y, float z) override;
+
+private:
+	ofxKinect kinect;
+	bool opened;
+	uint64_t timestamp;
+};
+
+// Frames replayed from a memory mapped DepthRecording
+class RecordedFrameSource: public FrameSource {
+public:
+	enum Playback_mode
+	{
+		PLAYBACK_REALTIME,   // Frames are delivered at their recorded timestamps
+		PLAYBACK_FULL_SPEED, // A new frame on every update()
+		PLAYBACK_STEP        // A new frame only after step()
+	};
+
+	RecordedFrameSource(std::string path, Playback_mode mode = PLAYBACK_REALTIME, bool loop = true);
+
+	void setup() override;
+	bool open() override;
+	void close() override;
+	bool isOpen() override;
+
+	void update() override;
+	bool isFrameNew() override;
+	uint64_t getWaitTime() override;
+
+	unsigned int getWidth() override;
+	unsigned int getHeight() override;
+	const ofShortPixels& getRawDepthPixels() override;
+	const ofPixels& getPixels() override;
+	uint64_t getTimestamp() override;
+
+	ofVec3f getWorldCoordinateAt(int x, int y, float z) override;
+
+	// Playback control, may be called from any thread
+	void setPlaybackMode(Playback_mode mode);
+	void step(int frames = 1);
+	void seek(size_t frame);
+
+	size_t getNumFrames() {
+		return reader.getNumFrames();
+	}
+	size_t getCurrentFrame() {
+		return currentFrame;
+	}
+	bool isFinished() {
+		return finished;
+	}
+
+private:
+	bool loadFrame(size_t frame);
+
+	std::string path;
+	DepthRecordingReader reader;
+	bool opened;
+	bool loop;
+	bool frameNew;
+	bool finished;
+
+	std::atomic<int> playbackMode;
+	std::atomic<int> pendingSteps;
+	std::atomic<long long> pendingSeek;
+
+	size_t currentFrame;
+	size_t nextFrame;
+	uint64_t playbackStart; // Wall clock time at which nextFrame's timestamp base was set
+	uint64_t timestampBase; // Recording timestamp matching playbackStart
+	uint64_t timestamp;
+
+	ofShortPixels depthPixels;
+	ofPixels colorPixels;
+};
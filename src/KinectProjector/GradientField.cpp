@@ -0,0 +1,153 @@
+/***********************************************************************
+GradientField - Pyramid of the depth gradient averaged over square
+cells of several sizes.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+
+#include "GradientField.h"
+
+GradientField::GradientField()
+:width(0),
+height(0),
+pixelSize(1),
+blockSize(1),
+blockCols(0),
+blockRows(0)
+{
+}
+
+void GradientField::setup(int swidth, int sheight, int baseResolution, int spixelSize)
+{
+	width = swidth;
+	height = sheight;
+	pixelSize = std::max(spixelSize, 1);
+	blockSize = std::max(baseResolution / 2 / pixelSize, 1);
+	blockCols = width / blockSize;
+	blockRows = height / blockSize;
+	blockCounts.assign((blockCols + 1) * (blockRows + 1), 0);
+	blockSums.assign((blockCols + 1) * (blockRows + 1), 0.0);
+	for (int i = 0; i < numLevels; i++)
+	{
+		GradientFieldLevel& level = levels[i];
+		int cellSize = (2 * blockSize) << i;
+		level.resolution = cellSize * pixelSize;
+		level.cols = width / cellSize;
+		level.rows = height / cellSize;
+		level.field.assign(level.cols * level.rows, ofVec2f(0));
+	}
+}
+
+void GradientField::update(const float* image, int x0, int y0, int x1, int y1, float invalidValue, float maxGradient, WorkerPool& pool)
+{
+	// Sum the valid pixels of the ROI part of each block into row by+1 of
+	// the tables: first down the columns of a block row, in loops the
+	// compiler vectorizes, then across the blocks. Bands of block rows in parallel
+	const int tableWidth = blockCols + 1;
+	const int roiWidth = std::max(x1 - x0, 0);
+	int numBands = std::max(1, std::min(pool.getNumThreads(), blockRows / 4));
+	columnScratch.resize(numBands * 2 * roiWidth);
+	pool.run(numBands, [&](int band) {
+		float* columnCounts = columnScratch.data() + band * 2 * roiWidth;
+		float* columnSums = columnCounts + roiWidth;
+		for (int by = blockRows * band / numBands; by < blockRows * (band + 1) / numBands; by++)
+		{
+			int* counts = blockCounts.data() + (by + 1) * tableWidth + 1;
+			double* sums = blockSums.data() + (by + 1) * tableWidth + 1;
+			std::fill(counts, counts + blockCols, 0);
+			std::fill(sums, sums + blockCols, 0.0);
+			int py0 = std::max(by * blockSize, y0), py1 = std::min((by + 1) * blockSize, y1);
+			if (py0 >= py1)
+				continue;
+
+			std::fill(columnCounts, columnCounts + 2 * roiWidth, 0.0f);
+			for (int y = py0; y < py1; y++)
+			{
+				const float* row = image + y * width + x0;
+				for (int x = 0; x < roiWidth; x++)
+				{
+					float valid = ((row[x] != 0) & (row[x] != invalidValue)) ? 1.0f : 0.0f;
+					columnCounts[x] += valid;
+					columnSums[x] += valid * row[x];
+				}
+			}
+			for (int bx = x0 / blockSize; bx < std::min((x1 + blockSize - 1) / blockSize, blockCols); bx++)
+			{
+				int px0 = std::max(bx * blockSize, x0) - x0, px1 = std::min((bx + 1) * blockSize, x1) - x0;
+				float count = 0, sum = 0;
+				for (int x = px0; x < px1; x++)
+				{
+					count += columnCounts[x];
+					sum += columnSums[x];
+				}
+				counts[bx] = static_cast<int>(count);
+				sums[bx] = sum;
+			}
+		}
+	});
+
+	// Turn the block sums into summed-area tables
+	for (int by = 1; by <= blockRows; by++)
+	{
+		int* counts = blockCounts.data() + by * tableWidth;
+		double* sums = blockSums.data() + by * tableWidth;
+		int rowCount = 0;
+		double rowSum = 0;
+		for (int bx = 1; bx <= blockCols; bx++)
+		{
+			rowCount += counts[bx];
+			rowSum += sums[bx];
+			counts[bx] = counts[bx - tableWidth] + rowCount;
+			sums[bx] = sums[bx - tableWidth] + rowSum;
+		}
+	}
+
+	for (int i = 0; i < numLevels; i++)
+	{
+		GradientFieldLevel& level = levels[i];
+		const int n = 2 << i; // Blocks per cell side
+		const int h = n / 2;
+		const float distance = static_cast<float>(h * blockSize * pixelSize); // Between the centres of the halves, in Kinect pixels
+		ofVec2f* cell = level.field.data();
+		for (int y = 0; y < level.rows; y++)
+		{
+			int r0 = y * n, r1 = r0 + n;
+			for (int x = 0; x < level.cols; x++, cell++)
+			{
+				int c0 = x * n, c1 = c0 + n;
+				*cell = ofVec2f(0);
+				if (c0 * blockSize < x0 || c1 * blockSize > x1 || r0 * blockSize < y0 || r1 * blockSize > y1)
+					continue;
+
+				int left = getCount(c0, r0, c0 + h, r1);
+				int right = getCount(c0 + h, r0, c1, r1);
+				int top = getCount(c0, r0, c1, r0 + h);
+				int bottom = getCount(c0, r0 + h, c1, r1);
+				if (left == 0 || right == 0 || top == 0 || bottom == 0)
+					continue;
+
+				double gx = getSum(c0, r0, c0 + h, r1) / left - getSum(c0 + h, r0, c1, r1) / right;
+				double gy = getSum(c0, r0, c1, r0 + h) / top - getSum(c0, r0 + h, c1, r1) / bottom;
+				*cell = ofVec2f(static_cast<float>(gx), static_cast<float>(gy)) / distance;
+				if (cell->length() > maxGradient)
+					cell->scale(maxGradient);
+			}
+		}
+	}
+}
@@ -0,0 +1,92 @@
+/***********************************************************************
+GradientField - Pyramid of the depth gradient averaged over square
+cells of several sizes.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+
+#pragma once
+#include "ofMain.h"
+
+#include "WorkerPool.h"
+
+// One level of the pyramid: the frame is cut into cols x rows square cells
+// of resolution pixels (the last partial row and column are dropped, as
+// before). Cells that are not entirely inside the ROI have a zero gradient.
+struct GradientFieldLevel
+{
+	int resolution; // In Kinect pixels
+	int cols, rows;
+	std::vector<ofVec2f> field; // Row major
+};
+
+// The gradient of a cell is the difference between the mean valid depth of
+// its left and right halves (top and bottom for y), divided by the distance
+// between their centres. It points towards decreasing depth, i.e. uphill.
+// Each frame is reduced once to the valid pixel counts and depth sums of
+// blocks of half the finest cell size. Every cell of every level is a
+// square of 2^(k+1) blocks, so the sums of its halves come from a
+// summed-area table of the blocks in four lookups each. All levels
+// together cost about one pass over the ROI.
+class GradientField {
+public:
+	static const int numLevels = 4;
+
+	GradientField();
+
+	// Size the levels for width x height frames whose pixels cover
+	// pixelSize x pixelSize Kinect pixels. Level k has cells of
+	// baseResolution << k Kinect pixels (rounded down to an even number of
+	// frame pixels) and gradients per Kinect pixel. Only the small block
+	// and level vectors are reallocated
+	void setup(int width, int height, int baseResolution, int pixelSize = 1);
+	int getBaseResolution() const {
+		return 2 * blockSize * pixelSize;
+	}
+
+	// Recompute all levels from the depth image, limiting each gradient
+	// vector to maxGradient
+	void update(const float* image, int x0, int y0, int x1, int y1, float invalidValue, float maxGradient, WorkerPool& pool);
+
+	const GradientFieldLevel& getLevel(int level) const {
+		return levels[level];
+	}
+
+private:
+	int getIndex(int col, int row) const { // In the block tables
+		return row * (blockCols + 1) + col;
+	}
+	int getCount(int col0, int row0, int col1, int row1) const {
+		return blockCounts[getIndex(col1, row1)] - blockCounts[getIndex(col0, row1)] - blockCounts[getIndex(col1, row0)] + blockCounts[getIndex(col0, row0)];
+	}
+	double getSum(int col0, int row0, int col1, int row1) const {
+		return blockSums[getIndex(col1, row1)] - blockSums[getIndex(col0, row1)] - blockSums[getIndex(col1, row0)] + blockSums[getIndex(col0, row0)];
+	}
+
+	int width, height;
+	int pixelSize; // Kinect pixels per frame pixel
+	int blockSize; // Frame pixels, half the finest cell
+	int blockCols, blockRows;
+	// Summed-area tables over the blocks, (blockCols+1) x (blockRows+1)
+	// with a first row and column of 0
+	std::vector<int> blockCounts;
+	std::vector<double> blockSums;
+	std::vector<float> columnScratch; // Per column counts and sums of one block row
+	GradientFieldLevel levels[numLevels];
+};
@@ -0,0 +1,83 @@
+/***********************************************************************
+HoleFiller - Replaces missing depth values in the kinect ROI by the
+average of their valid neighbours, in time linear in the ROI size.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+
+#include "HoleFiller.h"
+#include <algorithm>
+
+HoleFiller::HoleFiller()
+:numFilledLocal(0),
+numFilledGlobal(0)
+{
+}
+
+void HoleFiller::apply(float* image, int width, int height, int x0, int y0, int x1, int y1, float invalidValue, WorkerPool& pool)
+{
+	numFilledLocal = 0;
+	numFilledGlobal = 0;
+	table.build(image, width, x0, y0, x1, y1, invalidValue, pool);
+	int totalCount = table.getTotalCount();
+	if (totalCount == 0)
+		return; // Nothing valid to fill from
+	const float roiAverage = static_cast<float>(table.getTotalSum() / totalCount);
+
+	int fx0 = std::max(0, x0 - fillMargin), fx1 = std::min(width, x1 + fillMargin);
+	int fy0 = std::max(0, y0 - fillMargin), fy1 = std::min(height, y1 + fillMargin);
+	int fillHeight = fy1 - fy0;
+	int numBands = std::max(1, std::min(pool.getNumThreads(), fillHeight / 16));
+	bandCounts.assign(2 * numBands, 0);
+	pool.run(numBands, [&](int band) {
+		int filledLocal = 0, filledGlobal = 0;
+		for (int y = fy0 + fillHeight * band / numBands; y < fy0 + fillHeight * (band + 1) / numBands; y++)
+		{
+			// Window rows, an empty window for margin rows too far from the ROI
+			int top = std::max(y - windowRadius, y0);
+			int bottom = std::max(std::min(y + windowRadius + 1, y1), top);
+			float* row = image + y * width;
+			for (int x = fx0; x < fx1; x++)
+			{
+				if (row[x] != 0 && row[x] != invalidValue)
+					continue;
+				int left = std::max(x - windowRadius, x0);
+				int right = std::max(std::min(x + windowRadius + 1, x1), left);
+				int count = table.getCount(left, top, right, bottom);
+				if (count > 0)
+				{
+					row[x] = static_cast<float>(table.getSum(left, top, right, bottom) / count);
+					filledLocal++;
+				}
+				else
+				{
+					row[x] = roiAverage;
+					filledGlobal++;
+				}
+			}
+		}
+		bandCounts[2 * band] = filledLocal;
+		bandCounts[2 * band + 1] = filledGlobal;
+	});
+	for (int band = 0; band < numBands; band++)
+	{
+		numFilledLocal += bandCounts[2 * band];
+		numFilledGlobal += bandCounts[2 * band + 1];
+	}
+}
@@ -0,0 +1,62 @@
+/***********************************************************************
+HoleFiller - Replaces missing depth values in the kinect ROI by the
+average of their valid neighbours, in time linear in the ROI size.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+
+#pragma once
+#include <vector>
+
+#include "SummedAreaTable.h"
+
+// A pixel is a hole when its depth is 0 or the filter's initial value. Each
+// hole gets the average of the valid pixels of the ROI in the
+// (2*windowRadius+1)^2 window around it, or the average of the whole ROI if
+// there are none. The window sums come from summed-area tables of the
+// valid pixels and their depths, so the cost per pixel is the same for any
+// amount or size of holes. Only the original valid pixels are averaged, so
+// the result does not depend on the order in which holes are filled or on
+// the number of threads.
+class HoleFiller {
+public:
+	HoleFiller();
+
+	static const int fillMargin = 2; // The shader samples a little beyond the ROI
+
+	// Fill the holes of [x0, x1) x [y0, y1) and of a margin of fillMargin
+	// pixels around it (clipped to the width x height image) in place
+	void apply(float* image, int width, int height, int x0, int y0, int x1, int y1, float invalidValue, WorkerPool& pool);
+
+	// Holes filled by the last apply()
+	int getNumFilledLocal() const {
+		return numFilledLocal;
+	}
+	int getNumFilledGlobal() const {
+		return numFilledGlobal;
+	}
+
+private:
+	static const int windowRadius = 5;
+
+	SummedAreaTable table;
+	std::vector<int> bandCounts; // Local and global fills of each band
+
+	int numFilledLocal, numFilledGlobal;
+};
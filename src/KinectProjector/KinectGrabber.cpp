@@ -21,16 +21,79 @@ General Public License for more details.
 
 #include "KinectGrabber.h"
 #include "ofConstants.h"
+#include <chrono>
+
+namespace {
+
+// Mean of the valid (non-zero) raw depths of each D x D block along a row,
+// 0 if the Kinect saw none of them
+template <int D>
+void binRow(const KinectGrabber::RawDepth* input, int inputWidth, KinectGrabber::RawDepth* output, int numPixels)
+{
+	for (int x = 0; x < numPixels; x++, input += D)
+	{
+		unsigned int sum = 0, count = 0;
+		for (int by = 0; by < D; by++)
+		{
+			for (int bx = 0; bx < D; bx++)
+			{
+				KinectGrabber::RawDepth value = input[by * inputWidth + bx];
+				sum += value;
+				count += value != 0;
+			}
+		}
+		output[x] = count > 0 ? static_cast<KinectGrabber::RawDepth>((sum + count / 2) / count) : 0;
+	}
+}
+
+}
 
 KinectGrabber::KinectGrabber()
 :newFrame(true),
+stageTimings(),
+frameMetrics(),
+filterKernel(getBestDepthFilterKernel()),
 bufferInitiated(false),
-kinectOpened(false)
+commandSequence(0),
+overflowPending(),
+hasOverflow(false),
+numOverflowedCommands(0),
+commandStatistics(),
+wakeRequested(false),
+busyTime(0),
+idleTime(0),
+kinectOpened(false),
+kinectWidth(0),
+kinectHeight(0),
+decimation(1),
+width(0),
+height(0),
+useHugePages(false),
+bufferMemory(0),
+bufferHugePages(false),
+referenceFrame(nullptr),
+allTilesDirty(true),
+gradientFieldOutdated(true),
+averagingBuffer(nullptr),
+statBuffer(nullptr),
+validBuffer(nullptr),
+filterStorage(DEPTH_FILTER_STORAGE_FLOAT),
+fixedAveragingBuffer(nullptr),
+fixedCountBuffer(nullptr),
+fixedSumBuffer(nullptr),
+fixedSumSqBuffer(nullptr),
+filterMode(DEPTH_FILTER_MODE_AVERAGING),
+estimateBuffer(nullptr),
+varianceBuffer(nullptr),
+gradientResolution(10),
+spatialFilterRadius(1.0f)
 {
 }
 
 KinectGrabber::~KinectGrabber(){
     //    stop();
+    stopThread();
+    wake();
     waitForThread(true);
     //	waitForThread(true);
 }
@@ -45,44 +108,93 @@ void KinectGrabber::start(){
 /// next time it has the chance to.
 void KinectGrabber::stop(){
     stopThread();
+    wake();
+}
+
+void KinectGrabber::wake(){
+    std::lock_guard<std::mutex> lock(wakeMutex);
+    wakeRequested = true;
+    wakeCondition.notify_one();
 }
 
 bool KinectGrabber::setup(){
 	// settings and defaults
-	storedframes = 0;
-	ROIAverageValue = 0;
-	setToGlobalAvg = 0;
-	setToLocalAvg = 0;
+	frameSequence = 0;
+	frameMetrics = FilterFrameMetrics();
 	doInPaint = 0;
 	doFullFrameFiltering = false;
 
-	kinect.init();
-	kinect.setRegistration(true); // To have correspondance between RGB and depth images
-	kinect.setUseTexture(false);
-	width = kinect.getWidth();
-	height = kinect.getHeight();
+	if (!source)
+		source = std::make_shared<KinectFrameSource>();
+	source->setFrameListener([this]() {
+		wake();
+	});
+	source->setup();
+	kinectWidth = source->getWidth();
+	kinectHeight = source->getHeight();
+	width = kinectWidth/decimation;
+	height = kinectHeight/decimation;
 
+	// Until setupFramefilter() carves them out of the arena
 	kinectDepthImage.allocate(width, height, 1);
     filteredframe.allocate(width, height, 1);
-    kinectColorImage.allocate(width, height);
-    kinectColorImage.setUseTexture(false);
+    if (decimation > 1)
+        upsampledframe.allocate(kinectWidth, kinectHeight, 1);
+    dirtyTiles.resize(width, height);
+    upsampledDirtyTiles.resize(kinectWidth, kinectHeight);
+    pendingDirtyTiles.resize(kinectWidth, kinectHeight);
+    pendingDirtyTiles.setAll();
+    for (int i = 0; i < 3; i++)
+    {
+        GrabbedFrame& frame = frames.getSlot(i);
+        frame.depth.allocate(kinectWidth, kinectHeight, 1);
+        frame.depth.set(0);
+        frame.rawDepth.allocate(kinectWidth, kinectHeight, 1);
+        frame.rawDepth.set(0);
+        frame.color.allocate(kinectWidth, kinectHeight, 3);
+        frame.color.set(0);
+        for (int level = 0; level < GradientField::numLevels; level++)
+            frame.gradient[level] = GradientFieldLevel();
+        frame.metrics = FilterFrameMetrics();
+        frame.timestamp = 0;
+        frame.arrival = 0;
+        frame.filtered = 0;
+        frame.sequence = 0;
+        frame.dirty.resize(kinectWidth, kinectHeight);
+        frame.dirty.setAll();
+    }
 	return openKinect();
 }
 
+void KinectGrabber::setFrameSource(std::shared_ptr<FrameSource> newSource) {
+	source = newSource;
+}
+
 bool KinectGrabber::openKinect() {
-	kinectOpened = kinect.open();
+	kinectOpened = source->open();
 	return kinectOpened;
 }
-void KinectGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffset, ofRectangle ROI, bool sspatialFilter, bool sfollowBigChange, int snumAveragingSlots) {
-    gradFieldresolution = sgradFieldresolution;
-    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Gradient Field resolution: " << gradFieldresolution;
-    gradFieldcols = width / gradFieldresolution;
-    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Width: " << width << " Gradient Field Cols: " << gradFieldcols;
-    gradFieldrows = height / gradFieldresolution;
-    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Height: " << height << " Gradient Field Rows: " << gradFieldrows;
+
+bool KinectGrabber::startRecording(std::string path, int colorInterval) {
+	return recorder.start(path, kinectWidth, kinectHeight, colorInterval, getWorldMatrix());
+}
+
+void KinectGrabber::stopRecording() {
+	recorder.stop();
+}
+void KinectGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffset, ofRectangle ROI, bool sspatialFilter, bool sfollowBigChange, int snumAveragingSlots,
+	DepthFilterStorage storage, DepthFilterMode mode) {
+    gradientResolution = sgradFieldresolution;
+    gradientField.setup(width, height, gradientResolution, decimation);
+    gradientFieldOutdated = true;
+    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Gradient Field resolution: " << gradientField.getBaseResolution();
+    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Width: " << width << " Gradient Field Cols: " << gradientField.getLevel(0).cols;
+    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Height: " << height << " Gradient Field Rows: " << gradientField.getLevel(0).rows;
     
     spatialFilter = sspatialFilter;
     followBigChange = sfollowBigChange;
+    filterStorage = storage;
+    filterMode = mode;
     numAveragingSlots = snumAveragingSlots;
     minNumSamples = (numAveragingSlots+1)/2;
     maxOffset = newMaxOffset;
@@ -98,103 +210,586 @@ void KinectGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffse
     minInitFrame = 60;
     
     //Setup ROI
-    setKinectROI(ROI);
+    updateROI(ROI);
     
     //setting buffers
-	initiateBuffers();
+	resetBuffers();
 }
 
 void KinectGrabber::initiateBuffers(void){
-	filteredframe.set(0);
-
-    averagingBuffer=new float[numAveragingSlots*height*width];
-    float* averagingBufferPtr=averagingBuffer;
-    for(int i=0;i<numAveragingSlots;++i)
-        for(unsigned int y=0;y<height;++y)
-            for(unsigned int x=0;x<width;++x,++averagingBufferPtr)
-                *averagingBufferPtr=initialValue;
-    
+    if (!carveBuffers(bufferArena))
+        return;
+    filteredframe.set(0);
+    if (decimation > 1)
+        upsampledframe.set(0);
+    initiateAveragingBuffers();
     averagingSlotIndex=0;
     
-    /* Initialize the statistics buffer: */
-    statBuffer=new float[height*width*3];
-    float* sbPtr=statBuffer;
-    for(unsigned int y=0;y<height;++y)
-        for(unsigned int x=0;x<width;++x)
-            for(int i=0;i<3;++i,++sbPtr)
-                *sbPtr=0.0;
-    
     /* Initialize the valid buffer: */
-    validBuffer=new float[height*width];
     float* vbPtr=validBuffer;
     for(unsigned int y=0;y<height;++y)
         for(unsigned int x=0;x<width;++x,++vbPtr)
             *vbPtr=initialValue;
     
-    /* Initialize the gradient field buffer: */
-    gradField = new ofVec2f[gradFieldcols*gradFieldrows];
-    ofVec2f* gfPtr=gradField;
-    for(unsigned int y=0;y<gradFieldrows;++y)
-        for(unsigned int x=0;x<gradFieldcols;++x,++gfPtr)
-            *gfPtr=ofVec2f(0);
-    
     bufferInitiated = true;
     currentInitFrame = 0;
     firstImageReady = false;
 }
 
-void KinectGrabber::resetBuffers(void){
-    if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
+bool KinectGrabber::carveBuffers(FrameArena& arena){
+    size_t numPixels = height*width;
+    size_t size = FrameArena::alignedSize(numPixels*sizeof(RawDepth)) + 3*FrameArena::alignedSize(numPixels*sizeof(float));
+    if (filterMode == DEPTH_FILTER_MODE_RECURSIVE)
+        size += 2*FrameArena::alignedSize(numPixels*sizeof(float));
+    else if (filterStorage == DEPTH_FILTER_STORAGE_FIXED)
+        size += FrameArena::alignedSize(numAveragingSlots*numPixels*sizeof(uint16_t)) + FrameArena::alignedSize(numPixels*sizeof(uint16_t))
+            + FrameArena::alignedSize(numPixels*sizeof(uint32_t)) + FrameArena::alignedSize(numPixels*sizeof(uint64_t));
+    else
+        size += FrameArena::alignedSize(numAveragingSlots*numPixels*sizeof(float)) + FrameArena::alignedSize(3*numPixels*sizeof(float));
+    size_t numKinectPixels = kinectHeight*kinectWidth;
+    if (decimation > 1)
+        size += FrameArena::alignedSize(numKinectPixels*sizeof(float));
+    if (!arena.reserve(size)){
+        ofLogError("kinectGrabber") << "carveBuffers(): could not allocate " << size << " bytes for the filter buffers";
+        return false;
+    }
+    bufferMemory = arena.getCapacity();
+    bufferHugePages = arena.usesHugePages();
+
+    kinectDepthImage.setFromExternalPixels(arena.allocate<RawDepth>(numPixels), width, height, 1);
+    filteredframe.setFromExternalPixels(arena.allocate<float>(numPixels), width, height, 1);
+    validBuffer = arena.allocate<float>(numPixels);
+    referenceFrame = arena.allocate<float>(numPixels);
+    if (decimation > 1)
+        upsampledframe.setFromExternalPixels(arena.allocate<float>(numKinectPixels), kinectWidth, kinectHeight, 1);
+    allTilesDirty = true;
+    averagingBuffer = statBuffer = nullptr;
+    fixedAveragingBuffer = fixedCountBuffer = nullptr;
+    fixedSumBuffer = nullptr;
+    fixedSumSqBuffer = nullptr;
+    estimateBuffer = varianceBuffer = nullptr;
+    if (filterMode == DEPTH_FILTER_MODE_RECURSIVE){
+        estimateBuffer = arena.allocate<float>(numPixels);
+        varianceBuffer = arena.allocate<float>(numPixels);
+    } else if (filterStorage == DEPTH_FILTER_STORAGE_FIXED){
+        fixedAveragingBuffer = arena.allocate<uint16_t>(numAveragingSlots*numPixels);
+        fixedCountBuffer = arena.allocate<uint16_t>(numPixels);
+        fixedSumBuffer = arena.allocate<uint32_t>(numPixels);
+        fixedSumSqBuffer = arena.allocate<uint64_t>(numPixels);
+    } else {
+        averagingBuffer = arena.allocate<float>(numAveragingSlots*numPixels);
+        statBuffer = arena.allocate<float>(3*numPixels);
     }
+    return true;
+}
+
+void KinectGrabber::initiateAveragingBuffers(void){
+    if (filterMode == DEPTH_FILTER_MODE_RECURSIVE)
+    {
+        /* No estimates yet: */
+        std::fill(estimateBuffer, estimateBuffer+height*width, 0.0f);
+        std::fill(varianceBuffer, varianceBuffer+height*width, 0.0f);
+    }
+    else if (filterStorage == DEPTH_FILTER_STORAGE_FIXED)
+    {
+        /* Empty averaging slots and zero statistics, in integers: */
+        std::fill(fixedAveragingBuffer, fixedAveragingBuffer+numAveragingSlots*height*width, DEPTH_FILTER_FIXED_EMPTY_SLOT);
+        std::fill(fixedCountBuffer, fixedCountBuffer+height*width, 0);
+        std::fill(fixedSumBuffer, fixedSumBuffer+height*width, 0);
+        std::fill(fixedSumSqBuffer, fixedSumSqBuffer+height*width, 0);
+    }
+    else
+    {
+        float* averagingBufferPtr=averagingBuffer;
+        for(int i=0;i<numAveragingSlots;++i)
+            for(unsigned int y=0;y<height;++y)
+                for(unsigned int x=0;x<width;++x,++averagingBufferPtr)
+                    *averagingBufferPtr=initialValue;
+
+        /* Initialize the statistics buffer (count, sum and sum of squares planes): */
+        float* sbPtr=statBuffer;
+        for(int i=0;i<3;++i)
+            for(unsigned int y=0;y<height;++y)
+                for(unsigned int x=0;x<width;++x,++sbPtr)
+                    *sbPtr=0.0;
+    }
+}
+
+void KinectGrabber::resetBuffers(void){
+    freeBuffers();
     initiateBuffers();
 }
 
+// The arena keeps its block for the next initiateBuffers()
+void KinectGrabber::freeBuffers(void){
+    bufferInitiated = false;
+}
+
+// Forget everything about one pixel, as if the filter had just been set up
+void KinectGrabber::resetPixel(int idx){
+    int stride = height*width;
+    validBuffer[idx] = initialValue;
+    if (filterMode == DEPTH_FILTER_MODE_RECURSIVE){
+        estimateBuffer[idx] = 0;
+        varianceBuffer[idx] = 0;
+    } else if (filterStorage == DEPTH_FILTER_STORAGE_FIXED){
+        for (int s = 0; s < numAveragingSlots; s++)
+            fixedAveragingBuffer[s*stride + idx] = DEPTH_FILTER_FIXED_EMPTY_SLOT;
+        fixedCountBuffer[idx] = 0;
+        fixedSumBuffer[idx] = 0;
+        fixedSumSqBuffer[idx] = 0;
+    } else {
+        for (int s = 0; s < numAveragingSlots; s++)
+            averagingBuffer[s*stride + idx] = initialValue;
+        for (int plane = 0; plane < 3; plane++)
+            statBuffer[plane*stride + idx] = 0;
+    }
+}
+
+// Move to a new ROI keeping the filter state of the pixels that stay
+// inside. The buffers cover the whole frame but only the ROI is filtered,
+// so the pixels entering the ROI hold outdated samples and start over;
+// while they warm up the image does not count as stabilized
+void KinectGrabber::changeROI(ofRectangle ROI){
+    int oldMinX = minX, oldMaxX = maxX, oldMinY = minY, oldMaxY = maxY;
+    updateROI(ROI);
+    if (!bufferInitiated)
+        return;
+
+    bool grown = false;
+    float* data = filteredframe.getData();
+    for (int y = 0; y < (int)height; y++)
+    {
+        for (int x = 0; x < (int)width; x++)
+        {
+            int idx = y * width + x;
+            bool inside = x >= minX && x < maxX && y >= minY && y < maxY;
+            bool wasInside = x >= oldMinX && x < oldMaxX && y >= oldMinY && y < oldMaxY;
+            if (!inside)
+                data[idx] = 0;
+            else if (!wasInside)
+            {
+                resetPixel(idx);
+                grown = true;
+            }
+        }
+    }
+    if (grown)
+    {
+        currentInitFrame = 0;
+        firstImageReady = false;
+    }
+}
+
+// Change the number of averaging slots, the storage and/or the filter mode
+// without losing the history: the newest samples of each ROI pixel are
+// copied, oldest first, into slots 0.. of the new buffers and the
+// statistics recomputed from them. With more slots the extra ones start
+// empty and fill up, with fewer only the newest samples are kept. The
+// recursive filter starts from the mean of the samples with the variance
+// of a mean, and its estimate fills as many slots as it is worth samples
+// when going back. The valid values are copied, so the display keeps going
+// and stays stabilized. The buffers move to a new arena block, the old one
+// is given back once they are copied
+void KinectGrabber::resampleFilterState(int newNumSlots, DepthFilterStorage newStorage, DepthFilterMode newMode){
+    int oldNumSlots = numAveragingSlots;
+    DepthFilterStorage oldStorage = filterStorage;
+    DepthFilterMode oldMode = filterMode;
+    int oldSlotIndex = averagingSlotIndex;
+    const float* oldAveraging = averagingBuffer;
+    const uint16_t* oldFixedAveraging = fixedAveragingBuffer;
+    const float* oldEstimate = estimateBuffer;
+    const float* oldVariance = varianceBuffer;
+    const RawDepth* oldDepth = kinectDepthImage.getData();
+    const float* oldFiltered = filteredframe.getData();
+    const float* oldValid = validBuffer;
+    const float* oldUpsampled = upsampledframe.getData();
+
+    numAveragingSlots = newNumSlots;
+    filterStorage = newStorage;
+    filterMode = newMode;
+    FrameArena arena;
+    arena.setHugePages(useHugePages);
+    if (!carveBuffers(arena)){
+        // Back to the old views, the old block is big enough for them
+        numAveragingSlots = oldNumSlots;
+        filterStorage = oldStorage;
+        filterMode = oldMode;
+        carveBuffers(bufferArena);
+        return;
+    }
+    minNumSamples = (numAveragingSlots+1)/2;
+    initiateAveragingBuffers();
+    memcpy(kinectDepthImage.getData(), oldDepth, height*width*sizeof(RawDepth));
+    memcpy(filteredframe.getData(), oldFiltered, height*width*sizeof(float));
+    memcpy(validBuffer, oldValid, height*width*sizeof(float));
+    if (decimation > 1)
+        memcpy(upsampledframe.getData(), oldUpsampled, kinectHeight*kinectWidth*sizeof(float));
+
+    const int stride = height*width;
+    const int kept = oldMode == DEPTH_FILTER_MODE_AVERAGING ? std::min(oldNumSlots, newNumSlots) : newNumSlots;
+    int numBands = getNumBands();
+    workerPool.run(numBands, [&](int band) {
+        std::vector<float> samples(kept);
+        for (int y = bandStart(band, numBands); y < bandStart(band+1, numBands); y++)
+        {
+            for (int x = minX; x < maxX; x++)
+            {
+                int idx = y*width + x;
+                if (oldMode == DEPTH_FILTER_MODE_RECURSIVE && filterMode == DEPTH_FILTER_MODE_RECURSIVE)
+                {
+                    estimateBuffer[idx] = oldEstimate[idx];
+                    varianceBuffer[idx] = oldVariance[idx];
+                    continue;
+                }
+
+                // Oldest sample first, initialValue for empty slots
+                int numSamples = 0;
+                if (oldMode == DEPTH_FILTER_MODE_RECURSIVE)
+                {
+                    if (oldVariance[idx] > 0)
+                        numSamples = std::max(static_cast<int>(std::min(maxVariance / oldVariance[idx], static_cast<float>(kept))), 1);
+                    std::fill(samples.begin(), samples.begin() + numSamples, oldEstimate[idx]);
+                }
+                else
+                {
+                    for (; numSamples < kept; numSamples++)
+                    {
+                        int oldSlot = (oldSlotIndex + oldNumSlots - kept + numSamples) % oldNumSlots;
+                        if (oldStorage == DEPTH_FILTER_STORAGE_FIXED)
+                        {
+                            uint16_t v = oldFixedAveraging[oldSlot*stride + idx];
+                            samples[numSamples] = v == DEPTH_FILTER_FIXED_EMPTY_SLOT ? initialValue : v;
+                        }
+                        else
+                            samples[numSamples] = oldAveraging[oldSlot*stride + idx];
+                    }
+                }
+
+                int count = 0;
+                double sum = 0, sumSq = 0;
+                for (int j = 0; j < numSamples; j++)
+                {
+                    float value = samples[j];
+                    bool empty = value == initialValue;
+                    if (filterMode == DEPTH_FILTER_MODE_AVERAGING)
+                    {
+                        if (filterStorage == DEPTH_FILTER_STORAGE_FIXED)
+                            fixedAveragingBuffer[j*stride + idx] = empty ? DEPTH_FILTER_FIXED_EMPTY_SLOT : static_cast<uint16_t>(std::min(std::max(value + 0.5f, 0.0f), 65534.0f));
+                        else
+                            averagingBuffer[j*stride + idx] = value;
+                    }
+                    if (!empty)
+                    {
+                        count++;
+                        sum += value;
+                        sumSq += value * value;
+                    }
+                }
+                if (filterMode == DEPTH_FILTER_MODE_RECURSIVE)
+                {
+                    estimateBuffer[idx] = count > 0 ? static_cast<float>(sum / count) : 0;
+                    varianceBuffer[idx] = count > 0 ? maxVariance / count : 0;
+                }
+                else if (filterStorage == DEPTH_FILTER_STORAGE_FIXED)
+                {
+                    fixedCountBuffer[idx] = count;
+                    fixedSumBuffer[idx] = static_cast<uint32_t>(sum);
+                    fixedSumSqBuffer[idx] = static_cast<uint64_t>(sumSq);
+                }
+                else
+                {
+                    statBuffer[idx] = count;
+                    statBuffer[stride + idx] = sum;
+                    statBuffer[2*stride + idx] = sumSq;
+                }
+            }
+        }
+    });
+    // The copies of a recursive estimate are all alike, any slot can go first
+    averagingSlotIndex = oldMode == DEPTH_FILTER_MODE_AVERAGING ? kept % newNumSlots : 0;
+    bufferArena.swap(arena); // The old block goes with arena
+}
+
 void KinectGrabber::threadedFunction() {
+	typedef std::chrono::steady_clock Clock;
+	typedef std::chrono::duration<double, std::micro> Micros;
+	const uint64_t maxWait = 100000; // Check isThreadRunning() at least this often
+	busyTime = 0;
+	idleTime = 0;
 	while(isThreadRunning()) {
+        Clock::time_point busyStart = Clock::now();
         this->actionsLock.lock(); // Update the grabber state if needed
         for(auto & action : this->actions) {
             action(*this);
         }
         this->actions.clear();
         this->actionsLock.unlock();
+        applyCommands();
         
-        kinect.update();
-        if(kinect.isFrameNew()){
-            kinectDepthImage = kinect.getRawDepthPixels();
-            filter();
-            filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
-            updateGradientField();
-			kinectColorImage.setFromPixels(kinect.getPixels());
-        }
-        if (storedframes == 0)
-        {
-            filtered.send(std::move(filteredframe));
-			gradient.send(std::move(gradField));
-            colored.send(std::move(kinectColorImage.getPixels()));
-            lock();
-            storedframes += 1;
-            unlock();
+        source->update();
+        if(source->isFrameNew()){
+            // As close to the USB transfer as we get, ofxKinect receives it in its own thread
+            uint64_t arrival = ofGetElapsedTimeMicros();
+            if (recorder.isRecording())
+                recorder.addFrame(source->getTimestamp(), source->getRawDepthPixels(), source->getPixels());
+            colorFilter.addFrame(source->getPixels());
+            processFrame(source->getRawDepthPixels());
+            publishFrame(source->getTimestamp(), arrival);
         }
-        
+
+        // Sleep until the next frame is due, an action is queued or stop() is called
+        Clock::time_point idleStart = Clock::now();
+        busyTime += static_cast<uint64_t>(Micros(idleStart - busyStart).count());
+        uint64_t wait = std::min(source->getWaitTime(), maxWait);
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        if (wait > 0 && !wakeRequested && isThreadRunning())
+            wakeCondition.wait_for(lock, std::chrono::microseconds(wait), [this]() { return wakeRequested; });
+        wakeRequested = false;
+        lock.unlock();
+        idleTime += static_cast<uint64_t>(Micros(Clock::now() - idleStart).count());
     }
-    kinect.close();
-    delete[] averagingBuffer;
-    delete[] statBuffer;
-    delete[] validBuffer;
-    delete[] gradField;
+    recorder.stop();
+    source->close();
+    freeBuffers();
 }
 
 void KinectGrabber::performInThread(std::function<void(KinectGrabber&)> action) {
     this->actionsLock.lock();
     this->actions.push_back(action);
     this->actionsLock.unlock();
+    wake();
+}
+
+void KinectGrabber::queueCommand(GrabberCommand command) {
+    command.queueTime = ofGetElapsedTimeMicros();
+    command.sequence = ++commandSequence;
+    // The latest command of a type must not get lost, but the main loop must
+    // not wait for a stalled grabber thread either. Only the latest command
+    // of each type is applied, so a full queue is overflowed into one slot
+    // per type
+    if (!commands.push(command) && command.type < GRABBER_COMMAND_COUNT) {
+        std::lock_guard<std::mutex> lock(overflowMutex);
+        if (!overflowPending[command.type] || command.sequence > overflowCommands[command.type].sequence)
+            overflowCommands[command.type] = command;
+        overflowPending[command.type] = true;
+        hasOverflow = true;
+        numOverflowedCommands++;
+    }
+    wake();
+}
+
+// Take all queued and overflowed commands and keep the latest of each type,
+// then apply them. None of them restarts the filtering of the pixels that
+// stay in the ROI
+void KinectGrabber::applyCommands() {
+    GrabberCommand latest[GRABBER_COMMAND_COUNT];
+    bool pending[GRABBER_COMMAND_COUNT] = {};
+    int numQueued = 0;
+    uint64_t oldestQueueTime = 0;
+    auto coalesce = [&](const GrabberCommand& command) {
+        if (numQueued == 0 || command.queueTime < oldestQueueTime)
+            oldestQueueTime = command.queueTime;
+        numQueued++;
+        if (command.type < GRABBER_COMMAND_COUNT && (!pending[command.type] || command.sequence > latest[command.type].sequence)) {
+            latest[command.type] = command;
+            pending[command.type] = true;
+        }
+    };
+    GrabberCommand command;
+    while (commands.pop(command))
+        coalesce(command);
+    if (hasOverflow) {
+        std::lock_guard<std::mutex> lock(overflowMutex);
+        for (int type = 0; type < GRABBER_COMMAND_COUNT; type++)
+            if (overflowPending[type]) {
+                coalesce(overflowCommands[type]);
+                overflowPending[type] = false;
+            }
+        hasOverflow = false;
+    }
+    if (numQueued == 0)
+        return;
+
+    // Both set the ROI, the latest one wins
+    const GrabberCommand* ROICommand = nullptr;
+    if (pending[GRABBER_COMMAND_FULL_FRAME_FILTERING])
+        ROICommand = &latest[GRABBER_COMMAND_FULL_FRAME_FILTERING];
+    if (pending[GRABBER_COMMAND_ROI] && (!ROICommand || latest[GRABBER_COMMAND_ROI].sequence > ROICommand->sequence))
+        ROICommand = &latest[GRABBER_COMMAND_ROI];
+
+    // The ROI, slot count, storage, mode and huge pages are changed once, after
+    // all other settings, and the buffers moved at most once
+    int numApplied = 0;
+    int newNumSlots = numAveragingSlots;
+    DepthFilterStorage newStorage = filterStorage;
+    DepthFilterMode newMode = filterMode;
+    bool newHugePages = useHugePages;
+    int newDecimation = decimation;
+    for (int type = 0; type < GRABBER_COMMAND_COUNT; type++) {
+        if (!pending[type])
+            continue;
+        const GrabberCommand& c = latest[type];
+        numApplied++;
+        switch (type) {
+        case GRABBER_COMMAND_NUM_FILTER_THREADS:
+            setNumFilterThreads(static_cast<int>(c.value));
+            break;
+        case GRABBER_COMMAND_FILTER_STORAGE:
+            newStorage = static_cast<DepthFilterStorage>(static_cast<int>(c.value));
+            break;
+        case GRABBER_COMMAND_FILTER_MODE:
+            newMode = static_cast<DepthFilterMode>(static_cast<int>(c.value));
+            break;
+        case GRABBER_COMMAND_FULL_FRAME_FILTERING:
+            doFullFrameFiltering = c.value != 0;
+            break;
+        case GRABBER_COMMAND_ROI: // Applied below
+            break;
+        case GRABBER_COMMAND_AVERAGING_SLOTS:
+            newNumSlots = static_cast<int>(c.value);
+            break;
+        case GRABBER_COMMAND_FOLLOW_BIG_CHANGE:
+            setFollowBigChange(c.value != 0);
+            break;
+        case GRABBER_COMMAND_MAX_OFFSET:
+            setMaxOffset(c.value);
+            break;
+        case GRABBER_COMMAND_SPATIAL_FILTERING:
+            setSpatialFiltering(c.value != 0);
+            break;
+        case GRABBER_COMMAND_SPATIAL_FILTER_RADIUS:
+            setSpatialFilterRadius(c.value);
+            break;
+        case GRABBER_COMMAND_INPAINTING:
+            setInPainting(c.value != 0);
+            break;
+        case GRABBER_COMMAND_GRADIENT_RESOLUTION:
+            setGradFieldResolution(static_cast<int>(c.value));
+            break;
+        case GRABBER_COMMAND_HUGE_PAGES:
+            newHugePages = c.value != 0;
+            break;
+        case GRABBER_COMMAND_DECIMATION:
+            // Compared with the current one below, so as setDecimation() would
+            newDecimation = getValidDecimation(static_cast<int>(c.value));
+            break;
+        }
+    }
+    if (ROICommand)
+        setKinectROI(ROICommand->ROI);
+    bool moveBuffers = newHugePages != useHugePages;
+    if (moveBuffers) {
+        useHugePages = newHugePages;
+        bufferArena.setHugePages(useHugePages);
+    }
+    // Only a new decimation re-carves the buffers, everything else is resampled
+    if (newDecimation != decimation) {
+        // The filter restarts anyway, nothing to resample
+        numAveragingSlots = newNumSlots;
+        minNumSamples = (numAveragingSlots+1)/2;
+        filterStorage = newStorage;
+        filterMode = newMode;
+        if (moveBuffers)
+            bufferArena.release();
+        setDecimation(newDecimation);
+    } else if (moveBuffers || newNumSlots != numAveragingSlots || newStorage != filterStorage || newMode != filterMode) {
+        if (bufferInitiated) {
+            resampleFilterState(newNumSlots, newStorage, newMode);
+        } else {
+            setAveragingSlotsNumber(newNumSlots);
+            filterStorage = newStorage;
+            filterMode = newMode;
+            if (moveBuffers)
+                bufferArena.release();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(commandStatisticsMutex);
+    commandStatistics.numQueued = numQueued;
+    commandStatistics.numApplied = numApplied;
+    commandStatistics.latency = ofGetElapsedTimeMicros() - oldestQueueTime;
+    commandStatistics.numOverflowed = numOverflowedCommands;
+}
+
+// Copy the results into the back slot of the frame buffer. The slots only
+// get reallocated when the frame or gradient field size changes
+void KinectGrabber::publishFrame(uint64_t timestamp, uint64_t arrival)
+{
+	GrabbedFrame& frame = frames.getBack();
+	frame.filtered = ofGetElapsedTimeMicros();
+	frame.arrival = arrival;
+	if (frame.depth.getWidth() != kinectWidth || frame.depth.getHeight() != kinectHeight)
+		frame.depth.allocate(kinectWidth, kinectHeight, 1);
+	memcpy(frame.depth.getData(), getFilteredFrame().getData(), kinectWidth*kinectHeight*sizeof(float));
+
+	const ofShortPixels& rawDepth = source->getRawDepthPixels();
+	if (frame.rawDepth.getWidth() != rawDepth.getWidth() || frame.rawDepth.getHeight() != rawDepth.getHeight())
+		frame.rawDepth.allocate(rawDepth.getWidth(), rawDepth.getHeight(), 1);
+	memcpy(frame.rawDepth.getData(), rawDepth.getData(), frame.rawDepth.size()*sizeof(RawDepth));
+
+	const ofPixels& color = source->getPixels();
+	if (color.isAllocated())
+	{
+		if (frame.color.getWidth() != color.getWidth() || frame.color.getHeight() != color.getHeight() || frame.color.getNumChannels() != color.getNumChannels())
+			frame.color.allocate(color.getWidth(), color.getHeight(), color.getNumChannels());
+		memcpy(frame.color.getData(), color.getData(), color.size());
+	}
+
+	for (int level = 0; level < GradientField::numLevels; level++)
+		frame.gradient[level] = gradientField.getLevel(level);
+	frame.timestamp = timestamp;
+	frame.sequence = ++frameSequence;
+	frame.metrics = frameMetrics;
+	// The main loop may still have any frame since the last one it is known
+	// to have fetched. Once it took the frame before this one, the next frame
+	// only needs the changes from here on
+	const DirtyTiles& changed = decimation > 1 ? upsampledDirtyTiles : dirtyTiles;
+	pendingDirtyTiles.merge(changed);
+	frame.dirty = pendingDirtyTiles;
+	if (!frames.publish())
+		pendingDirtyTiles = changed;
+}
+
+void KinectGrabber::processFrame(const ofShortPixels& depth)
+{
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point t0 = Clock::now();
+	// Copied into the arena rather than assigned, which would reallocate
+	if (decimation > 1)
+		binDepth(depth);
+	else
+		memcpy(kinectDepthImage.getData(), depth.getData(), std::min(depth.size(), kinectDepthImage.size())*sizeof(RawDepth));
+	filter();
+	Clock::time_point t1 = Clock::now();
+	frameMetrics = FilterFrameMetrics();
+	if (bufferInitiated && doInPaint)
+		applySimpleOutlierInpainting();
+	Clock::time_point t2 = Clock::now();
+	if (bufferInitiated && spatialFilter)
+		applySpaceFilter();
+	Clock::time_point t3 = Clock::now();
+	filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
+	detectChanges();
+	Clock::time_point t4 = Clock::now();
+	// The summed-area tables cannot be patched, but a static sand bed needs no new gradients
+	if (dirtyTiles.any() || gradientFieldOutdated)
+		updateGradientField();
+	Clock::time_point t5 = Clock::now();
+	if (decimation > 1)
+		upsampleFrame();
+	Clock::time_point t6 = Clock::now();
+
+	typedef std::chrono::duration<double, std::micro> Micros;
+	stageTimings.filter = Micros(t1 - t0).count();
+	stageTimings.inpaint = Micros(t2 - t1).count();
+	stageTimings.spaceFilter = Micros(t3 - t2).count();
+	stageTimings.changes = Micros(t4 - t3).count();
+	stageTimings.gradient = Micros(t5 - t4).count();
+	stageTimings.upsample = Micros(t6 - t5).count();
 }
 
+// Temporal filtering only, inpainting and spatial filtering are run by processFrame()
 void KinectGrabber::filter()
 {
 	if (bufferInitiated && numAveragingSlots < 2)
@@ -219,95 +814,73 @@ void KinectGrabber::filter()
 			filteredFramePtr += width - maxX;
 		}
 
-		if (doInPaint)
-		{
-			applySimpleOutlierInpainting();
-		}
-
-		if (spatialFilter)
-		{
-			applySpaceFilter();
-		}
 	}
 	else if (bufferInitiated)
     {
-        const RawDepth* inputFramePtr = static_cast<const RawDepth*>(kinectDepthImage.getData());
-        float* averagingBufferPtr = averagingBuffer+averagingSlotIndex*height*width;
-        float* statBufferPtr = statBuffer;
-        float* validBufferPtr = validBuffer;
-        float* filteredFramePtr = filteredframe.getData();
-        
-        inputFramePtr += minY*width;  // We only scan kinect ROI
-        averagingBufferPtr += minY*width;
-        statBufferPtr += minY*width*3;
-        validBufferPtr += minY*width;
-        filteredFramePtr += minY*width;
+        DepthFilterParameters params;
+        params.numAveragingSlots = numAveragingSlots;
+        params.slotStride = height*width;
+        params.minNumSamples = minNumSamples;
+        params.maxVariance = maxVariance;
+        params.hysteresis = hysteresis;
+        params.maxOffset = maxOffset;
+        params.initialValue = initialValue;
+        params.followBigChange = followBigChange;
+        params.bigChange = bigChange;
+        params.processNoise = getDepthFilterProcessNoise(maxVariance, numAveragingSlots);
+        params.gate = 9; // Three standard deviations
 
-		for(unsigned int y=minY ; y<maxY ; ++y)
-        {
-            inputFramePtr += minX;
-            averagingBufferPtr += minX;
-            statBufferPtr += minX*3;
-            validBufferPtr += minX;
-            filteredFramePtr += minX;
-            for(unsigned int x=minX ; x<maxX ; ++x,++inputFramePtr,++averagingBufferPtr,statBufferPtr+=3,++validBufferPtr,++filteredFramePtr)
+        // Statistics are stored as three planes: sample count, sum and sum of squares
+        float* countPlane = statBuffer;
+        float* sumPlane = statBuffer + height*width;
+        float* sumSqPlane = statBuffer + 2*height*width;
+
+        // We only scan kinect ROI, in bands of rows spread over the worker pool
+        int numBands = getNumBands();
+        workerPool.run(numBands, [&](int band) {
+            for(int y=bandStart(band, numBands) ; y<bandStart(band+1, numBands) ; ++y)
             {
-                float newVal = static_cast<float>(*inputFramePtr);
-                float oldVal = *averagingBufferPtr;
-                
-				if(newVal > maxOffset)//we are under the ceiling plane
+                size_t offset = y*width + minX;
+                if (filterMode == DEPTH_FILTER_MODE_RECURSIVE)
                 {
-                    *averagingBufferPtr = newVal; // Store the value
-                    if (followBigChange && statBufferPtr[0] > 0){ // Follow big changes
-                        float oldFiltered = statBufferPtr[1]/statBufferPtr[0]; // Compare newVal with average
-                        if(oldFiltered-newVal >= bigChange || newVal-oldFiltered >= bigChange)
-                        {
-                            float* aaveragingBufferPtr;
-                            for (int i = 0; i < numAveragingSlots; i++){ // update all averaging slots
-                                aaveragingBufferPtr = averagingBuffer + i*height*width + y*width +x;
-                                *aaveragingBufferPtr = newVal;
-                            }
-                            statBufferPtr[0] = numAveragingSlots; //Update statistics
-                            statBufferPtr[1] = newVal*numAveragingSlots;
-                            statBufferPtr[2] = newVal*newVal*numAveragingSlots;
-                        }
-                    }
-                    /* Update the pixel's statistics: */
-                    ++statBufferPtr[0]; // Number of valid samples
-                    statBufferPtr[1] += newVal; // Sum of valid samples
-                    statBufferPtr[2] += newVal*newVal; // Sum of squares of valid samples
-                    
-                    /* Check if the previous value in the averaging buffer was not initiated */
-                    if(oldVal != initialValue)
-                    {
-                        --statBufferPtr[0]; // Number of valid samples
-                        statBufferPtr[1] -= oldVal; // Sum of valid samples
-                        statBufferPtr[2] -= oldVal * oldVal; // Sum of squares of valid samples
-                    }
+                    DepthFilterRecursiveRow row;
+                    row.input = static_cast<const RawDepth*>(kinectDepthImage.getData()) + offset;
+                    row.estimate = estimateBuffer + offset;
+                    row.variance = varianceBuffer + offset;
+                    row.valid = validBuffer + offset;
+                    row.filtered = filteredframe.getData() + offset;
+                    row.numPixels = maxX - minX;
+                    runDepthFilterRowRecursive(filterKernel, params, row);
+                    continue;
                 }
-                // Check if the pixel is "stable": */
-                if(statBufferPtr[0] >= minNumSamples &&
-                   statBufferPtr[2]*statBufferPtr[0] <= maxVariance*statBufferPtr[0]*statBufferPtr[0] + statBufferPtr[1]*statBufferPtr[1])
+                if (filterStorage == DEPTH_FILTER_STORAGE_FIXED)
                 {
-                    /* Check if the new running mean is outside the previous value's envelope: */
-                    float newFiltered = statBufferPtr[1]/statBufferPtr[0];
-                    if(abs(newFiltered-*validBufferPtr) >= hysteresis)
-                    {
-                        /* Set the output pixel value to the depth-corrected running mean: */
-                        *filteredFramePtr = *validBufferPtr = newFiltered;
-                    } else {
-                        /* Leave the pixel at its previous value: */
-                        *filteredFramePtr = *validBufferPtr;
-                    }
+                    DepthFilterFixedRow row;
+                    row.input = static_cast<const RawDepth*>(kinectDepthImage.getData()) + offset;
+                    row.averagingSlots = fixedAveragingBuffer + offset;
+                    row.averagingSlotIndex = averagingSlotIndex;
+                    row.count = fixedCountBuffer + offset;
+                    row.sum = fixedSumBuffer + offset;
+                    row.sumSq = fixedSumSqBuffer + offset;
+                    row.valid = validBuffer + offset;
+                    row.filtered = filteredframe.getData() + offset;
+                    row.numPixels = maxX - minX;
+                    runDepthFilterRowFixed(filterKernel, params, row);
+                    continue;
                 }
-                *filteredFramePtr = *validBufferPtr;
-			}
-            inputFramePtr += width-maxX;
-            averagingBufferPtr += width-maxX;
-            statBufferPtr += (width-maxX)*3;
-            validBufferPtr += width-maxX;
-            filteredFramePtr += width-maxX;
-        }
+                DepthFilterRow row;
+                row.input = static_cast<const RawDepth*>(kinectDepthImage.getData()) + offset;
+                row.averagingSlots = averagingBuffer + offset;
+                row.averagingSlotIndex = averagingSlotIndex;
+                row.count = countPlane + offset;
+                row.sum = sumPlane + offset;
+                row.sumSq = sumSqPlane + offset;
+                row.valid = validBuffer + offset;
+                row.filtered = filteredframe.getData() + offset;
+                row.numPixels = maxX - minX;
+                runDepthFilterRow(filterKernel, params, row);
+            }
+        });
 
         /* Go to the next averaging slot: */
         if(++averagingSlotIndex==numAveragingSlots)
@@ -318,243 +891,197 @@ void KinectGrabber::filter()
             if(currentInitFrame > minInitFrame)
                 firstImageReady = true;
         }
-        
-		if (doInPaint)
-		{
-			applySimpleOutlierInpainting();
-		}
-
-        /* Apply a spatial filter if requested: */
-        if(spatialFilter)
-        {
-            applySpaceFilter();
-        }
 	}
 }
 
-void KinectGrabber::setFullFrameFiltering(bool ff, ofRectangle ROI)
+void KinectGrabber::setNumFilterThreads(int numThreads)
 {
-	doFullFrameFiltering = ff;
-	if (ff)
-	{
-		setKinectROI(ofRectangle(0, 0, width, height));
-	}
-	else 
-	{
-		setKinectROI(ROI);
-		float *data = filteredframe.getData();
+	workerPool.setNumThreads(numThreads);
+	ofLogVerbose("kinectGrabber") << "setNumFilterThreads(): filtering with " << workerPool.getNumThreads() << " threads";
+}
 
-		// Clear all pixels outside ROI
-		for (unsigned int y = 0; y < height; y++)
-		{
-			for (unsigned int x = 0; x < width; x++)
-			{
-				if (y < minY || y >= maxY || x < minX || x >= maxX)
-				{
-					int idx = y * width + x;
-					data[idx] = 0;
-				}
-			}
-		}
+int KinectGrabber::getNumBands()
+{
+	// Bands of at least 16 rows, the thread wake up costs more than filtering fewer
+	return std::max(1, std::min(workerPool.getNumThreads(), (maxY - minY) / 16));
+}
 
-	}
+int KinectGrabber::bandStart(int band, int numBands)
+{
+	return minY + (maxY - minY) * band / numBands;
+}
+
+void KinectGrabber::setFilterKernel(DepthFilterKernel kernel)
+{
+	// Never pick an instruction set the CPU does not have
+	filterKernel = kernel <= getBestDepthFilterKernel() ? kernel : getBestDepthFilterKernel();
+}
+
+void KinectGrabber::setFullFrameFiltering(bool ff, ofRectangle ROI)
+{
+	doFullFrameFiltering = ff;
+	setKinectROI(ROI); // The whole frame if ff
 }
 
+// Gaussian low-pass filter over the ROI
 void KinectGrabber::applySpaceFilter()
 {
-    for(int filterPass=0;filterPass<2;++filterPass)
-    {
-		// Pointer to first pixel of ROI
-		float *ptrOffset = filteredframe.getData() + minY * width + minX;
+    spaceFilter.apply(filteredframe.getData(), width, minX, minY, maxX, maxY, workerPool);
+}
 
-        // Low-pass filter the values in the ROI
-		// First a horisontal pass
-        for(unsigned int x = 0; x < width; x++)
-        {
-			// Pointer to current pixel
-            float* colPtr = ptrOffset + x;
-			float lastVal = *colPtr;
-
-            // Top border pixels 
-            *colPtr = (colPtr[0]*2.0f + colPtr[width]) / 3.0f;
-            colPtr += width;
-            
-            // Filter the interior pixels in the column
-            for(unsigned int y = minY+1; y < maxY-1; ++y, colPtr += width)
-            {
-				float nextLastVal = *colPtr;
-                *colPtr=(lastVal + colPtr[0]*2.0f + colPtr[width])*0.25f;
-				lastVal = nextLastVal; // To avoid using already updated pixels
-            }
-            
-            // Filter the last pixel in the column: 
-            *colPtr=(lastVal + colPtr[0] * 2.0f)/3.0f;
-        }
+void KinectGrabber::setSpatialFilterRadius(float radius)
+{
+    spatialFilterRadius = radius;
+    spaceFilter.setRadius(radius / decimation);
+}
 
-		// then a vertical pass
-        for(unsigned int y = 0; y < height; y++)
+// Bin the blocks of the ROI only, like filter() the rest is never read
+void KinectGrabber::binDepth(const ofShortPixels& depth)
+{
+    const int inputWidth = depth.getWidth();
+    const int d = decimation;
+    if (inputWidth < (int)width*d || (int)depth.getHeight() < (int)height*d)
+        return;
+    int numBands = getNumBands();
+    workerPool.run(numBands, [&](int band) {
+        for (int y = bandStart(band, numBands); y < bandStart(band+1, numBands); y++)
         {
-			// Pointer to current pixel
-			float* rowPtr = ptrOffset + y * width;
-			
-			// Filter the first pixel in the row: 
-            float lastVal=*rowPtr;
-            *rowPtr=(rowPtr[0]*2.0f + rowPtr[1]) / 3.0f;
-            rowPtr++;
-       
-            // Filter the interior pixels in the row: 
-            for(unsigned int x = minX+1; x < maxX-1; ++x,++rowPtr)
-            {
-                float nextLastVal=*rowPtr;
-                *rowPtr=(lastVal+rowPtr[0]*2.0f+rowPtr[1])*0.25f;
-                lastVal=nextLastVal;
-            }
-            
-            // Filter the last pixel in the row: 
-            *rowPtr=(lastVal+rowPtr[0]*2.0f)/3.0f;
+            const RawDepth* input = depth.getData() + y*d*inputWidth + minX*d;
+            RawDepth* output = kinectDepthImage.getData() + y*width + minX;
+            if (d == 4)
+                binRow<4>(input, inputWidth, output, maxX - minX);
+            else
+                binRow<2>(input, inputWidth, output, maxX - minX);
         }
+    });
+}
+
+// The temporal filter has to see every pixel to keep its statistics, so
+// changes are found in the final filtered frame
+void KinectGrabber::detectChanges()
+{
+    dirtyTiles.clear();
+    if (!bufferInitiated)
+    {
+        dirtyTiles.setAll();
+        allTilesDirty = true;
+    }
+    else if (allTilesDirty)
+    {
+        // The ROI moved or the filter restarted: pixels outside the ROI changed too
+        dirtyTiles.setAll();
+        memcpy(referenceFrame, filteredframe.getData(), width*height*sizeof(float));
+        allTilesDirty = false;
+    }
+    else
+    {
+        // The hole filler also writes a margin around the filtered pixels
+        int x0 = std::max(minX - HoleFiller::fillMargin, 0), x1 = std::min(maxX + HoleFiller::fillMargin, static_cast<int>(width));
+        int y0 = std::max(minY - HoleFiller::fillMargin, 0), y1 = std::min(maxY + HoleFiller::fillMargin, static_cast<int>(height));
+        int firstTileRow = y0 / DirtyTiles::tileSize;
+        int numTileRows = (y1 + DirtyTiles::tileSize - 1) / DirtyTiles::tileSize - firstTileRow;
+        int numBands = std::max(1, std::min(getNumBands(), numTileRows));
+        workerPool.run(numBands, [&](int band) {
+            int end = firstTileRow + numTileRows * (band + 1) / numBands;
+            for (int tileY = firstTileRow + numTileRows * band / numBands; tileY < end; tileY++)
+                dirtyTiles.detectRow(tileY, filteredframe.getData(), referenceFrame, width, x0, y0, x1, y1);
+        });
     }
+    frameMetrics.dirtyTiles = dirtyTiles.count();
+    int numROITiles = DirtyTiles::countTiles(minX, minY, maxX, maxY);
+    frameMetrics.dirtyFraction = numROITiles > 0 ? std::min(1.0f, static_cast<float>(frameMetrics.dirtyTiles) / numROITiles) : 0;
 }
 
-void KinectGrabber::updateGradientField()
+// Bilinear interpolation of the filtered pixels around each Kinect pixel of
+// the tiles that changed. Where one of them is not a valid depth, like
+// outside the ROI, the nearest one is taken instead so holes do not bleed
+void KinectGrabber::upsampleFrame()
 {
-    int ind = 0;
-    float gx;
-    float gy;
-    int gvx, gvy;
-    float lgth = 0;
-    float* filteredFramePtr=filteredframe.getData();
-    for(unsigned int y=0;y<gradFieldrows;++y) {
-        for(unsigned int x=0;x<gradFieldcols;++x) {
-            if (isInsideROI(x*gradFieldresolution, y*gradFieldresolution) && isInsideROI((x+1)*gradFieldresolution, (y+1)*gradFieldresolution) ){
-                gx = 0;
-                gvx = 0;
-                gy = 0;
-                gvy = 0;
-                for (unsigned int i=0; i<gradFieldresolution; i++) {
-                    ind = y*gradFieldresolution*width+i*width+x*gradFieldresolution;
-                    if (filteredFramePtr[ind]!= 0 && filteredFramePtr[ind+gradFieldresolution-1]!=0){
-                        gvx+=1;
-                        gx+=filteredFramePtr[ind]-filteredFramePtr[ind+gradFieldresolution-1];
-                    }
-                    ind = y*gradFieldresolution*width+i+x*gradFieldresolution;
-                    if (filteredFramePtr[ind]!= 0 && filteredFramePtr[ind+(gradFieldresolution-1)*width]!=0){
-                        gvy+=1;
-                        gy+=filteredFramePtr[ind]-filteredFramePtr[ind+(gradFieldresolution-1)*width];
+    upsampledDirtyTiles.upscale(dirtyTiles, decimation);
+    const float* input = filteredframe.getData();
+    float* output = upsampledframe.getData();
+    const int d = decimation;
+    const float scale = 1.0f / d;
+    const float offset = 0.5f * scale - 0.5f; // Kinect pixel centres in filtered pixels
+
+    // The same for every row: left neighbour, its weight and nearest pixel of each column
+    upsampleColumns.resize(kinectWidth);
+    upsampleWeights.resize(kinectWidth);
+    upsampleNearest.resize(kinectWidth);
+    for (int x = 0; x < (int)kinectWidth; x++)
+    {
+        float sx = std::min(std::max(x * scale + offset, 0.0f), width - 1.0f);
+        upsampleColumns[x] = std::min(static_cast<int>(sx), (int)width - 2);
+        upsampleWeights[x] = sx - upsampleColumns[x];
+        upsampleNearest[x] = std::min(x / d, (int)width - 1);
+    }
+    int numTileRows = upsampledDirtyTiles.getNumTilesY();
+    int numBands = std::max(1, std::min(workerPool.getNumThreads(), numTileRows));
+    workerPool.run(numBands, [&](int band) {
+        int end = numTileRows * (band + 1) / numBands;
+        for (int tileY = numTileRows * band / numBands; tileY < end; tileY++)
+        {
+            int y1 = std::min((tileY + 1) * DirtyTiles::tileSize, (int)kinectHeight);
+            for (int tileX = 0; tileX < upsampledDirtyTiles.getNumTilesX(); tileX++)
+            {
+                if (!upsampledDirtyTiles.isDirty(tileX, tileY))
+                    continue;
+                int x0 = tileX * DirtyTiles::tileSize;
+                int x1 = std::min(x0 + DirtyTiles::tileSize, (int)kinectWidth);
+                for (int y = tileY * DirtyTiles::tileSize; y < y1; y++)
+                {
+                    // The Kinect frames are far larger than 2x2 filtered pixels
+                    float sy = std::min(std::max(y * scale + offset, 0.0f), height - 1.0f);
+                    int iy = std::min(static_cast<int>(sy), (int)height - 2);
+                    float fy = sy - iy;
+                    const float* top = input + iy*width;
+                    const float* bottom = top + width;
+                    const float* nearest = input + std::min(y / d, (int)height - 1)*width;
+                    for (int x = x0; x < x1; x++)
+                    {
+                        int ix = upsampleColumns[x];
+                        float fx = upsampleWeights[x];
+                        float a = top[ix], b = top[ix + 1], c = bottom[ix], e = bottom[ix + 1];
+                        if (a > 0 && a < initialValue && b > 0 && b < initialValue && c > 0 && c < initialValue && e > 0 && e < initialValue)
+                        {
+                            float upper = a + (b - a) * fx;
+                            float lower = c + (e - c) * fx;
+                            output[y*kinectWidth + x] = upper + (lower - upper) * fy;
+                        }
+                        else
+                            output[y*kinectWidth + x] = nearest[upsampleNearest[x]];
                     }
                 }
-                if (gvx !=0 && gvy !=0)
-                    gradField[y*gradFieldcols+x]=ofVec2f(gx/gradFieldresolution/gvx, gy/gradFieldresolution/gvy);
-                if (gradField[y*gradFieldcols+x].length() > maxgradfield){
-                    gradField[y*gradFieldcols+x].scale(maxgradfield);// /= gradField[y*gradFieldcols+x].length()*maxgradfield;
-                    lgth+=1;
-                }
-            } else {
-                gradField[y*gradFieldcols+x] = ofVec2f(0);
             }
         }
-    }
+    });
 }
 
-
-float KinectGrabber::findInpaintValue(float *data, int x, int y)
+void KinectGrabber::updateGradientField()
 {
-	int sideLength = 5;
-
-	// We do not search outside ROI
-	int tminx = max(minX, x - sideLength);
-	int tmaxx = min(maxX, x + sideLength);
-	int tminy = max(minY, y - sideLength);
-	int tmaxy = min(maxY, y + sideLength);
-
-	int samples = 0;
-	double sumval = 0;
-	for (int y = tminy; y < tmaxy; y++)
-	{
-		for (int x = tminx; x < tmaxy; x++)
-		{
-			int idx = y * width + x;
-			float val = data[idx];
-			if (val != 0 && val != initialValue)
-			{
-				samples++;
-				sumval += val;
-			}
-		}
-	}
-	// No valid samples found in neighboorhood
-	if (samples == 0)
-		return 0;
-
-	return sumval / samples;
+    gradientField.update(filteredframe.getData(), minX, minY, maxX, maxY, initialValue, maxgradfield, workerPool);
+    gradientFieldOutdated = false;
 }
 
 void KinectGrabber::applySimpleOutlierInpainting()
 {
-	float *data = filteredframe.getData();
-
-	// Estimate overall average inside ROI
-	int samples = 0;
-	ROIAverageValue = 0;
-	for (unsigned int y = minY; y < maxY; y++)
-	{
-		for (unsigned int x = minX; x < maxX; x++)
-		{
-			int idx = y * width + x;
-			float val = data[idx];
-			if (val != 0 && val != initialValue)
-			{
-				samples++;
-				ROIAverageValue += val;
-			}
-		}
-	}
-	// No valid samples found in ROI - strange situation
-	if (samples == 0)
-		ROIAverageValue = initialValue;
-	
-	ROIAverageValue /= samples;
-
-	setToLocalAvg = 0;
-	setToGlobalAvg = 0;
-	// Filter ROI
-	for (unsigned int y = max(0, minY-2); y < min((int)height, maxY+2); y++)
-	{
-		for (unsigned int x = max(0, minX-2); x < min((int)width, maxX+2); x++)
-		{
-	//for (unsigned int y = minY; y < maxY; y++)
-	//{
-	//	for (unsigned int x = minX; x < maxX; x++)
-	//	{
-			int idx = y * width + x;
-			float val = data[idx];
-
-			if (val == 0 || val == initialValue)
-			{
-				float newval = findInpaintValue(data, x, y);
-				if (newval == 0)
-				{
-					newval = ROIAverageValue;
-					setToGlobalAvg++;
-				}
-				else
-				{
-
-					setToLocalAvg++;
-				}
-				data[idx] = newval;
-			}
-		}
-	}
+	holeFiller.apply(filteredframe.getData(), width, height, minX, minY, maxX, maxY, initialValue, workerPool);
+	frameMetrics.inpaintedLocal = holeFiller.getNumFilledLocal();
+	frameMetrics.inpaintedGlobal = holeFiller.getNumFilledGlobal();
 }
 
-bool KinectGrabber::isInsideROI(int x, int y){
-    if (x<minX||x>maxX||y<minY||y>maxY)
-        return false;
-    return true;
+void KinectGrabber::setKinectROI(ofRectangle ROI){
+    if (bufferInitiated){
+        changeROI(ROI);
+    } else {
+        updateROI(ROI);
+        resetBuffers();
+    }
 }
 
-void KinectGrabber::setKinectROI(ofRectangle ROI){
+void KinectGrabber::updateROI(ofRectangle ROI){
+	allTilesDirty = true;
+	kinectROI = ROI;
 	if (doFullFrameFiltering)
 	{
 		minX = 0;
@@ -569,59 +1096,106 @@ void KinectGrabber::setKinectROI(ofRectangle ROI){
 		minY = static_cast<int>(ROI.getMinY()) - 2;
 		maxY = static_cast<int>(ROI.getMaxY()) + 2;
 		
-		minX = max(0, minX);
-		maxX = min(maxX, (int)width);
-		minY = max(0, minY);
-		maxY = min(maxY, (int)height);
+		// Every filtered pixel touching the ROI
+		minX = max(0, minX) / decimation;
+		maxX = min((max(maxX, 0) + decimation - 1) / decimation, (int)width);
+		minY = max(0, minY) / decimation;
+		maxY = min((max(maxY, 0) + decimation - 1) / decimation, (int)height);
 	}
     //ROIwidth = maxX-minX;
     //ROIheight = maxY-minY;
-    resetBuffers();
 }
 
 void KinectGrabber::setAveragingSlotsNumber(int snumAveragingSlots){
     if (bufferInitiated){
-            bufferInitiated = false;
-            delete[] averagingBuffer;
-            delete[] statBuffer;
-            delete[] validBuffer;
-            delete[] gradField;
-        }
-    numAveragingSlots = snumAveragingSlots;
-    minNumSamples=(numAveragingSlots+1)/2;
-    initiateBuffers();
+        resampleFilterState(snumAveragingSlots, filterStorage, filterMode);
+    } else {
+        numAveragingSlots = snumAveragingSlots;
+        minNumSamples=(numAveragingSlots+1)/2;
+    }
 }
 
 void KinectGrabber::setGradFieldResolution(int sgradFieldresolution){
+    gradientResolution = sgradFieldresolution;
+    gradientField.setup(width, height, gradientResolution, decimation);
+    gradientFieldOutdated = true;
+}
+
+void KinectGrabber::setDecimation(int newDecimation){
+    newDecimation = getValidDecimation(newDecimation);
+    if (newDecimation == decimation)
+        return;
+    decimation = newDecimation;
+    spaceFilter.setRadius(spatialFilterRadius / decimation);
+    if (kinectWidth == 0)
+        return; // setup() sizes everything
+    width = kinectWidth/decimation;
+    height = kinectHeight/decimation;
+    ofLogVerbose("kinectGrabber") << "setDecimation(): filtering " << width << "x" << height << " pixels";
+
+    dirtyTiles.resize(width, height);
+    gradientField.setup(width, height, gradientResolution, decimation);
+    gradientFieldOutdated = true;
+    updateROI(kinectROI);
     if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
+        resetBuffers();
+    } else {
+        kinectDepthImage.allocate(width, height, 1);
+        filteredframe.allocate(width, height, 1);
+        if (decimation > 1)
+            upsampledframe.allocate(kinectWidth, kinectHeight, 1);
     }
-    gradFieldresolution = sgradFieldresolution;
-    initiateBuffers();
+}
+
+void KinectGrabber::setFilterStorage(DepthFilterStorage storage){
+    if (bufferInitiated)
+        resampleFilterState(numAveragingSlots, storage, filterMode);
+    else
+        filterStorage = storage;
+}
+
+void KinectGrabber::setFilterMode(DepthFilterMode mode){
+    if (bufferInitiated)
+        resampleFilterState(numAveragingSlots, filterStorage, mode);
+    else
+        filterMode = mode;
+}
+
+void KinectGrabber::setHugePages(bool use){
+    if (use == useHugePages)
+        return;
+    useHugePages = use;
+    bufferArena.setHugePages(use);
+    if (bufferInitiated)
+        resampleFilterState(numAveragingSlots, filterStorage, filterMode);
+    else
+        bufferArena.release(); // The next initiateBuffers() gets a new block
 }
 
 void KinectGrabber::setFollowBigChange(bool newfollowBigChange){
-    if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
-    }
     followBigChange = newfollowBigChange;
-    initiateBuffers();
 }
 
 ofVec3f KinectGrabber::getStatBuffer(int x, int y){
-    float* statBufferPtr = statBuffer+3*(x + y*width);
-    return ofVec3f(statBufferPtr[0], statBufferPtr[1], statBufferPtr[2]);
+    if (filterMode == DEPTH_FILTER_MODE_RECURSIVE){
+        int idx = x + y*width;
+        return ofVec3f(estimateBuffer[idx], varianceBuffer[idx], 0);
+    }
+    if (filterStorage == DEPTH_FILTER_STORAGE_FIXED){
+        int idx = x + y*width;
+        return ofVec3f(fixedCountBuffer[idx], fixedSumBuffer[idx], fixedSumSqBuffer[idx]);
+    }
+    float* statBufferPtr = statBuffer + (x + y*width);
+    return ofVec3f(statBufferPtr[0], statBufferPtr[height*width], statBufferPtr[2*height*width]);
 }
 
 float KinectGrabber::getAveragingBuffer(int x, int y, int slotNum){
+    if (filterMode == DEPTH_FILTER_MODE_RECURSIVE)
+        return estimateBuffer[x + y*width];
+    if (filterStorage == DEPTH_FILTER_STORAGE_FIXED){
+        uint16_t value = fixedAveragingBuffer[slotNum*height*width + (x + y*width)];
+        return value == DEPTH_FILTER_FIXED_EMPTY_SLOT ? initialValue : value;
+    }
     float* averagingBufferPtr = averagingBuffer + slotNum*height*width + (x + y*width);
     return *averagingBufferPtr;
 }
@@ -634,8 +1208,8 @@ float KinectGrabber::getValidBuffer(int x, int y){
 ofMatrix4x4 KinectGrabber::getWorldMatrix() {
 	auto mat = ofMatrix4x4();
 	if (kinectOpened) {
-		ofVec3f a = kinect.getWorldCoordinateAt(0, 0, 1);// Trick to access kinect internal parameters without having to modify ofxKinect
-		ofVec3f b = kinect.getWorldCoordinateAt(1, 1, 1);
+		ofVec3f a = source->getWorldCoordinateAt(0, 0, 1);// Trick to access kinect internal parameters without having to modify ofxKinect
+		ofVec3f b = source->getWorldCoordinateAt(1, 1, 1);
 		ofLogVerbose("kinectGrabber") << "getWorldMatrix(): Computing kinect world matrix";
 		mat = ofMatrix4x4(b.x - a.x, 0, 0, a.x,
 			0, b.y - a.y, 0, a.y,
@@ -26,6 +26,106 @@ General Public License for more details.
 #include "ofxKinect.h"
 
 #include "Utils.h"
+#include "FrameSource.h"
+#include "DepthRecorder.h"
+#include "TemporalFilterWorker.h"
+#include "DepthFilterKernels.h"
+#include "WorkerPool.h"
+#include "TripleBuffer.h"
+#include "BoundedQueue.h"
+#include "SpatialFilter.h"
+#include "HoleFiller.h"
+#include "GradientField.h"
+#include "FrameArena.h"
+#include "DirtyTiles.h"
+
+// Time spent in each stage of the last processed frame, in microseconds
+struct FilterStageTimings
+{
+	double filter;
+	double inpaint;
+	double spaceFilter;
+	double changes; // Comparing the tiles with the previous frame
+	double gradient;
+	double upsample; // Decimated frames back to the Kinect resolution
+};
+
+// Pixel counts of the last processed frame
+struct FilterFrameMetrics
+{
+	int inpaintedLocal; // Holes filled with the average of their neighbourhood
+	int inpaintedGlobal; // Holes without valid neighbours, filled with the ROI average
+	int dirtyTiles; // Tiles of the ROI that differ from the previous frame
+	float dirtyFraction; // Of the tiles overlapping the ROI
+};
+
+// One processed frame, handed from the grabber thread to the main loop
+struct GrabbedFrame
+{
+	ofFloatPixels depth; // Filtered depth
+	ofShortPixels rawDepth; // As received, in mm
+	ofPixels color;
+	GradientFieldLevel gradient[GradientField::numLevels]; // Finest cells first
+	uint64_t timestamp; // Microseconds, from the frame source
+	uint64_t arrival; // When the grabber thread got the frame, and
+	uint64_t filtered; // finished filtering it, in ofGetElapsedTimeMicros() microseconds
+	uint64_t sequence; // Counts the processed frames from 1
+	FilterFrameMetrics metrics;
+	// Tiles that changed since the last frame the main loop fetched before
+	// it, so those of frames overwritten unfetched are included. Everything
+	// outside them is the same as in that frame
+	DirtyTiles dirty;
+};
+
+// Setting changes sent from the main loop to the grabber thread. The type
+// is also the key by which queued commands are coalesced: only the latest
+// command of each type is applied. They are applied in this order, except
+// that the ROI is the one of the latest of GRABBER_COMMAND_FULL_FRAME_FILTERING
+// and GRABBER_COMMAND_ROI
+enum GrabberCommandType {
+	GRABBER_COMMAND_NUM_FILTER_THREADS, // value
+	GRABBER_COMMAND_FILTER_STORAGE, // value, a DepthFilterStorage
+	GRABBER_COMMAND_FILTER_MODE, // value, a DepthFilterMode
+	GRABBER_COMMAND_FULL_FRAME_FILTERING, // value != 0, and ROI to use otherwise
+	GRABBER_COMMAND_ROI, // ROI
+	GRABBER_COMMAND_AVERAGING_SLOTS, // value
+	GRABBER_COMMAND_FOLLOW_BIG_CHANGE, // value != 0
+	GRABBER_COMMAND_MAX_OFFSET, // value
+	GRABBER_COMMAND_SPATIAL_FILTERING, // value != 0
+	GRABBER_COMMAND_SPATIAL_FILTER_RADIUS, // value
+	GRABBER_COMMAND_INPAINTING, // value != 0
+	GRABBER_COMMAND_GRADIENT_RESOLUTION, // value
+	GRABBER_COMMAND_HUGE_PAGES, // value != 0
+	GRABBER_COMMAND_DECIMATION, // value
+	GRABBER_COMMAND_COUNT
+};
+
+struct GrabberCommand
+{
+	GrabberCommand(GrabberCommandType stype = GRABBER_COMMAND_COUNT, float svalue = 0, ofRectangle sROI = ofRectangle())
+	:type(stype),
+	value(svalue),
+	ROI(sROI),
+	queueTime(0),
+	sequence(0)
+	{
+	}
+
+	GrabberCommandType type;
+	float value;
+	ofRectangle ROI;
+	uint64_t queueTime; // Set by queueCommand()
+	uint64_t sequence; // Set by queueCommand(), the latest command is the highest
+};
+
+// Commands applied by the grabber thread in one batch
+struct GrabberCommandStatistics
+{
+	int numQueued; // Commands taken from the queue
+	int numApplied; // Left after coalescing
+	uint64_t latency; // Microseconds from queueing the oldest command to applying the batch
+	int numOverflowed; // Commands that found the queue full and were coalesced aside, since the start
+};
 
 class KinectGrabber: public ofThread {
 public:
@@ -36,24 +136,82 @@ public:
 	~KinectGrabber();
     void start();
     void stop();
+    // Queue an action for the grabber thread, which is woken up to run it.
+    // Settings should use queueCommand() instead, this allocates and does not coalesce
     void performInThread(std::function<void(KinectGrabber&)> action);
+    // Queue a setting change for the grabber thread without allocating or
+    // locking, and wake it up. The thread applies the latest command of each
+    // type before the next frame and resets the filter buffers at most once.
+    // Never waits: if the queue is full the command replaces the one of its
+    // type in a latest-value slot, under a lock the thread only takes briefly
+    void queueCommand(GrabberCommand command);
+    GrabberCommandStatistics getCommandStatistics(){
+        std::lock_guard<std::mutex> lock(commandStatisticsMutex);
+        return commandStatistics;
+    }
+    size_t getCommandQueueDepth(){ // Commands waiting now
+        return commands.size();
+    }
     bool setup();
+	// Use another frame source than the live Kinect. Must be called before setup()
+	void setFrameSource(std::shared_ptr<FrameSource> newSource);
+	std::shared_ptr<FrameSource> getFrameSource(){
+		return source;
+	}
 	bool openKinect();
-	void setupFramefilter(int gradFieldresolution, float newMaxOffset, ofRectangle ROI, bool spatialFilter, bool followBigChange, int numAveragingSlots);
+	// Record the raw frames to path, with colour every colorInterval frames (0: no colour)
+	bool startRecording(std::string path, int colorInterval);
+	void stopRecording();
+	DepthRecorder& getRecorder(){
+		return recorder;
+	}
+	// Fed with the colour frames while started
+	TemporalFilterWorker& getColorFilter(){
+		return colorFilter;
+	}
+	// Run the whole filtering pipeline on one raw depth frame. Called by the
+	// grabber thread, and directly by the benchmark when the thread is not running
+	void processFrame(const ofShortPixels& depth);
+	FilterStageTimings getStageTimings(){
+		return stageTimings;
+	}
+	FilterFrameMetrics getFrameMetrics(){
+		return frameMetrics;
+	}
+	// Time the grabber thread spent working and sleeping while waiting for
+	// frames since it was started, in microseconds
+	uint64_t getBusyTime(){
+		return busyTime;
+	}
+	uint64_t getIdleTime(){
+		return idleTime;
+	}
+	void setupFramefilter(int gradFieldresolution, float newMaxOffset, ofRectangle ROI, bool spatialFilter, bool followBigChange, int numAveragingSlots,
+		DepthFilterStorage storage = DEPTH_FILTER_STORAGE_FLOAT, DepthFilterMode mode = DEPTH_FILTER_MODE_AVERAGING);
     void initiateBuffers(void); // Reinitialise buffers
     void resetBuffers(void);
     
-    ofVec3f getStatBuffer(int x, int y);
-    float getAveragingBuffer(int x, int y, int slotNum);
+    // In filtered frame pixels, see setDecimation()
+    ofVec3f getStatBuffer(int x, int y); // Estimate and variance with the recursive filter
+    float getAveragingBuffer(int x, int y, int slotNum); // The estimate with the recursive filter
     float getValidBuffer(int x, int y);
     
+    // These keep the filter state of the pixels that stay in the ROI: only
+    // pixels entering it start over, and slots are resampled from the
+    // newest samples when their number, storage or the filter mode changes
     void setFollowBigChange(bool newfollowBigChange);
     void setKinectROI(ofRectangle skinectROI);
     void setAveragingSlotsNumber(int snumAveragingSlots);
-    void setGradFieldResolution(int sgradFieldresolution);
-    
-    void decStoredframes(){
-        storedframes -= 1;
+    void setGradFieldResolution(int sgradFieldresolution); // Cell size of the finest gradient level, keeps the filter state
+    void setFilterStorage(DepthFilterStorage storage);
+    DepthFilterStorage getFilterStorage(){
+        return filterStorage;
+    }
+    // Averaging slots or recursive filter. numAveragingSlots sets how much
+    // either smooths, and with fewer than 2 both pass the raw depth through
+    void setFilterMode(DepthFilterMode mode);
+    DepthFilterMode getFilterMode(){
+        return filterMode;
     }
     
     bool isImageStabilized(){
@@ -65,11 +223,30 @@ public:
     }
     
     ofVec2f getKinectSize(){
-        return ofVec2f(width, height);
+        return ofVec2f(kinectWidth, kinectHeight);
     }
     
+    // Main loop only, of the last frame it fetched: the filter buffers are
+    // moved by the grabber thread. In Kinect pixels, 0 outside the frame
     float getRawDepthAt(int x, int y){
-        return kinectDepthImage.getData()[(int)(y*width+x)];
+        const ofShortPixels& rawDepth = frames.getFront().rawDepth;
+        if (x < 0 || y < 0 || x >= static_cast<int>(rawDepth.getWidth()) || y >= static_cast<int>(rawDepth.getHeight()))
+            return 0;
+        return rawDepth[y*rawDepth.getWidth()+x];
+    }
+
+    // Filter decimation x decimation blocks of Kinect pixels as one (1, 2 or
+    // 4) for slow computers. The raw depth is binned before the temporal
+    // filter and the result upsampled to the Kinect resolution, so the
+    // published frames, the ROI and the gradient field resolution stay in
+    // Kinect pixels. Restarts the filter
+    void setDecimation(int decimation);
+    // The decimation actually used for a requested one: 4, 2 or 1
+    static int getValidDecimation(int decimation){
+        return decimation >= 4 ? 4 : decimation >= 2 ? 2 : 1;
+    }
+    int getDecimation(){
+        return decimation;
     }
     
 	ofMatrix4x4 getWorldMatrix();
@@ -85,66 +262,175 @@ public:
     void setSpatialFiltering(bool newspatialFilter){
         spatialFilter = newspatialFilter;
     }
+    // Standard deviation of the spatial filter in Kinect pixels
+    void setSpatialFilterRadius(float radius);
+    float getSpatialFilterRadius(){
+        return spatialFilterRadius;
+    }
     
 	void setInPainting(bool inp)
 	{
 		doInPaint = inp;
 	}
 
+	// Number of threads sharing the filtering (0: one per core, leaving one
+	// free), results are identical for any number
+	void setNumFilterThreads(int numThreads);
+	int getNumFilterThreads(){
+		return workerPool.getNumThreads();
+	}
+
+	// Scalar or SIMD temporal filter, they give identical results
+	void setFilterKernel(DepthFilterKernel kernel);
+	DepthFilterKernel getFilterKernel(){
+		return filterKernel;
+	}
+
+	const ofFloatPixels& getFilteredFrame(){ // At the Kinect resolution
+		return decimation > 1 ? upsampledframe : filteredframe;
+	}
+
+	// Back the filter buffers with transparent huge pages where the system
+	// has them. Moves the buffers to a new block, keeping the filter state
+	void setHugePages(bool use);
+	// Size of the block holding the filter buffers and frames, in bytes
+	size_t getBufferMemory(){
+		return bufferMemory;
+	}
+	bool isUsingHugePages(){
+		return bufferHugePages;
+	}
+
 	// Should the entire frame be filtered and thereby ignoring the KinectROI
 	void setFullFrameFiltering(bool ff, ofRectangle ROI);
 
-	ofThreadChannel<ofFloatPixels> filtered;
-	ofThreadChannel<ofPixels> colored;
-	ofThreadChannel<ofVec2f*> gradient;
+	// Latest processed frame. The main loop fetch()es it and reads the front
+	// slot, which stays untouched until the next fetch()
+	TripleBuffer<GrabbedFrame> frames;
     
 private:
 	void threadedFunction() override;
+    void wake(); // End the wait for the next frame
+    void applyCommands();
+    void updateROI(ofRectangle ROI); // Without touching the buffers
+    void changeROI(ofRectangle ROI);
+    void resampleFilterState(int newNumSlots, DepthFilterStorage newStorage, DepthFilterMode newMode);
+    // Reserve the arena for the slot count and storage and carve the
+    // buffers out of it. Only asks the system for memory when it is too small
+    bool carveBuffers(FrameArena& arena);
+    void initiateAveragingBuffers(); // Empty slots and zero statistics of filterStorage, or no estimates
+    void resetPixel(int idx);
     void filter();
-    bool isInsideROI(int x, int y); // test is x, y is inside ROI
+    void freeBuffers();
     void applySpaceFilter();
+    int getNumBands();
+    int bandStart(int band, int numBands); // First row of a band of the ROI
+    void binDepth(const ofShortPixels& depth); // Into kinectDepthImage, when decimating
+    void detectChanges();
+    void upsampleFrame(); // The changed tiles of filteredframe into upsampledframe
     void updateGradientField();
+    void publishFrame(uint64_t timestamp, uint64_t arrival);
     
 	// A simple inpainting algorithm to remove outliers in the depth
 	// Since the shader has no way of filtering outliers (0 and 4000 values mainly) it creates visual artifacts if they are not 
 	// removed prior to the shader pass
 	void applySimpleOutlierInpainting();
-	float findInpaintValue(float *data, int x, int y);
-	double ROIAverageValue = 0;
-	int setToLocalAvg = 0;
-	int setToGlobalAvg = 0;
-
 
 	bool newFrame;
+	FilterStageTimings stageTimings;
+	FilterFrameMetrics frameMetrics;
+	DepthFilterKernel filterKernel;
+	WorkerPool workerPool;
+	SpatialFilter spaceFilter;
+	HoleFiller holeFiller;
     bool bufferInitiated;
     bool firstImageReady;
-    int storedframes;
+    uint64_t frameSequence;
     
     // Thread lambda functions (actions)
 	vector<std::function<void(KinectGrabber&)> > actions;
 	ofMutex actionsLock;
+
+	// Typed setting changes, coalesced by type when applied
+	static const size_t commandQueueCapacity = 256; // A few seconds of GUI events even if the thread stalls
+	BoundedQueue<GrabberCommand, commandQueueCapacity> commands;
+	std::atomic<uint64_t> commandSequence;
+	// Latest command of each type that found the queue full, taken with the queued ones
+	std::mutex overflowMutex;
+	GrabberCommand overflowCommands[GRABBER_COMMAND_COUNT];
+	bool overflowPending[GRABBER_COMMAND_COUNT];
+	std::atomic<bool> hasOverflow;
+	std::atomic<int> numOverflowedCommands;
+	GrabberCommandStatistics commandStatistics; // Of the last batch
+	std::mutex commandStatisticsMutex;
+
+	// The thread sleeps on wakeCondition between frames
+	std::mutex wakeMutex;
+	std::condition_variable wakeCondition;
+	bool wakeRequested;
+	std::atomic<uint64_t> busyTime;
+	std::atomic<uint64_t> idleTime;
     
     // Kinect parameters
 	bool kinectOpened;
-    ofxKinect               kinect;
-    unsigned int width, height; // Width and height of kinect frames
-	int minX, maxX; // , ROIwidth; // ROI definition
+    std::shared_ptr<FrameSource> source; // Live kinect or recorded frames
+	DepthRecorder recorder;
+	TemporalFilterWorker colorFilter;
+    unsigned int kinectWidth, kinectHeight; // Width and height of kinect frames
+    int decimation; // Kinect pixels binned into one filtered pixel along each axis
+    unsigned int width, height; // Of the filtered frames, the kinect frames divided by decimation
+    ofRectangle kinectROI; // In kinect pixels, as last set
+	int minX, maxX; // , ROIwidth; // ROI definition, in filtered pixels
 	int minY, maxY; //, ROIheight;
     
+    // All the buffers below are views into bufferArena: resetting the
+    // filter never allocates, only changing the slot count, the storage or
+    // the huge pages does
+    FrameArena bufferArena;
+    bool useHugePages;
+    std::atomic<size_t> bufferMemory; // Read by the main thread
+    std::atomic<bool> bufferHugePages;
+
     // General buffers
-    ofxCvColorImage         kinectColorImage;
     ofShortPixels     kinectDepthImage;
     ofFloatPixels filteredframe;
-    ofVec2f* gradField;
+
+    // Change detection: the filtered frame is compared tile by tile with
+    // referenceFrame, its copy as of the previous frame
+    float* referenceFrame;
+    DirtyTiles dirtyTiles; // Of the last frame
+    // The filtered frame upsampled to the kinect resolution and the tiles of
+    // it that changed, only used when decimating
+    ofFloatPixels upsampledframe;
+    DirtyTiles upsampledDirtyTiles;
+    std::vector<int> upsampleColumns, upsampleNearest; // Per kinect column, see upsampleFrame()
+    std::vector<float> upsampleWeights;
+    bool allTilesDirty; // The reference is outdated: mark the whole frame changed
+    bool gradientFieldOutdated; // Recompute the gradient field even if no tile changed
+    DirtyTiles pendingDirtyTiles; // Since the last frame the main loop is known to have fetched
     
     // Filtering buffers
 	float* averagingBuffer; // Buffer to calculate running averages of each pixel's depth value
-	float* statBuffer; // Buffer retaining the running means and variances of each pixel's depth value
+	float* statBuffer; // Planes of sample counts, sums and sums of squares of each pixel's depth value
 	float* validBuffer; // Buffer holding the most recent stable depth value for each pixel
+
+	// Fixed point filtering buffers, only carved with DEPTH_FILTER_STORAGE_FIXED
+	// (the float averaging and statistics buffers are not carved then)
+	DepthFilterStorage filterStorage;
+	uint16_t* fixedAveragingBuffer;
+	uint16_t* fixedCountBuffer;
+	uint32_t* fixedSumBuffer;
+	uint64_t* fixedSumSqBuffer;
+
+	// Recursive filter buffers, only carved with DEPTH_FILTER_MODE_RECURSIVE
+	// (neither the float nor the fixed point averaging buffers are then)
+	DepthFilterMode filterMode;
+	float* estimateBuffer; // Filtered depth of each pixel
+	float* varianceBuffer; // Variance of the estimate, 0 when there is none
     
     // Gradient computation variables
-    int gradFieldcols, gradFieldrows;
-    int gradFieldresolution;           //Resolution of grid relative to window width and height in pixels
+    GradientField gradientField;
+    int gradientResolution; // Finest cell size asked for, in kinect pixels
     float maxgradfield, depthrange;
     
     // Frame filter parameters
@@ -159,6 +445,7 @@ private:
     float bigChange; // Amount of change over which the averaging slot is reset to new value
 //	float instableValue; // Value to assign to instable pixels if retainValids is false
 	bool spatialFilter; // Flag whether to apply a spatial filter to time-averaged depth values
+	float spatialFilterRadius; // In kinect pixels, spaceFilter works in filtered pixels
     float maxOffset;
     
     int minInitFrame; // Minimal number of frame to consider the kinect initialized
@@ -45,6 +45,9 @@ drawKinectColorView(true)
 	TemporalFilteringType = 1;
 	DumpDebugFiles = true;
 	DebugFileOutDir = "DebugFiles//";
+	RecordingOutDir = "Recordings//";
+	lastGrabberBusyTime = 0;
+	lastGrabberIdleTime = 0;
 }
 
 void KinectProjector::setup(bool sdisplayGui)
@@ -85,8 +88,17 @@ void KinectProjector::setup(bool sdisplayGui)
     maxOffsetBack = basePlaneOffset.z-300;
     maxOffset = maxOffsetBack;
     maxOffsetSafeRange = 50; // Range above the autocalib measured max offset
+    seaLevelFitParameters.sampleSpacing = 8;
+    seaLevelFitParameters.inlierDistance = 8;
+    seaLevelFitParameters.timeBudget = 5;
+    seaLevelFitParameters.maxIterations = 500;
+    seaLevelFitParameters.confidence = 0.999f;
+    basePlaneInlierFraction = 0;
+    minBasePlaneInlierFraction = 0.5f;
 
     // kinectgrabber: start & default setup
+	if (replaySource)
+		kinectgrabber.setFrameSource(replaySource);
 	kinectOpened = kinectgrabber.setup();
 	lastKinectOpenTry = ofGetElapsedTimef(); 
 	if (!kinectOpened)
@@ -98,8 +110,16 @@ void KinectProjector::setup(bool sdisplayGui)
 	doInpainting = false;
 	doFullFrameFiltering = false;
 	spatialFiltering = true;
+	spatialFilterRadius = 1;
     followBigChanges = false;
     numAveragingSlots = 15;
+	numFilterThreads = 0; // One per core
+	filterStorage = DEPTH_FILTER_STORAGE_FLOAT;
+	filterMode = DEPTH_FILTER_MODE_AVERAGING;
+	hugePages = false;
+	decimation = 1;
+	landHysteresis = 0;
+	trackSeaLevel = false;
 	TemporalFrameCounter = 0;
     
     // Get projector and kinect width & height
@@ -110,19 +130,22 @@ void KinectProjector::setup(bool sdisplayGui)
 
     // Initialize the fbos and images
     FilteredDepthImage.allocate(kinectRes.x, kinectRes.y);
+    depthImageOutdated = true;
     kinectColorImage.allocate(kinectRes.x, kinectRes.y);
     thresholdedImage.allocate(kinectRes.x, kinectRes.y);
     
 	kpt = new ofxKinectProjectorToolkit(projRes, kinectRes);
 
 	// finish kinectgrabber setup and start the grabber
-    kinectgrabber.setupFramefilter(gradFieldResolution, maxOffset, kinectROI, spatialFiltering, followBigChanges, numAveragingSlots);
+	kinectgrabber.setNumFilterThreads(numFilterThreads);
+    kinectgrabber.setupFramefilter(gradFieldResolution, maxOffset, kinectROI, spatialFiltering, followBigChanges, numAveragingSlots, filterStorage, filterMode);
     kinectWorldMatrix = kinectgrabber.getWorldMatrix();
+    kinectRays.setup(kinectWorldMatrix, kinectRes.x, kinectRes.y);
+    elevationMap.invalidateAll();
+    landMask.invalidateAll();
+    resetSeaLevelTracker();
     ofLogVerbose("KinectProjector") << "KinectProjector.setup(): kinectWorldMatrix: " << kinectWorldMatrix ;
     
-    // Setup gradient field
-    setupGradientField();
-    
     fboProjWindow.allocate(projRes.x, projRes.y, GL_RGBA);
     fboProjWindow.begin();
     ofClear(255, 255, 255, 0);
@@ -142,6 +165,36 @@ void KinectProjector::setup(bool sdisplayGui)
 	updateStatusGUI();
 }
 
+void KinectProjector::setReplayFile(std::string file, RecordedFrameSource::Playback_mode mode)
+{
+	ofLogVerbose("KinectProjector") << "setReplayFile(): replaying " << file << " instead of the live Kinect";
+	replaySource = std::make_shared<RecordedFrameSource>(file, mode);
+}
+
+void KinectProjector::setRecording(bool record)
+{
+	if (record)
+	{
+		ofDirectory::createDirectory(RecordingOutDir, true, true);
+		std::string file = ofToDataPath(RecordingOutDir + "session-" + ofGetTimestampString("%Y%m%d-%H%M%S") + ".msd");
+		kinectgrabber.performInThread([file](KinectGrabber & kg) {
+			kg.startRecording(file, 10);
+		});
+	}
+	else
+	{
+		kinectgrabber.performInThread([](KinectGrabber & kg) {
+			kg.stopRecording();
+		});
+	}
+}
+
+void KinectProjector::stepReplay(int frames)
+{
+	if (replaySource)
+		replaySource->step(frames);
+}
+
 void KinectProjector::exit(ofEventArgs& e)
 {
 	if (ROIcalibrated)
@@ -156,23 +209,9 @@ void KinectProjector::exit(ofEventArgs& e)
 	}
 }
 
-void KinectProjector::setupGradientField(){
-    gradFieldcols = kinectRes.x / gradFieldResolution;
-    gradFieldrows = kinectRes.y / gradFieldResolution;
-    
-    gradField = new ofVec2f[gradFieldcols*gradFieldrows];
-    ofVec2f* gfPtr=gradField;
-    for(unsigned int y=0;y<gradFieldrows;++y)
-        for(unsigned int x=0;x<gradFieldcols;++x,++gfPtr)
-            *gfPtr=ofVec2f(0);
-}
-
 void KinectProjector::setGradFieldResolution(int sgradFieldResolution){
     gradFieldResolution = sgradFieldResolution;
-    setupGradientField();
-    kinectgrabber.performInThread([sgradFieldResolution](KinectGrabber & kg) {
-        kg.setGradFieldResolution(sgradFieldResolution);
-    });
+    kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_GRADIENT_RESOLUTION, sgradFieldResolution));
 }
 
 // For some reason this call eats milliseconds - so it should only be called when something is changed
@@ -238,9 +277,14 @@ void KinectProjector::updateStatusGUI()
 	StatusGUI->getLabel("Calibration Step")->setLabelColor(ofColor(0, 255, 255));
 
 	gui->getToggle("Spatial filtering")->setChecked(spatialFiltering);
+	gui->getSlider("Spatial filter radius")->setValue(spatialFilterRadius);
 	gui->getToggle("Quick reaction")->setChecked(followBigChanges);
+	gui->getToggle("Recursive filter")->setChecked(filterMode == DEPTH_FILTER_MODE_RECURSIVE);
+	gui->getSlider("Decimation")->setValue(decimation);
+	gui->getSlider("Shoreline hysteresis")->setValue(landHysteresis);
 	gui->getToggle("Inpaint outliers")->setChecked(doInpainting);
 	gui->getToggle("Full Frame Filtering")->setChecked(doFullFrameFiltering);
+	gui->getToggle("Track sea level drift")->setChecked(trackSeaLevel);
 }
 
 void KinectProjector::update()
@@ -262,10 +306,15 @@ void KinectProjector::update()
 			ofLogVerbose("KinectProjector") << "KinectProjector.update(): A Kinect was found ";
 			kinectRes = kinectgrabber.getKinectSize();
 			kinectROI = ofRectangle(0, 0, kinectRes.x, kinectRes.y);
+			depthImageOutdated = true;
 			ofLogVerbose("KinectProjector") << "KinectProjector.update(): kinectROI " << kinectROI;
 
-			kinectgrabber.setupFramefilter(gradFieldResolution, maxOffset, kinectROI, spatialFiltering, followBigChanges, numAveragingSlots);
+			kinectgrabber.setupFramefilter(gradFieldResolution, maxOffset, kinectROI, spatialFiltering, followBigChanges, numAveragingSlots, filterStorage, filterMode);
 			kinectWorldMatrix = kinectgrabber.getWorldMatrix();
+			kinectRays.setup(kinectWorldMatrix, kinectRes.x, kinectRes.y);
+			elevationMap.invalidateAll();
+			landMask.invalidateAll();
+			resetSeaLevelTracker();
 			ofLogVerbose("KinectProjector") << "KinectProjector.update(): kinectWorldMatrix: " << kinectWorldMatrix;
 
 			updateStatusGUI();
@@ -278,35 +327,78 @@ void KinectProjector::update()
 		StatusGUI->update();
 	}
 
-    // Get images from kinect grabber
-    ofFloatPixels filteredframe;
-    if (kinectOpened && kinectgrabber.filtered.tryReceive(filteredframe)) 
+    // Get the latest frame from kinect grabber
+    if (kinectOpened && kinectgrabber.frames.fetch()) 
 	{
+		const GrabbedFrame& frame = kinectgrabber.frames.getFront();
+		latencyTracer.beginFrame(frame.sequence, frame.arrival, frame.filtered);
 		fpsKinect.newFrame();
 		fpsKinectText->setText(ofToString(fpsKinect.getFps(), 2));
 
-		FilteredDepthImage.setFromPixels(filteredframe.getData(), kinectRes.x, kinectRes.y);
-        FilteredDepthImage.updateTexture();
-        
-        // Get color image from kinect grabber
-        ofPixels coloredframe;
-        if (kinectgrabber.colored.tryReceive(coloredframe)) 
+		// Share of the time the grabber thread was busy, updated every second
+		uint64_t grabberBusyTime = kinectgrabber.getBusyTime();
+		uint64_t grabberIdleTime = kinectgrabber.getIdleTime();
+		uint64_t grabberTime = grabberBusyTime + grabberIdleTime - lastGrabberBusyTime - lastGrabberIdleTime;
+		if (grabberTime >= 1000000 || grabberBusyTime < lastGrabberBusyTime)
 		{
-            kinectColorImage.setFromPixels(coloredframe);
-		
-			if (TemporalFilteringType == 0)
-				TemporalFrameFilter.NewFrame(kinectColorImage.getPixels().getData(), kinectColorImage.width, kinectColorImage.height);
-			else if (TemporalFilteringType == 1)
-				TemporalFrameFilter.NewColFrame(kinectColorImage.getPixels().getData(), kinectColorImage.width, kinectColorImage.height);
+			if (grabberBusyTime >= lastGrabberBusyTime)
+				kinectLoadText->setText(ofToString(100.0 * (grabberBusyTime - lastGrabberBusyTime) / grabberTime, 1) + " %");
+			lastGrabberBusyTime = grabberBusyTime;
+			lastGrabberIdleTime = grabberIdleTime;
+
+			// Commands queued / applied after coalescing, and how long the oldest one waited
+			GrabberCommandStatistics commandStats = kinectgrabber.getCommandStatistics();
+			commandQueueText->setText(ofToString(commandStats.numQueued) + " / " + ofToString(commandStats.numApplied) + ", " + ofToString(commandStats.latency / 1000.0, 1) + " ms");
+
+			std::string memory = "Kinect buffers " + ofToString(kinectgrabber.getBufferMemory() / (1024.0 * 1024.0), 1) + " MB";
+			if (kinectgrabber.isUsingHugePages())
+				memory += " (huge pages)";
+			StatusGUI->getLabel("Kinect Memory")->setLabel(memory);
+
+			// Median and 99th percentile age of the frames at each stage over the last 10 s
+			for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+			{
+				std::string name = LatencyTracer::getStageName(static_cast<LatencyStage>(stage));
+				LatencyStatistics stats = latencyTracer.getStatistics(static_cast<LatencyStage>(stage));
+				StatusGUI->getLabel("Latency " + name)->setLabel("Latency " + name + ": " + ofToString(stats.p50, 1) + " / " + ofToString(stats.p99, 1) + " ms");
+			}
 		}
-
-        // Get gradient field from kinect grabber
-        kinectgrabber.gradient.tryReceive(gradField);
+		inpaintedText->setText(ofToString(frame.metrics.inpaintedLocal) + " / " + ofToString(frame.metrics.inpaintedGlobal));
+		dirtyTilesText->setText(ofToString(100.0 * frame.metrics.dirtyFraction, 1) + " %");
+
+		// The texture is uploaded whole, but not at all while the sand stays still
+		depthDirty = frame.dirty;
+		if (depthImageOutdated)
+			depthDirty.setAll();
+		landMask.invalidate(depthDirty);
+		if (depthDirty.any())
+		{
+			FilteredDepthImage.setFromPixels(frame.depth.getData(), kinectRes.x, kinectRes.y);
+			FilteredDepthImage.updateTexture();
+			depthImageOutdated = false;
+			elevationMap.invalidate(depthDirty);
+			getElevationMap(); // Once per frame, before the games query it
+		}
+		seaLevelTracker.addFrame(frame.depth.getData(), depthDirty, kinectROI);
+		ofVec4f driftedSeaLevel;
+		float ceilingShift;
+		if (seaLevelTracker.fetchCorrection(driftedSeaLevel, ceilingShift))
+			applySeaLevelDrift(driftedSeaLevel, ceilingShift);
+		latencyTracer.stamp(LATENCY_STAGE_TEXTURE);
         
-        // Update grabber stored frame number
-        kinectgrabber.lock();
-        kinectgrabber.decStoredframes();
-        kinectgrabber.unlock();
+        // Color image
+        kinectColorImage.setFromPixels(frame.color);
+		// The grabber only filters the colour frames while they are used
+		if (applicationState == APPLICATION_STATE_CALIBRATING || drawKinectColorView)
+			kinectgrabber.getColorFilter().start(TemporalFilteringType);
+		else
+			kinectgrabber.getColorFilter().stop();
+		if (applicationState != APPLICATION_STATE_CALIBRATING)
+			kinectgrabber.getColorFilter().fetchImage(TemporalFilteredImage);
+
+        // Gradient field pyramid
+        for (int level = 0; level < GradientField::numLevels; level++)
+            gradField[level] = frame.gradient[level];
         
         // Is the depth image stabilized
         imageStabilized = kinectgrabber.isImageStabilized();
@@ -708,9 +800,7 @@ void KinectProjector::setNewKinectROI()
 }
 
 void KinectProjector::updateKinectGrabberROI(ofRectangle ROI){
-    kinectgrabber.performInThread([ROI](KinectGrabber & kg) {
-        kg.setKinectROI(ROI);
-    });
+    kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_ROI, 0, ROI));
 //    while (kinectgrabber.isImageStabilized()){
 //    } // Wait for kinectgrabber to reset buffers
     imageStabilized = false; // Now we can wait for a clean new depth frame
@@ -758,9 +848,7 @@ void KinectProjector::updateProjKinectAutoCalibration()
 {
     if (autoCalibState == AUTOCALIB_STATE_INIT_FIRST_PLANE)
 	{
-        kinectgrabber.performInThread([](KinectGrabber & kg) {
-            kg.setMaxOffset(0);
-        });
+        kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_MAX_OFFSET, 0));
 		calibrationText = "Stabilizing acquisition";
         autoCalibState = AUTOCALIB_STATE_INIT_POINT;
 		updateStatusGUI();
@@ -778,6 +866,8 @@ void KinectProjector::updateProjKinectAutoCalibration()
 			return;
 		}
 		calibrationText = "Sea level plane estimated";
+		if (basePlaneInlierFraction < minBasePlaneInlierFraction)
+			calibrationText += " from only " + ofToString(100 * basePlaneInlierFraction, 0) + " % of the sand";
 		updateStatusGUI();
 
         autoCalibPts = new ofPoint[10];
@@ -804,6 +894,7 @@ void KinectProjector::updateProjKinectAutoCalibration()
         upframe = false;
         trials = 0;
 		TemporalFrameCounter = 0;
+		kinectgrabber.getColorFilter().restart();
 
 		ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; //
 		drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
@@ -812,22 +903,24 @@ void KinectProjector::updateProjKinectAutoCalibration()
     } 
 	else if (autoCalibState == AUTOCALIB_STATE_NEXT_POINT && imageStabilized)
 	{
-		if (!(TemporalFrameCounter % 20))
-			ofLogVerbose("KinectProjector") << "autoCalib(): Got frame " + ofToString(TemporalFrameCounter) + " / " + ofToString(TemporalFrameFilter.getBufferSize() + 3) + " for temporal filter";
+		TemporalFilterWorker& colorFilter = kinectgrabber.getColorFilter();
+		int numFrames = colorFilter.getNumFrames();
+		if (numFrames != TemporalFrameCounter && !(numFrames % 20))
+			ofLogVerbose("KinectProjector") << "autoCalib(): Got frame " + ofToString(numFrames) + " / " + ofToString(colorFilter.getBufferSize() + TemporalFilterWorker::settleFrames) + " for temporal filter";
+		TemporalFrameCounter = numFrames;
 
 		// We want to have a buffer of images that are only focusing on one chess pattern
-		if (TemporalFrameCounter++ > TemporalFrameFilter.getBufferSize() + 3)
+		if (colorFilter.fetchImage(TemporalFilteredImage))
 		{
 			CalibrateNextPoint();
+			colorFilter.restart();
 			TemporalFrameCounter = 0;
 		}
 	}
 	else if (autoCalibState == AUTOCALIB_STATE_COMPUTE) 
 	{
         updateKinectGrabberROI(kinectROI); // Goes back to kinectROI and maxoffset
-        kinectgrabber.performInThread([this](KinectGrabber & kg) {
-            kg.setMaxOffset(this->maxOffset);
-        });
+        kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_MAX_OFFSET, maxOffset));
         if (pairsKinect.size() == 0) {
             ofLogVerbose("KinectProjector") << "autoCalib(): Error: No points acquired !!" ;
 			calibrationText = "Calibration failed: No points acquired";
@@ -947,10 +1040,7 @@ void KinectProjector::CalibrateNextPoint()
 		cvRgbImage = ofxCv::toCv(kinectColorImage.getPixels());
 
 		ofxCvGrayscaleImage tempImage;
-		if (TemporalFilteringType == 0)
-			tempImage.setFromPixels(TemporalFrameFilter.getMedianFilteredImage(), kinectColorImage.width, kinectColorImage.height);
-		if (TemporalFilteringType == 1)
-			tempImage.setFromPixels(TemporalFrameFilter.getAverageFilteredColImage(), kinectColorImage.width, kinectColorImage.height);
+		tempImage.setFromPixels(TemporalFilteredImage);
 		
 		ProcessChessBoardInput(tempImage);
 
@@ -1087,44 +1177,47 @@ void KinectProjector::updateBasePlane()
 	basePlaneComputed = false;
 	updateStatusGUI();
 
-    ofRectangle smallROI = kinectROI;
-    smallROI.scaleFromCenter(0.75); // Reduce ROI to avoid problems with borders
-    ofLogVerbose("KinectProjector") << "updateBasePlane(): smallROI: " << smallROI ;
-    int sw = static_cast<int>(smallROI.width);
-    int sh = static_cast<int>(smallROI.height);
-    int sl = static_cast<int>(smallROI.getLeft());
-    int st = static_cast<int>(smallROI.getTop());
-    ofLogVerbose("KinectProjector") << "updateBasePlane(): sw: " << sw << " sh : " << sh << " sl : " << sl << " st : " << st << " sw*sh : " << sw*sh ;
-    if (sw*sh == 0) {
-        ofLogVerbose("KinectProjector") << "updateBasePlane(): smallROI is null, cannot compute base plane normal" ;
+    // The whole ROI: the borders and whatever is on the sand are left out
+    // as outliers of the fit
+    ofLogVerbose("KinectProjector") << "updateBasePlane(): kinectROI: " << kinectROI ;
+    if (kinectROI.width * kinectROI.height == 0 || kinectRays.getWidth() != kinectRes.x || kinectRays.getHeight() != kinectRes.y) {
+        ofLogVerbose("KinectProjector") << "updateBasePlane(): kinectROI is null, cannot compute base plane normal" ;
         return;
     }
-    ofVec4f pt;
-    ofVec3f* points;
-    points = new ofVec3f[sw*sh];
-    ofLogVerbose("KinectProjector") << "updateBasePlane(): Computing points in smallROI : " << sw*sh ;
-    for (int x = 0; x<sw; x++){
-        for (int y = 0; y<sh; y ++){
-            points[x+y*sw] = kinectCoordToWorldCoord(x+sl, y+st);
-        }
-    }
-    ofLogVerbose("KinectProjector") << "updateBasePlane(): Computing plane from points" ;
-    basePlaneEq = plane_from_points(points, sw*sh);
-	if (basePlaneEq.x == 0 && basePlaneEq.y == 0 && basePlaneEq.z == 0)
+    PlaneFit fit = seaLevelFit.fit(FilteredDepthImage.getFloatPixelsRef().getData(), kinectRays, static_cast<int>(kinectROI.getLeft()), static_cast<int>(kinectROI.getTop()),
+        static_cast<int>(kinectROI.getRight()), static_cast<int>(kinectROI.getBottom()), seaLevelFitParameters);
+    ofLogVerbose("KinectProjector") << "updateBasePlane(): " << seaLevelFit.getNumIterations() << " planes tried on " << seaLevelFit.getNumSamples() << " samples" ;
+	if (fit.equation.x == 0 && fit.equation.y == 0 && fit.equation.z == 0)
 	{
-		ofLogVerbose("KinectProjector") << "updateBasePlane(): plane_from_points could not compute basePlane";
+		ofLogVerbose("KinectProjector") << "updateBasePlane(): could not compute basePlane";
 		return;
 	}
+    basePlaneEq = fit.equation;
+    basePlaneInlierFraction = seaLevelFit.getInlierFraction();
+    ofLogVerbose("KinectProjector") << "updateBasePlane(): " << fit.numPoints << " points at sea level, residual " << fit.rmsResidual << " mm RMS" ;
+    if (basePlaneInlierFraction < minBasePlaneInlierFraction)
+        ofLogWarning("KinectProjector") << "updateBasePlane(): only " << 100 * basePlaneInlierFraction << " % of the sand is at sea level";
 
     basePlaneNormal = ofVec3f(basePlaneEq);
-    basePlaneOffset = ofVec3f(0,0,-basePlaneEq.w);
+    basePlaneOffset = ofVec3f(0, 0, -basePlaneEq.w / basePlaneEq.z); // On the optical axis, its z is the sea level depth
     basePlaneNormalBack = basePlaneNormal;
     basePlaneOffsetBack = basePlaneOffset;
+    resetSeaLevelTracker();
     basePlaneUpdated = true;
 	basePlaneComputed = true;
 	updateStatusGUI();
 }
 
+PlaneFit KinectProjector::fitPlane(const ofRectangle& ROI)
+{
+	// One pass over the depth image, no point kept
+	PlaneMoments moments;
+	if (kinectRays.getWidth() == kinectRes.x && kinectRays.getHeight() == kinectRes.y)
+		moments.add(FilteredDepthImage.getFloatPixelsRef().getData(), kinectRays, static_cast<int>(ROI.getLeft()), static_cast<int>(ROI.getTop()),
+			static_cast<int>(ROI.getRight()), static_cast<int>(ROI.getBottom()));
+	return moments.fit();
+}
+
 void KinectProjector::updateMaxOffset(){
     ofRectangle smallROI = kinectROI;
     smallROI.scaleFromCenter(0.75); // Reduce ROI to avoid problems with borders
@@ -1138,24 +1231,14 @@ void KinectProjector::updateMaxOffset(){
         ofLogVerbose("KinectProjector") << "updateMaxOffset(): smallROI is null, cannot compute base plane normal" ;
         return;
     }
-    ofVec4f pt;
-    ofVec3f* points;
-    points = new ofVec3f[sw*sh];
-    ofLogVerbose("KinectProjector") << "updateMaxOffset(): Computing points in smallROI : " << sw*sh ;
-    for (int x = 0; x<sw; x++){
-        for (int y = 0; y<sh; y ++){
-            points[x+y*sw] = kinectCoordToWorldCoord(x+sl, y+st);//vertexCcvertexCc;
-        }
-    }
-    ofLogVerbose("KinectProjector") << "updateMaxOffset(): Computing plane from points" ;
-    ofVec4f eqoff = plane_from_points(points, sw*sh);
-    maxOffset = -eqoff.w-maxOffsetSafeRange;
+    ofLogVerbose("KinectProjector") << "updateMaxOffset(): Computing plane from points in smallROI : " << sw*sh ;
+    PlaneFit fit = fitPlane(ofRectangle(sl, st, sw, sh));
+    ofLogVerbose("KinectProjector") << "updateMaxOffset(): residual " << fit.rmsResidual << " mm RMS" ;
+    maxOffset = -fit.equation.w-maxOffsetSafeRange;
     maxOffsetBack = maxOffset;
     // Update max Offset
     ofLogVerbose("KinectProjector") << "updateMaxOffset(): maxOffset" << maxOffset ;
-    kinectgrabber.performInThread([this](KinectGrabber & kg) {
-        kg.setMaxOffset(this->maxOffset);
-    });
+    kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_MAX_OFFSET, maxOffset));
 }
 
 bool KinectProjector::addPointPair() {
@@ -1215,6 +1298,10 @@ void KinectProjector::drawMainWindow(float x, float y, float width, float height
 	{
 		gui->draw();
 		StatusGUI->draw();
+
+		// Rolling latency histograms on top of the status panel, 0 to 160 ms
+		float rowHeight = 20;
+		latencyTracer.drawHistograms(StatusGUI->getPosition().x, StatusGUI->getPosition().y - LATENCY_STAGE_COUNT * rowHeight, StatusGUI->getWidth(), rowHeight);
 	}
 }
 
@@ -1248,18 +1335,19 @@ void KinectProjector::drawChessboard(int x, int y, int chessboardSize) {
     fboProjWindow.end();
 }
 
-void KinectProjector::drawGradField()
+void KinectProjector::drawGradField(int level)
 {
+    const GradientFieldLevel& field = gradField[level];
     ofClear(255, 0);
-    for(int rowPos=0; rowPos< gradFieldrows ; rowPos++)
+    for(int rowPos=0; !field.field.empty() && rowPos< field.rows ; rowPos++)
     {
-        for(int colPos=0; colPos< gradFieldcols ; colPos++)
+        for(int colPos=0; colPos< field.cols ; colPos++)
         {
-            float x = colPos*gradFieldResolution + gradFieldResolution/2;
-            float y = rowPos*gradFieldResolution  + gradFieldResolution/2;
+            float x = colPos*field.resolution + field.resolution/2;
+            float y = rowPos*field.resolution  + field.resolution/2;
             ofVec2f projectedPoint = kinectCoordToProjCoord(x, y);
-            int ind = colPos + rowPos * gradFieldcols;
-            ofVec2f v2 = gradField[ind];
+            int ind = colPos + rowPos * field.cols;
+            ofVec2f v2 = field.field[ind];
             v2 *= arrowLength;
 
             ofSetColor(255,0,0,255);
@@ -1343,19 +1431,30 @@ ofVec3f KinectProjector::kinectCoordToWorldCoord(float x, float y) // x, y in ki
 	if (x >= kinectRes.x)
 		x = kinectRes.x - 1;
 
-    ofVec4f kc = ofVec2f(x, y);
-    int ind = static_cast<int>(y) * kinectRes.x + static_cast<int>(x);
-    kc.z = FilteredDepthImage.getFloatPixelsRef().getData()[ind];
-	//if (kc.z == 0)
+    int ix = static_cast<int>(x);
+    int iy = static_cast<int>(y);
+    float z = FilteredDepthImage.getFloatPixelsRef().getData()[iy * static_cast<int>(kinectRes.x) + ix];
+	//if (z == 0)
 	//	ofLogVerbose("KinectProjector") << "kinectCoordToWorldCoord z coordinate 0";
-	//if (kc.z == 4000)
+	//if (z == 4000)
 	//	ofLogVerbose("KinectProjector") << "kinectCoordToWorldCoord z coordinate 4000 (invalid)";
+	if (ix == x && iy == y && kinectRays.getWidth() == kinectRes.x && kinectRays.getHeight() == kinectRes.y)
+		return kinectRays.toWorld(ix, iy, z);
 
-    kc.w = 1;
+	// Between pixels, like the chessboard corners
+    ofVec4f kc = ofVec4f(x, y, z, 1);
     ofVec4f wc = kinectWorldMatrix*kc*kc.z;
     return ofVec3f(wc);
 }
 
+int KinectProjector::kinectROIToWorldCoords(ofRectangle ROI, std::vector<ofVec3f>& points)
+{
+	if (kinectRays.getWidth() != kinectRes.x || kinectRays.getHeight() != kinectRes.y)
+		return 0;
+	return kinectRays.toWorld(FilteredDepthImage.getFloatPixelsRef().getData(), static_cast<int>(ROI.getLeft()), static_cast<int>(ROI.getTop()),
+		static_cast<int>(ROI.getRight()), static_cast<int>(ROI.getBottom()), points);
+}
+
 ofVec2f KinectProjector::worldCoordTokinectCoord(ofVec3f wc)
 {
 	float x = (wc.x / wc.z - kinectWorldMatrix(0, 3)) / kinectWorldMatrix(0, 0);
@@ -1373,10 +1472,18 @@ ofVec3f KinectProjector::RawKinectCoordToWorldCoord(float x, float y) // x, y in
 
 float KinectProjector::elevationAtKinectCoord(float x, float y) // x, y in kinect pixel coordinate
 {
-    ofVec4f wc = kinectCoordToWorldCoord(x, y);
-    wc.w = 1;
-    float elevation = -basePlaneEq.dot(wc);
-    return elevation;
+	const ElevationMap& elevation = getElevationMap();
+	if (elevation.getWidth() == 0)
+		return 0;
+	int ix = std::min(std::max(static_cast<int>(x), 0), elevation.getWidth() - 1);
+	int iy = std::min(std::max(static_cast<int>(y), 0), elevation.getHeight() - 1);
+	return elevation.at(ix, iy);
+}
+
+const ElevationMap& KinectProjector::getElevationMap()
+{
+	elevationMap.update(FilteredDepthImage.getFloatPixelsRef().getData(), kinectRays, basePlaneEq, kinectROI);
+	return elevationMap;
 }
 
 float KinectProjector::elevationToKinectDepth(float elevation, float x, float y) // x, y in kinect pixel coordinate
@@ -1388,10 +1495,17 @@ float KinectProjector::elevationToKinectDepth(float elevation, float x, float y)
     return kinectDepth;
 }
 
-ofVec2f KinectProjector::gradientAtKinectCoord(float x, float y){
-    int ind = static_cast<int>(floor(x/gradFieldResolution)) + gradFieldcols*static_cast<int>(floor(y/gradFieldResolution));
+ofVec2f KinectProjector::gradientAtKinectCoord(float x, float y, int level){
+    const GradientFieldLevel& field = gradField[level];
+    if (field.field.empty()) // No frame yet
+        return ofVec2f(0);
+    int col = static_cast<int>(floor(x/field.resolution));
+    int row = static_cast<int>(floor(y/field.resolution));
+    if (col < 0 || col >= field.cols || row < 0 || row >= field.rows)
+        return ofVec2f(0);
+    int ind = col + field.cols*row;
     fishInd = ind;
-    return gradField[ind];
+    return field.field[ind];
 }
 
 void KinectProjector::setupGui(){
@@ -1401,22 +1515,33 @@ void KinectProjector::setupGui(){
 	gui->addBreak();
     gui->addFRM();
 	fpsKinectText = gui->addTextInput("Kinect FPS", "0");
+	kinectLoadText = gui->addTextInput("Kinect thread busy", "0 %");
+	inpaintedText = gui->addTextInput("Inpainted local/ROI avg", "0 / 0");
+	dirtyTilesText = gui->addTextInput("Changed ROI tiles", "0 %");
+	commandQueueText = gui->addTextInput("Kinect commands", "0 / 0, 0 ms");
     gui->addBreak();
     
     auto advancedFolder = gui->addFolder("Advanced", ofColor::purple);
     advancedFolder->addToggle("Display kinect depth view", drawKinectView)->setName("Draw kinect depth view");
 	advancedFolder->addToggle("Display kinect color view", drawKinectColorView)->setName("Draw kinect color view");
 	advancedFolder->addToggle("Dump Debug", DumpDebugFiles);
+	advancedFolder->addToggle("Record depth session", false);
 	advancedFolder->addSlider("Ceiling", -300, 300, 0);
     advancedFolder->addToggle("Spatial filtering", spatialFiltering);
+	advancedFolder->addSlider("Spatial filter radius", 0.5, 5, spatialFilterRadius);
 	advancedFolder->addToggle("Inpaint outliers", doInpainting);
 	advancedFolder->addToggle("Full Frame Filtering", doFullFrameFiltering);
 	advancedFolder->addToggle("Quick reaction", followBigChanges);
+	advancedFolder->addToggle("Recursive filter", filterMode == DEPTH_FILTER_MODE_RECURSIVE);
     advancedFolder->addSlider("Averaging", 1, 40, numAveragingSlots)->setPrecision(0);
+	advancedFolder->addSlider("Decimation", 1, 4, decimation)->setPrecision(0);
+	advancedFolder->addSlider("Shoreline hysteresis", 0, 5, landHysteresis);
 	advancedFolder->addSlider("Tilt X", -30, 30, 0);
 	advancedFolder->addSlider("Tilt Y", -30, 30, 0);
 	advancedFolder->addSlider("Vertical offset", -100, 100, 0);
 	advancedFolder->addButton("Reset sea level");
+	advancedFolder->addButton("Estimate sea level");
+	advancedFolder->addToggle("Track sea level drift", trackSeaLevel);
 	advancedFolder->addBreak();
 	
 	auto calibrationFolder = gui->addFolder("Calibration", ofColor::darkCyan);
@@ -1452,6 +1577,9 @@ void KinectProjector::setupGui(){
 	StatusGUI->addLabel("Calibration Status");
 	StatusGUI->addLabel("Calibration Step");
 	StatusGUI->addLabel("Projector Status");
+	StatusGUI->addLabel("Kinect Memory");
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+		StatusGUI->addLabel("Latency " + std::string(LatencyTracer::getStageName(static_cast<LatencyStage>(stage))));
 	StatusGUI->addHeader(":: Status ::", false);
 	StatusGUI->setAutoDraw(false);
 }
@@ -1510,10 +1638,10 @@ void KinectProjector::startApplication()
 			setInPainting(doInpainting);
 			setFollowBigChanges(followBigChanges);
 			setSpatialFiltering(spatialFiltering);
+			setSpatialFilterRadius(spatialFilterRadius);
+			setSeaLevelTracking(trackSeaLevel);
 
-			int nAvg = numAveragingSlots;
-			kinectgrabber.performInThread([nAvg](KinectGrabber & kg) {
-				kg.setAveragingSlotsNumber(nAvg); });
+			kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_AVERAGING_SLOTS, numAveragingSlots));
 
 			updateStatusGUI();
 		}
@@ -1607,17 +1735,18 @@ void KinectProjector::startAutomaticKinectProjectorCalibration(){
 
 void KinectProjector::setSpatialFiltering(bool sspatialFiltering){
     spatialFiltering = sspatialFiltering;
-    kinectgrabber.performInThread([sspatialFiltering](KinectGrabber & kg) {
-        kg.setSpatialFiltering(sspatialFiltering);
-    });
+    kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_SPATIAL_FILTERING, sspatialFiltering));
 	updateStatusGUI();
 }
 
+void KinectProjector::setSpatialFilterRadius(float radius){
+    spatialFilterRadius = radius;
+    kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_SPATIAL_FILTER_RADIUS, radius));
+}
+
 void KinectProjector::setInPainting(bool inp) {
 	doInpainting = inp;
-	kinectgrabber.performInThread([inp](KinectGrabber & kg) {
-		kg.setInPainting(inp);
-	});
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_INPAINTING, inp));
 	updateStatusGUI();
 }
 
@@ -1625,18 +1754,28 @@ void KinectProjector::setInPainting(bool inp) {
 void KinectProjector::setFullFrameFiltering(bool ff)
 {
 	doFullFrameFiltering = ff;
-	ofRectangle ROI = kinectROI;
-	kinectgrabber.performInThread([ff, ROI](KinectGrabber & kg) {
-		kg.setFullFrameFiltering(ff, ROI);
-	});
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_FULL_FRAME_FILTERING, ff, kinectROI));
 	updateStatusGUI();
 }
 
 void KinectProjector::setFollowBigChanges(bool sfollowBigChanges){
     followBigChanges = sfollowBigChanges;
-    kinectgrabber.performInThread([sfollowBigChanges](KinectGrabber & kg) {
-        kg.setFollowBigChange(sfollowBigChanges);
-    });
+    kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_FOLLOW_BIG_CHANGE, sfollowBigChanges));
+	updateStatusGUI();
+}
+
+void KinectProjector::setRecursiveFiltering(bool recursive){
+	filterMode = recursive ? DEPTH_FILTER_MODE_RECURSIVE : DEPTH_FILTER_MODE_AVERAGING;
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_FILTER_MODE, filterMode));
+	updateStatusGUI();
+}
+
+void KinectProjector::setDecimation(int sdecimation){
+	sdecimation = KinectGrabber::getValidDecimation(sdecimation);
+	if (sdecimation == decimation)
+		return;
+	decimation = sdecimation;
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_DECIMATION, decimation));
 	updateStatusGUI();
 }
 
@@ -1662,6 +1801,8 @@ void KinectProjector::onButtonEvent(ofxDatGuiButtonEvent e){
     } else if (e.target->is("Reset sea level")){
 		ResetSeaLevel();
 
+    } else if (e.target->is("Estimate sea level")){
+		estimateSeaLevel();
     }
 	else if (e.target->is("Auto Adjust ROI"))
 	{
@@ -1690,6 +1831,54 @@ void KinectProjector::ResetSeaLevel()
 	basePlaneUpdated = true;
 }
 
+void KinectProjector::estimateSeaLevel()
+{
+	if (!kinectOpened || applicationState == APPLICATION_STATE_CALIBRATING)
+		return;
+	updateBasePlane();
+	if (!basePlaneComputed)
+		return;
+	// The sliders are relative to the new plane
+	gui->getSlider("Tilt X")->setValue(0);
+	gui->getSlider("Tilt Y")->setValue(0);
+	gui->getSlider("Vertical offset")->setValue(0);
+}
+
+void KinectProjector::setSeaLevelTracking(bool track)
+{
+	trackSeaLevel = track;
+	if (trackSeaLevel)
+	{
+		resetSeaLevelTracker();
+		seaLevelTracker.start();
+	}
+	else
+		seaLevelTracker.stop();
+	updateStatusGUI();
+}
+
+void KinectProjector::resetSeaLevelTracker()
+{
+	seaLevelTracker.reset(kinectRays, getPlaneEquation(basePlaneOffsetBack, basePlaneNormalBack));
+}
+
+void KinectProjector::applySeaLevelDrift(const ofVec4f& seaLevel, float ceilingShift)
+{
+	// The calibrated sea level and ceiling drifted, the sliders stay relative to them
+	basePlaneNormalBack = ofVec3f(seaLevel);
+	basePlaneOffsetBack = ofVec3f(0, 0, -seaLevel.w / seaLevel.z);
+	basePlaneNormal = basePlaneNormalBack.getRotated(gui->getSlider("Tilt X")->getValue(), ofVec3f(1,0,0));
+	basePlaneNormal.rotate(gui->getSlider("Tilt Y")->getValue(), ofVec3f(0,1,0));
+	basePlaneOffset = basePlaneOffsetBack;
+	basePlaneOffset.z += gui->getSlider("Vertical offset")->getValue();
+	basePlaneEq = getPlaneEquation(basePlaneOffset, basePlaneNormal);
+	basePlaneUpdated = true;
+	maxOffsetBack += ceilingShift;
+	maxOffset = maxOffsetBack - gui->getSlider("Ceiling")->getValue();
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_MAX_OFFSET, maxOffset));
+	ofLogVerbose("KinectProjector") << "applySeaLevelDrift(): basePlaneEq " << basePlaneEq << ", maxOffset " << maxOffset;
+}
+
 void KinectProjector::showROIonProjector(bool show)
 {
 	doShowROIonProjector = show;
@@ -1710,6 +1899,9 @@ void KinectProjector::onToggleEvent(ofxDatGuiToggleEvent e){
 	else if (e.target->is("Quick reaction")) {
 		setFollowBigChanges(e.checked);
 	}
+	else if (e.target->is("Recursive filter")) {
+		setRecursiveFiltering(e.checked);
+	}
 	else if (e.target->is("Inpaint outliers")) {
 		setInPainting(e.checked);
     } 
@@ -1736,6 +1928,14 @@ void KinectProjector::onToggleEvent(ofxDatGuiToggleEvent e){
 	{
 		DumpDebugFiles = e.checked;
 	}
+	else if (e.target->is("Record depth session"))
+	{
+		setRecording(e.checked);
+	}
+	else if (e.target->is("Track sea level drift"))
+	{
+		setSeaLevelTracking(e.checked);
+	}
 	else if (e.target->is("Show ROI on sand"))
 	{
 		showROIonProjector(e.checked);
@@ -1755,14 +1955,16 @@ void KinectProjector::onSliderEvent(ofxDatGuiSliderEvent e){
     } else if (e.target->is("Ceiling")){
         maxOffset = maxOffsetBack-e.value;
         ofLogVerbose("KinectProjector") << "onSliderEvent(): maxOffset" << maxOffset ;
-        kinectgrabber.performInThread([this](KinectGrabber & kg) {
-            kg.setMaxOffset(this->maxOffset);
-        });
+        kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_MAX_OFFSET, maxOffset));
+    } else if(e.target->is("Spatial filter radius")){
+        setSpatialFilterRadius(e.value);
     } else if(e.target->is("Averaging")){
         numAveragingSlots = e.value;
-        kinectgrabber.performInThread([e](KinectGrabber & kg) {
-            kg.setAveragingSlotsNumber(e.value);
-        });
+        kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_AVERAGING_SLOTS, numAveragingSlots));
+    } else if(e.target->is("Decimation")){
+        setDecimation(static_cast<int>(e.value));
+    } else if(e.target->is("Shoreline hysteresis")){
+        landHysteresis = e.value;
     }
 }
 
@@ -1866,10 +2068,23 @@ bool KinectProjector::loadSettings(){
     maxOffsetBack = xml.getValue<float>("maxOffsetBack");
     maxOffset = maxOffsetBack;
     spatialFiltering = xml.getValue<bool>("spatialFiltering");
+    spatialFilterRadius = xml.getValue<float>("SpatialFilterRadius", 1.0f);
     followBigChanges = xml.getValue<bool>("followBigChanges");
     numAveragingSlots = xml.getValue<int>("numAveragingSlots");
 	doInpainting = xml.getValue<bool>("OutlierInpainting", false);
 	doFullFrameFiltering = xml.getValue<bool>("FullFrameFiltering", false);
+	numFilterThreads = xml.getValue<int>("NumFilterThreads", 0);
+	filterStorage = xml.getValue<bool>("FixedPointFiltering", false) ? DEPTH_FILTER_STORAGE_FIXED : DEPTH_FILTER_STORAGE_FLOAT;
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_NUM_FILTER_THREADS, numFilterThreads));
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_FILTER_STORAGE, filterStorage));
+	filterMode = xml.getValue<bool>("RecursiveFiltering", false) ? DEPTH_FILTER_MODE_RECURSIVE : DEPTH_FILTER_MODE_AVERAGING;
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_FILTER_MODE, filterMode));
+	hugePages = xml.getValue<bool>("HugePages", false);
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_HUGE_PAGES, hugePages));
+	decimation = KinectGrabber::getValidDecimation(xml.getValue<int>("Decimation", 1));
+	kinectgrabber.queueCommand(GrabberCommand(GRABBER_COMMAND_DECIMATION, decimation));
+	landHysteresis = xml.getValue<float>("LandHysteresis", 0.0f);
+	trackSeaLevel = xml.getValue<bool>("TrackSeaLevelDrift", false);
     return true;
 }
 
@@ -1886,10 +2101,18 @@ bool KinectProjector::saveSettings()
     xml.addValue("basePlaneEq", basePlaneEq);
     xml.addValue("maxOffsetBack", maxOffsetBack);
     xml.addValue("spatialFiltering", spatialFiltering);
+    xml.addValue("SpatialFilterRadius", spatialFilterRadius);
     xml.addValue("followBigChanges", followBigChanges);
     xml.addValue("numAveragingSlots", numAveragingSlots);
 	xml.addValue("OutlierInpainting", doInpainting);
 	xml.addValue("FullFrameFiltering", doFullFrameFiltering);
+	xml.addValue("NumFilterThreads", numFilterThreads);
+	xml.addValue("FixedPointFiltering", filterStorage == DEPTH_FILTER_STORAGE_FIXED);
+	xml.addValue("RecursiveFiltering", filterMode == DEPTH_FILTER_MODE_RECURSIVE);
+	xml.addValue("HugePages", hugePages);
+	xml.addValue("Decimation", decimation);
+	xml.addValue("LandHysteresis", landHysteresis);
+	xml.addValue("TrackSeaLevelDrift", trackSeaLevel);
 	xml.setToParent();
     return xml.save(settingsFile);
 }
@@ -1997,11 +2220,8 @@ void KinectProjector::SaveFilteredDepthImageDebug()
 
 			fostKC << val << std::endl;
 
-			// Kinect coords
-			ofVec4f kc = ofVec4f(x, y, val, 1);
-
 			// World coords
-			ofVec4f wc = kinectWorldMatrix*kc*kc.z;
+			ofVec3f wc = kinectRays.toWorld(x, y, val);
 			fostWC << wc.x << " " << wc.y << " " << wc.z << std::endl;
 
 			float H = elevationAtKinectCoord(x, y);
@@ -2021,26 +2241,23 @@ bool KinectProjector::getBinaryLandImage(ofxCvGrayscaleImage& BinImg)
 	if (!kinectOpened)
 		return false;
 
-	float *imgData = FilteredDepthImage.getFloatPixelsRef().getData();
-
-	BinImg.allocate(kinectRes.x, kinectRes.y);
-	unsigned char *binData = BinImg.getPixels().getData();
-
-	for (int y = 0; y < kinectRes.y; y++)
+	// Only the tiles of the ROI that changed since the last call are
+	// classified again, everything when the base plane moved
+	const ElevationMap& elevation = getElevationMap();
+	int w = static_cast<int>(kinectRes.x);
+	int h = static_cast<int>(kinectRes.y);
+	if (elevation.getWidth() != w || elevation.getHeight() != h)
+		return false;
+	if (landMaskBasePlaneEq != basePlaneEq)
 	{
-		for (int x = 0; x < kinectRes.x; x++)
-		{
-			int IDX = y * kinectRes.x + x;
-			double val = imgData[IDX];
-
-			float H = elevationAtKinectCoord(x, y);
-
-			unsigned char BinOut = 255 * (H > 0);
-
-			binData[IDX] = BinOut;
-		}
+		landMask.invalidateAll();
+		landMaskBasePlaneEq = basePlaneEq;
 	}
+	landMask.update(elevation, kinectROI, landHysteresis);
 
+	if (BinImg.getWidth() != w || BinImg.getHeight() != h)
+		BinImg.allocate(w, h);
+	BinImg.setFromPixels(landMask.getPixels());
 	return true;
 }
 
@@ -2105,11 +2322,8 @@ void KinectProjector::SaveFilteredDepthImage()
 			
 			fostKC << val << std::endl;
 
-			// Kinect coords
-			ofVec4f kc = ofVec4f(x, y, val, 1);
-
 			// World coords
-			ofVec4f wc = kinectWorldMatrix*kc*kc.z;
+			ofVec3f wc = kinectRays.toWorld(x, y, val);
 			fostWC << wc.x << " " << wc.y << " " << wc.z << std::endl;
 
 			float H = elevationAtKinectCoord(x, y);
@@ -2124,22 +2338,24 @@ void KinectProjector::SaveFilteredDepthImage()
 	ofSaveImage(BinImg.getPixels(), BinOutName);
 }
 
+void KinectProjector::SaveLatencyTrace()
+{
+	std::string LatencyOutName = ofToDataPath(DebugFileOutDir + "LatencyTrace_" + GetTimeAndDateString() + ".json");
+	if (latencyTracer.dump(LatencyOutName))
+		ofLogVerbose("KinectProjector") << "SaveLatencyTrace(): latency trace saved to " << LatencyOutName;
+	else
+		ofLogError("KinectProjector") << "SaveLatencyTrace(): could not write " << LatencyOutName;
+}
+
 void KinectProjector::SaveKinectColorImage()
 {
 	std::string ColourOutName = DebugFileOutDir + "RawColorImage.png";
 	std::string MedianOutName = DebugFileOutDir + "TemporalFilteredImage.png";
 	ofSaveImage(kinectColorImage.getPixels(), ColourOutName);
 
-	if (TemporalFrameFilter.isValid())
-	{
-		ofxCvGrayscaleImage tempImage;
-//		tempImage.allocate(kinectColorImage.width, kinectColorImage.height);
-		if (TemporalFilteringType == 0)
-			tempImage.setFromPixels(TemporalFrameFilter.getMedianFilteredImage(), kinectColorImage.width, kinectColorImage.height);
-		if (TemporalFilteringType == 1)
-			tempImage.setFromPixels(TemporalFrameFilter.getAverageFilteredColImage(), kinectColorImage.width, kinectColorImage.height);
-		ofSaveImage(tempImage.getPixels(), MedianOutName);
-	}
+	// Filtered while the colour view is shown
+	if (TemporalFilteredImage.isAllocated())
+		ofSaveImage(TemporalFilteredImage, MedianOutName);
 
 }
 
@@ -33,7 +33,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "KinectProjectorCalibration.h"
 #include "Utils.h"
-#include "TemporalFrameFilter.h"
+#include "LatencyTracer.h"
+#include "KinectRayTable.h"
+#include "ElevationMap.h"
+#include "LandMask.h"
+#include "PlaneMoments.h"
+#include "RansacPlaneFit.h"
+#include "SeaLevelTracker.h"
 
 class ofxModalThemeProjKinect : public ofxModalTheme {
 public:
@@ -49,13 +55,19 @@ class KinectProjector {
 public:
     KinectProjector(std::shared_ptr<ofAppBaseWindow> const& p);
     
+    // Replay a recorded session instead of the live Kinect. Must be called before setup()
+    void setReplayFile(std::string file, RecordedFrameSource::Playback_mode mode);
+    void stepReplay(int frames);
+    // Record the raw Kinect frames to bin/data/Recordings for later replay
+    void setRecording(bool record);
+
     // Running loop functions
     void setup(bool sdisplayGui);
     void update();
     void updateNativeScale(float scaleMin, float scaleMax);
     void drawProjectorWindow();
     void drawMainWindow(float x, float y, float width, float height);
-    void drawGradField();
+    void drawGradField(int level = 0);
 
     // Coordinate conversion functions
     ofVec2f worldCoordToProjCoord(ofVec3f vin);
@@ -64,11 +76,15 @@ public:
 	ofVec2f kinectCoordToProjCoord(float x, float y, float z);
 	
 	ofVec3f kinectCoordToWorldCoord(float x, float y);
+	// World coordinates of the pixels of a rectangle in kinect coordinates,
+	// row after row, clipped to the kinect image. points only grows, so it can
+	// be reused from frame to frame. Returns the number of points
+	int kinectROIToWorldCoords(ofRectangle ROI, std::vector<ofVec3f>& points);
 	ofVec2f worldCoordTokinectCoord(ofVec3f wc);
 	ofVec3f RawKinectCoordToWorldCoord(float x, float y);
-    float elevationAtKinectCoord(float x, float y);
+    float elevationAtKinectCoord(float x, float y); // Of the pixel, from getElevationMap()
     float elevationToKinectDepth(float elevation, float x, float y);
-    ofVec2f gradientAtKinectCoord(float x, float y);
+    ofVec2f gradientAtKinectCoord(float x, float y, int level = 0); // Level 0 has the finest cells
 
 	// Try to start the application - assumes calibration has been done before
 	void startApplication();
@@ -80,12 +96,20 @@ public:
     void setGradFieldResolution(int gradFieldResolution);
 	void updateStatusGUI();
 	void setSpatialFiltering(bool sspatialFiltering);
+	void setSpatialFilterRadius(float radius);
 	void setInPainting(bool inp);
 	void setFullFrameFiltering(bool ff);	
 	
 	void setFollowBigChanges(bool sfollowBigChanges);
+	void setRecursiveFiltering(bool recursive);
+	void setDecimation(int sdecimation); // 1, 2 or 4, restarts the filter
 	void StartManualROIDefinition();
 	void ResetSeaLevel();
+	// Fit the sea level to the sand now, ignoring what sticks out of it
+	void estimateSeaLevel();
+	// Follow the drift of the kinect depth in the background, correcting the
+	// sea level and the ceiling
+	void setSeaLevelTracking(bool track);
 	void showROIonProjector(bool show);
 
     // Gui and event functions
@@ -143,6 +167,15 @@ public:
 
 	// Map Game interface
 	bool getBinaryLandImage(ofxCvGrayscaleImage& BinImg);
+	// Tiles of the depth image that changed with the last frame from the
+	// grabber. Everything else is as it was the frame before
+	const DirtyTiles& getDirtyTiles(){
+		return depthDirty;
+	}
+	// Elevation of every pixel of the depth image above the base plane,
+	// brought up to date with the base plane first. Its version changes
+	// whenever an elevation does
+	const ElevationMap& getElevationMap();
 
 	bool isCalibrated(){
         return projKinectCalibrated;
@@ -176,9 +209,15 @@ public:
 
 	bool getDumpDebugFiles();
 
+	// The current depth frame reached a stage drawn outside the KinectProjector
+	void traceLatency(LatencyStage stage){
+		latencyTracer.stamp(stage);
+	}
+
 	// Debug functions
 	void SaveFilteredDepthImage();
 	void SaveKinectColorImage();
+	void SaveLatencyTrace();
 
 private:
 
@@ -215,7 +254,6 @@ private:
 
    
     void exit(ofEventArgs& e);
-    void setupGradientField();
     
 
     void updateCalibration();
@@ -240,6 +278,9 @@ private:
     bool addPointPair();
     void updateMaxOffset();
     void updateBasePlane();
+    PlaneFit fitPlane(const ofRectangle& ROI); // To the depth image in the ROI, in world coordinates
+    void resetSeaLevelTracker(); // The rays or the calibrated sea level changed
+    void applySeaLevelDrift(const ofVec4f& seaLevel, float ceilingShift);
     void askToFlattenSand();
 
     void drawChessboard(int x, int y, int chessboardSize);
@@ -277,18 +318,36 @@ private:
     
     //kinect grabber
     KinectGrabber               kinectgrabber;
+    std::shared_ptr<RecordedFrameSource> replaySource;
     bool                        spatialFiltering;
+    float                       spatialFilterRadius; // Standard deviation in kinect pixels
     bool                        followBigChanges;
     int                         numAveragingSlots;
 	bool                        doInpainting;
 	bool                        doFullFrameFiltering;
+	int                         numFilterThreads; // 0: one per core
+	DepthFilterStorage          filterStorage; // Float or fixed point filter buffers
+	DepthFilterMode             filterMode; // Averaging slots or recursive filter
+	bool                        hugePages; // Filter buffers on transparent huge pages
+	int                         decimation; // Kinect pixels binned per filtered pixel along each axis
 
     //kinect buffer
     ofxCvFloatImage             FilteredDepthImage;
     ofxCvColorImage             kinectColorImage;
-    ofVec2f*                    gradField;
+    GradientFieldLevel          gradField[GradientField::numLevels];
+    DirtyTiles                  depthDirty; // Of the last frame
+    bool                        depthImageOutdated; // Upload the next frame even if no tile changed
+    LandMask                    landMask; // Kept by getBinaryLandImage() between calls
+    ofVec4f                     landMaskBasePlaneEq; // Base plane landMask was computed with
+    float                       landHysteresis; // Elevation above/below the sea level making a pixel land/water
 	ofFpsCounter                fpsKinect;
 	ofxDatGuiTextInput*         fpsKinectText;
+	ofxDatGuiTextInput*         kinectLoadText; // Busy share of the grabber thread
+	ofxDatGuiTextInput*         inpaintedText; // Holes filled in the last frame
+	ofxDatGuiTextInput*         dirtyTilesText; // Share of the ROI that changed in the last frame
+	ofxDatGuiTextInput*         commandQueueText; // Last batch of grabber commands
+	uint64_t                    lastGrabberBusyTime, lastGrabberIdleTime;
+	LatencyTracer               latencyTracer; // Age of the depth frames from the Kinect to the projector
 
     // Projector and kinect variables
     ofVec2f projRes;
@@ -304,7 +363,6 @@ private:
 //	ofxCvFloatImage             Dptimg;
     
     //Gradient field variables
-    int gradFieldcols, gradFieldrows;
     int gradFieldResolution;
     float arrowLength;
     int fishInd;
@@ -334,11 +392,21 @@ private:
     // Conversion matrices
     ofMatrix4x4                 kinectProjMatrix;
     ofMatrix4x4                 kinectWorldMatrix;
+    KinectRayTable              kinectRays; // Of kinectWorldMatrix, for each kinect pixel
+    ElevationMap                elevationMap; // Of FilteredDepthImage, updated with each frame
 
     // Max offset for keeping kinect points
     float maxOffset;
     float maxOffsetSafeRange;
     float maxOffsetBack;
+
+    // Sea level fit, ignoring hands, toys and piles of sand
+    RansacPlaneFit seaLevelFit;
+    RansacParameters seaLevelFitParameters;
+    float basePlaneInlierFraction; // Of the ROI at sea level in the last fit
+    float minBasePlaneInlierFraction; // Below this the sand is not considered flat
+    SeaLevelTracker seaLevelTracker; // Runs while trackSeaLevel
+    bool trackSeaLevel;
     
     // Autocalib points
     ofPoint* autoCalibPts; // Center of autocalib chess boards
@@ -346,9 +414,9 @@ private:
     int trials;
     bool upframe;
 
-	// Temporal frame filter for cleaning the colour image used for calibration. It should probably be moved to the grabber class/thread
-	CTemporalFrameFilter TemporalFrameFilter;
-	// Keeps track of how many frames are acquired since last calibration event
+	// Latest image of the temporal filter the grabber runs on the colour frames, used for calibration
+	ofPixels TemporalFilteredImage;
+	// Frames filtered since last calibration event
 	int TemporalFrameCounter;
 	// Type of temporal filtering of colour image 0: Median, 1 :average
 	int TemporalFilteringType;
@@ -370,6 +438,7 @@ private:
 	// Debug functions
 	bool DumpDebugFiles;
 	std::string DebugFileOutDir;
+	std::string RecordingOutDir;
 	std::string GetTimeAndDateString();
 	bool savePointPair();
 	void SaveFilteredDepthImageDebug();
@@ -0,0 +1,170 @@
+/***********************************************************************
+KinectRayTable - World space ray of every Kinect pixel, to turn depth
+frames into points with one multiplication per coordinate.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "KinectRayTable.h"
+#include <algorithm>
+
+#ifdef DEPTH_FILTER_X86
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(ofVec3f) == 3 * sizeof(float), "The SIMD conversions write the points as packed floats");
+
+namespace {
+
+// One row of the rectangle: rays and depth start at its first pixel
+struct RayRow
+{
+	const float* rayX;
+	const float* rayY;
+	const float* rayZ;
+	const float* depth;
+	ofVec3f* points;
+	int numPixels;
+};
+
+void toWorldScalar(const RayRow& row, int i)
+{
+	for (; i < row.numPixels; i++)
+	{
+		float d = row.depth[i];
+		row.points[i] = ofVec3f(row.rayX[i] * d, row.rayY[i] * d, row.rayZ[i] * d);
+	}
+}
+
+#ifdef DEPTH_FILTER_X86
+
+// Interleave 4 points into x y z triples. Each store writes 4 floats, the
+// 4th is overwritten by the next point, so the caller keeps at least one
+// point after the last group
+DEPTH_FILTER_TARGET("sse4.1")
+inline void storePoints(float* out, __m128 x, __m128 y, __m128 z)
+{
+	__m128 w = z;
+	_MM_TRANSPOSE4_PS(x, y, z, w);
+	_mm_storeu_ps(out, x);
+	_mm_storeu_ps(out + 3, y);
+	_mm_storeu_ps(out + 6, z);
+	_mm_storeu_ps(out + 9, w);
+}
+
+DEPTH_FILTER_TARGET("sse4.1")
+void toWorldSSE41(const RayRow& row)
+{
+	float* out = &row.points[0].x;
+	int i = 0;
+	for (; i + 4 < row.numPixels; i += 4)
+	{
+		__m128 d = _mm_loadu_ps(row.depth + i);
+		storePoints(out + 3 * i, _mm_mul_ps(_mm_loadu_ps(row.rayX + i), d), _mm_mul_ps(_mm_loadu_ps(row.rayY + i), d),
+			_mm_mul_ps(_mm_loadu_ps(row.rayZ + i), d));
+	}
+	toWorldScalar(row, i);
+}
+
+DEPTH_FILTER_TARGET("avx2")
+void toWorldAVX2(const RayRow& row)
+{
+	float* out = &row.points[0].x;
+	int i = 0;
+	for (; i + 8 < row.numPixels; i += 8)
+	{
+		__m256 d = _mm256_loadu_ps(row.depth + i);
+		__m256 x = _mm256_mul_ps(_mm256_loadu_ps(row.rayX + i), d);
+		__m256 y = _mm256_mul_ps(_mm256_loadu_ps(row.rayY + i), d);
+		__m256 z = _mm256_mul_ps(_mm256_loadu_ps(row.rayZ + i), d);
+		storePoints(out + 3 * i, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z));
+		storePoints(out + 3 * i + 12, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1));
+	}
+	toWorldScalar(row, i);
+}
+
+#endif
+
+}
+
+KinectRayTable::KinectRayTable()
+:width(0),
+height(0),
+numPixels(0)
+{
+}
+
+void KinectRayTable::setup(const ofMatrix4x4& worldMatrix, int swidth, int sheight)
+{
+	width = std::max(swidth, 0);
+	height = std::max(sheight, 0);
+	numPixels = width * height;
+	rays.resize(3 * numPixels);
+	if (worldMatrix(0, 2) != 0 || worldMatrix(1, 2) != 0 || worldMatrix(2, 2) != 0)
+		ofLogWarning("KinectRayTable") << "setup(): the world matrix depends on the depth, the rays leave that out";
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			int idx = y * width + x;
+			for (int c = 0; c < 3; c++)
+				rays[c * numPixels + idx] = worldMatrix(c, 0) * x + worldMatrix(c, 1) * y + worldMatrix(c, 3);
+		}
+	}
+}
+
+int KinectRayTable::toWorld(const float* depth, int minX, int minY, int maxX, int maxY, std::vector<ofVec3f>& points, DepthFilterKernel kernel) const
+{
+	minX = std::max(minX, 0);
+	minY = std::max(minY, 0);
+	maxX = std::min(maxX, width);
+	maxY = std::min(maxY, height);
+	if (minX >= maxX || minY >= maxY)
+		return 0;
+	int rowLength = maxX - minX;
+	int numPoints = rowLength * (maxY - minY);
+	if (points.size() < static_cast<size_t>(numPoints))
+		points.resize(numPoints);
+
+	for (int y = minY; y < maxY; y++)
+	{
+		int idx = y * width + minX;
+		RayRow row;
+		row.rayX = &rays[idx];
+		row.rayY = &rays[numPixels + idx];
+		row.rayZ = &rays[2 * numPixels + idx];
+		row.depth = depth + idx;
+		row.points = &points[(y - minY) * rowLength];
+		row.numPixels = rowLength;
+#ifdef DEPTH_FILTER_X86
+		if (kernel == DEPTH_FILTER_KERNEL_AVX2)
+		{
+			toWorldAVX2(row);
+			continue;
+		}
+		if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+		{
+			toWorldSSE41(row);
+			continue;
+		}
+#endif
+		toWorldScalar(row, 0);
+	}
+	return numPoints;
+}
@@ -0,0 +1,73 @@
+/***********************************************************************
+KinectRayTable - World space ray of every Kinect pixel, to turn depth
+frames into points with one multiplication per coordinate.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "DepthFilterKernels.h"
+
+// The kinect world matrix (KinectGrabber::getWorldMatrix()) maps pixel
+// (x, y) at depth d to M * (x, y, d, 1) * d. Its depth column is zero, so
+// this is the ray M * (x, y, 0, 1) scaled by d, and the rays are computed
+// once when the matrix is known. The SIMD conversions do the same float
+// multiplications as the scalar one and give identical points.
+class KinectRayTable {
+public:
+	KinectRayTable();
+
+	// Rays of a width x height frame. Only the depth column of worldMatrix
+	// is ignored, a warning is logged if it is not zero
+	void setup(const ofMatrix4x4& worldMatrix, int width, int height);
+	bool isSetup() const {
+		return width > 0;
+	}
+	int getWidth() const {
+		return width;
+	}
+	int getHeight() const {
+		return height;
+	}
+
+	// The x, y and z planes of the rays, width * height floats each
+	const float* getRays(int axis) const {
+		return rays.data() + axis * numPixels;
+	}
+	ofVec3f getRay(int x, int y) const {
+		int idx = y * width + x;
+		return ofVec3f(rays[idx], rays[numPixels + idx], rays[2 * numPixels + idx]);
+	}
+	// Same as kinectWorldMatrix * (x, y, depth, 1) * depth
+	ofVec3f toWorld(int x, int y, float depth) const {
+		int idx = y * width + x;
+		return ofVec3f(rays[idx] * depth, rays[numPixels + idx] * depth, rays[2 * numPixels + idx] * depth);
+	}
+
+	// Convert the pixels [minX, maxX) x [minY, maxY) of a depth frame of the
+	// table size, row after row, into points. The rectangle is clipped to the
+	// frame and points only grows. Returns the number of points
+	int toWorld(const float* depth, int minX, int minY, int maxX, int maxY, std::vector<ofVec3f>& points,
+		DepthFilterKernel kernel = getBestDepthFilterKernel()) const;
+
+private:
+	int width, height;
+	int numPixels;
+	std::vector<float> rays; // Planes of the x, y and z components
+};
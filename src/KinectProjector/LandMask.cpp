@@ -0,0 +1,203 @@
+/***********************************************************************
+LandMask - Binary land/water image of the elevation map, updated in the
+tiles that changed, with hysteresis around the sea level.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "LandMask.h"
+#include <algorithm>
+
+#ifdef DEPTH_FILTER_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Land above high, water below or at low, the previous class in between
+void classifyRowScalar(const float* elevations, unsigned char* mask, int numPixels, float high, float low, int i)
+{
+	for (; i < numPixels; i++)
+		mask[i] = (elevations[i] > high || (mask[i] && elevations[i] > low)) ? 255 : 0;
+}
+
+#ifdef DEPTH_FILTER_X86
+
+// The float comparisons give all ones or zeros per pixel, packing them with
+// signed saturation keeps that, down to one byte per pixel
+DEPTH_FILTER_TARGET("sse4.1")
+void classifyRowSSE41(const float* elevations, unsigned char* mask, int numPixels, float high, float low)
+{
+	const __m128 h = _mm_set1_ps(high);
+	const __m128 l = _mm_set1_ps(low);
+	int i = 0;
+	for (; i + 16 <= numPixels; i += 16)
+	{
+		__m128 e0 = _mm_loadu_ps(elevations + i);
+		__m128 e1 = _mm_loadu_ps(elevations + i + 4);
+		__m128 e2 = _mm_loadu_ps(elevations + i + 8);
+		__m128 e3 = _mm_loadu_ps(elevations + i + 12);
+		__m128i above = _mm_packs_epi16(
+			_mm_packs_epi32(_mm_castps_si128(_mm_cmpgt_ps(e0, h)), _mm_castps_si128(_mm_cmpgt_ps(e1, h))),
+			_mm_packs_epi32(_mm_castps_si128(_mm_cmpgt_ps(e2, h)), _mm_castps_si128(_mm_cmpgt_ps(e3, h))));
+		__m128i notBelow = _mm_packs_epi16(
+			_mm_packs_epi32(_mm_castps_si128(_mm_cmpgt_ps(e0, l)), _mm_castps_si128(_mm_cmpgt_ps(e1, l))),
+			_mm_packs_epi32(_mm_castps_si128(_mm_cmpgt_ps(e2, l)), _mm_castps_si128(_mm_cmpgt_ps(e3, l))));
+		__m128i previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), _mm_or_si128(above, _mm_and_si128(previous, notBelow)));
+	}
+	classifyRowScalar(elevations, mask, numPixels, high, low, i);
+}
+
+// The packs work within 128 bit lanes, a permutation of the 4 byte groups
+// puts the pixels back in order
+DEPTH_FILTER_TARGET("avx2")
+__m256i packComparisonsAVX2(__m256 c0, __m256 c1, __m256 c2, __m256 c3)
+{
+	__m256i packed = _mm256_packs_epi16(
+		_mm256_packs_epi32(_mm256_castps_si256(c0), _mm256_castps_si256(c1)),
+		_mm256_packs_epi32(_mm256_castps_si256(c2), _mm256_castps_si256(c3)));
+	return _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+DEPTH_FILTER_TARGET("avx2")
+void classifyRowAVX2(const float* elevations, unsigned char* mask, int numPixels, float high, float low)
+{
+	const __m256 h = _mm256_set1_ps(high);
+	const __m256 l = _mm256_set1_ps(low);
+	int i = 0;
+	for (; i + 32 <= numPixels; i += 32)
+	{
+		__m256 e0 = _mm256_loadu_ps(elevations + i);
+		__m256 e1 = _mm256_loadu_ps(elevations + i + 8);
+		__m256 e2 = _mm256_loadu_ps(elevations + i + 16);
+		__m256 e3 = _mm256_loadu_ps(elevations + i + 24);
+		__m256i above = packComparisonsAVX2(_mm256_cmp_ps(e0, h, _CMP_GT_OQ), _mm256_cmp_ps(e1, h, _CMP_GT_OQ),
+			_mm256_cmp_ps(e2, h, _CMP_GT_OQ), _mm256_cmp_ps(e3, h, _CMP_GT_OQ));
+		__m256i notBelow = packComparisonsAVX2(_mm256_cmp_ps(e0, l, _CMP_GT_OQ), _mm256_cmp_ps(e1, l, _CMP_GT_OQ),
+			_mm256_cmp_ps(e2, l, _CMP_GT_OQ), _mm256_cmp_ps(e3, l, _CMP_GT_OQ));
+		__m256i previous = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mask + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(mask + i), _mm256_or_si256(above, _mm256_and_si256(previous, notBelow)));
+	}
+	classifyRowSSE41(elevations + i, mask + i, numPixels - i, high, low);
+}
+
+#endif
+
+void classifyRow(DepthFilterKernel kernel, const float* elevations, unsigned char* mask, int numPixels, float high, float low)
+{
+#ifdef DEPTH_FILTER_X86
+	if (kernel == DEPTH_FILTER_KERNEL_AVX2)
+	{
+		classifyRowAVX2(elevations, mask, numPixels, high, low);
+		return;
+	}
+	if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+	{
+		classifyRowSSE41(elevations, mask, numPixels, high, low);
+		return;
+	}
+#endif
+	classifyRowScalar(elevations, mask, numPixels, high, low, 0);
+}
+
+}
+
+LandMask::LandMask()
+:outdated(true),
+minX(0),
+minY(0),
+maxX(0),
+maxY(0),
+version(0)
+{
+}
+
+void LandMask::invalidate(const DirtyTiles& changed)
+{
+	dirty.merge(changed);
+}
+
+void LandMask::invalidateAll()
+{
+	outdated = true;
+}
+
+bool LandMask::update(const ElevationMap& elevation, const ofRectangle& ROI, float hysteresis, DepthFilterKernel kernel)
+{
+	int width = elevation.getWidth();
+	int height = elevation.getHeight();
+	if (static_cast<int>(mask.getWidth()) != width || static_cast<int>(mask.getHeight()) != height)
+	{
+		mask.allocate(width, height, 1);
+		dirty.resize(width, height);
+		outdated = true;
+	}
+	int roiMinX = std::max(static_cast<int>(ROI.getLeft()), 0);
+	int roiMinY = std::max(static_cast<int>(ROI.getTop()), 0);
+	int roiMaxX = std::min(static_cast<int>(ROI.getRight()), width);
+	int roiMaxY = std::min(static_cast<int>(ROI.getBottom()), height);
+	if (outdated || roiMinX != minX || roiMinY != minY || roiMaxX != maxX || roiMaxY != maxY)
+	{
+		minX = roiMinX;
+		minY = roiMinY;
+		maxX = roiMaxX;
+		maxY = roiMaxY;
+		// Outside the ROI too, where the elevation is the same everywhere
+		unsigned char* data = mask.getData();
+		std::fill(data, data + width * height, 0);
+		for (int y = 0; y < height; y++)
+			classifyRow(kernel, elevation.getData() + y * width, data + y * width, width, 0, 0);
+		dirty.clear();
+		outdated = false;
+		version++;
+		return true;
+	}
+	if (!dirty.any())
+		return false;
+
+	// Runs of dirty tiles along each row of tiles, clipped to the ROI
+	float high = std::max(hysteresis, 0.0f);
+	for (int tileY = 0; tileY < dirty.getNumTilesY(); tileY++)
+	{
+		int y0 = std::max(tileY * DirtyTiles::tileSize, minY);
+		int y1 = std::min((tileY + 1) * DirtyTiles::tileSize, maxY);
+		int tileX = 0;
+		while (y0 < y1 && tileX < dirty.getNumTilesX())
+		{
+			if (!dirty.isDirty(tileX, tileY))
+			{
+				tileX++;
+				continue;
+			}
+			int runStart = tileX;
+			while (tileX < dirty.getNumTilesX() && dirty.isDirty(tileX, tileY))
+				tileX++;
+			int x0 = std::max(runStart * DirtyTiles::tileSize, minX);
+			int x1 = std::min(tileX * DirtyTiles::tileSize, maxX);
+			for (int y = y0; y < y1 && x0 < x1; y++)
+			{
+				int idx = y * width + x0;
+				classifyRow(kernel, elevation.getData() + idx, mask.getData() + idx, x1 - x0, high, -high);
+			}
+		}
+	}
+	dirty.clear();
+	version++;
+	return true;
+}
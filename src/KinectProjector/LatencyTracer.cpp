@@ -0,0 +1,184 @@
+/***********************************************************************
+LatencyTracer - Age of the depth frames at each stage from their arrival
+to the projector window, as rolling histograms.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "LatencyTracer.h"
+#include <algorithm>
+#include <fstream>
+
+LatencyTracer::LatencyTracer()
+:numTraces(0),
+nextTrace(0),
+current(),
+tracing(false)
+{
+	memset(histograms, 0, sizeof(histograms));
+}
+
+void LatencyTracer::beginFrame(uint64_t sequence, uint64_t arrival, uint64_t filtered)
+{
+	if (tracing)
+		finishFrame();
+	current = FrameLatencyTrace();
+	current.sequence = sequence;
+	current.arrival = arrival;
+	current.stages[LATENCY_STAGE_FILTERED] = filtered;
+	current.stages[LATENCY_STAGE_HANDOFF] = ofGetElapsedTimeMicros();
+	tracing = true;
+}
+
+void LatencyTracer::stamp(LatencyStage stage)
+{
+	if (tracing && current.stages[stage] == 0)
+		current.stages[stage] = ofGetElapsedTimeMicros();
+}
+
+void LatencyTracer::finishFrame()
+{
+	if (numTraces == windowSize)
+		countTrace(window[nextTrace], -1);
+	else
+		numTraces++;
+	window[nextTrace] = current;
+	countTrace(current, 1);
+	nextTrace = (nextTrace + 1) % windowSize;
+}
+
+void LatencyTracer::countTrace(const FrameLatencyTrace& trace, int weight)
+{
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+		if (trace.stages[stage] != 0)
+			histograms[stage][getBin(getLatency(trace, stage))] += weight;
+}
+
+uint64_t LatencyTracer::getLatency(const FrameLatencyTrace& trace, int stage)
+{
+	return trace.stages[stage] > trace.arrival ? trace.stages[stage] - trace.arrival : 0;
+}
+
+int LatencyTracer::getBin(uint64_t latency)
+{
+	return static_cast<int>(std::min<uint64_t>(latency / binWidth, numBins - 1));
+}
+
+LatencyStatistics LatencyTracer::getStatistics(LatencyStage stage) const
+{
+	std::vector<uint64_t> latencies;
+	latencies.reserve(numTraces);
+	for (int i = 0; i < numTraces; i++)
+		if (window[i].stages[stage] != 0)
+			latencies.push_back(getLatency(window[i], stage));
+
+	LatencyStatistics stats = LatencyStatistics();
+	stats.numFrames = static_cast<int>(latencies.size());
+	if (latencies.empty())
+		return stats;
+	std::sort(latencies.begin(), latencies.end());
+	size_t n = latencies.size();
+	stats.p50 = latencies[(n - 1) / 2] / 1000.0;
+	stats.p90 = latencies[(n - 1) * 90 / 100] / 1000.0;
+	stats.p99 = latencies[(n - 1) * 99 / 100] / 1000.0;
+	stats.max = latencies[n - 1] / 1000.0;
+	return stats;
+}
+
+void LatencyTracer::drawHistograms(float x, float y, float width, float rowHeight) const
+{
+	ofPushStyle();
+	ofFill();
+	float barWidth = width / numBins;
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+	{
+		float rowY = y + stage * rowHeight;
+		ofSetColor(0, 0, 0, 160);
+		ofDrawRectangle(x, rowY, width, rowHeight);
+
+		const int* bins = histograms[stage];
+		int fullest = *std::max_element(bins, bins + numBins);
+		if (fullest > 0)
+		{
+			ofSetColor(0, 200, 255);
+			for (int bin = 0; bin < numBins; bin++)
+			{
+				float h = (rowHeight - 2) * bins[bin] / fullest;
+				ofDrawRectangle(x + bin * barWidth, rowY + rowHeight - 1 - h, std::max(barWidth - 1, 1.0f), h);
+			}
+		}
+		ofSetColor(255);
+		ofDrawBitmapString(getStageName(static_cast<LatencyStage>(stage)), x + 2, rowY + 12);
+	}
+	ofPopStyle();
+}
+
+bool LatencyTracer::dump(std::string path) const
+{
+	std::ofstream out(path.c_str());
+	if (!out)
+		return false;
+	out << "{\n";
+	out << "  \"bin_width_us\": " << binWidth << ",\n";
+	out << "  \"stages\": [\n";
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+	{
+		LatencyStatistics stats = getStatistics(static_cast<LatencyStage>(stage));
+		out << "    {\"name\": \"" << getStageName(static_cast<LatencyStage>(stage)) << "\", \"frames\": " << stats.numFrames
+			<< ", \"p50_ms\": " << stats.p50 << ", \"p90_ms\": " << stats.p90 << ", \"p99_ms\": " << stats.p99 << ", \"max_ms\": " << stats.max
+			<< ", \"histogram\": [";
+		for (int bin = 0; bin < numBins; bin++)
+			out << (bin ? ", " : "") << histograms[stage][bin];
+		out << "]}" << (stage + 1 < LATENCY_STAGE_COUNT ? "," : "") << "\n";
+	}
+	out << "  ],\n";
+
+	// Oldest first, arrival and then the time of each stage in microseconds
+	out << "  \"frames\": [\n";
+	int first = numTraces == windowSize ? nextTrace : 0;
+	for (int i = 0; i < numTraces; i++)
+	{
+		const FrameLatencyTrace& trace = window[(first + i) % windowSize];
+		out << "    [" << trace.sequence << ", " << trace.arrival;
+		for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+			out << ", " << trace.stages[stage];
+		out << "]" << (i + 1 < numTraces ? "," : "") << "\n";
+	}
+	out << "  ]\n";
+	out << "}\n";
+	return out.good();
+}
+
+const char* LatencyTracer::getStageName(LatencyStage stage)
+{
+	switch (stage)
+	{
+	case LATENCY_STAGE_FILTERED:
+		return "filtered";
+	case LATENCY_STAGE_HANDOFF:
+		return "handoff";
+	case LATENCY_STAGE_TEXTURE:
+		return "texture";
+	case LATENCY_STAGE_CONTOURS:
+		return "contours";
+	case LATENCY_STAGE_PROJECTED:
+		return "projected";
+	default:
+		return "unknown";
+	}
+}
@@ -0,0 +1,91 @@
+/***********************************************************************
+LatencyTracer - Age of the depth frames at each stage from their arrival
+to the projector window, as rolling histograms.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+// Stages a depth frame goes through after the grabber thread got it from
+// the Kinect, in order
+enum LatencyStage {
+	LATENCY_STAGE_FILTERED, // Filtered by the grabber thread
+	LATENCY_STAGE_HANDOFF, // Fetched by the main loop
+	LATENCY_STAGE_TEXTURE, // Uploaded to the depth texture
+	LATENCY_STAGE_CONTOURS, // Sand surface and contour lines rendered
+	LATENCY_STAGE_PROJECTED, // Projector window drawn, before its buffer swap
+	LATENCY_STAGE_COUNT
+};
+
+// Times of one frame in microseconds, on the ofGetElapsedTimeMicros() clock
+struct FrameLatencyTrace
+{
+	uint64_t sequence;
+	uint64_t arrival;
+	uint64_t stages[LATENCY_STAGE_COUNT]; // 0 if the frame never got there
+};
+
+// Of the frames in the window that reached a stage, in milliseconds since their arrival
+struct LatencyStatistics
+{
+	int numFrames;
+	double p50, p90, p99, max;
+};
+
+// Called from the main loop only. A frame is traced from the time it is
+// fetched until the next one is, so a stage it never reached (a frame
+// replaced before it was projected) is left out of the statistics
+class LatencyTracer {
+public:
+	static const int windowSize = 300; // Frames, 10 s of the Kinect stream
+	static const int numBins = 40;
+	static const uint64_t binWidth = 4000; // Microseconds, the last bin also takes everything slower
+
+	LatencyTracer();
+
+	// Start tracing a frame just fetched from the grabber
+	void beginFrame(uint64_t sequence, uint64_t arrival, uint64_t filtered);
+	// The current frame reached stage now. Only the first time counts
+	void stamp(LatencyStage stage);
+
+	LatencyStatistics getStatistics(LatencyStage stage) const;
+	const int* getHistogram(LatencyStage stage) const { // numBins frame counts
+		return histograms[stage];
+	}
+	// One row of bars per stage, each scaled to its fullest bin
+	void drawHistograms(float x, float y, float width, float rowHeight) const;
+	// Statistics, histograms and the traces of the window as JSON
+	bool dump(std::string path) const;
+
+	static const char* getStageName(LatencyStage stage);
+
+private:
+	void finishFrame(); // Move the current frame into the window
+	void countTrace(const FrameLatencyTrace& trace, int weight);
+	static uint64_t getLatency(const FrameLatencyTrace& trace, int stage);
+	static int getBin(uint64_t latency);
+
+	FrameLatencyTrace window[windowSize]; // Ring of the latest frames
+	int numTraces;
+	int nextTrace;
+	FrameLatencyTrace current;
+	bool tracing;
+	int histograms[LATENCY_STAGE_COUNT][numBins]; // Of the frames in the window
+};
@@ -0,0 +1,344 @@
+/***********************************************************************
+PlaneMoments - Running sums of the world points of a depth frame, fitting
+a plane to them without keeping the points.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "PlaneMoments.h"
+#include "Utils.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef DEPTH_FILTER_X86
+#include <immintrin.h>
+#endif
+
+// The kernels only agree if no multiply and add is fused into an FMA, which
+// -march=native allows the compiler to do in the scalar kernel
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+namespace {
+
+const int numLanes = 8;
+const int numSums = 10; // count, x, y, z, xx, xy, xz, yy, yz, zz
+
+// One row of the rectangle: rays and depth start at its first pixel. Pixel
+// i goes to lane i % numLanes of each sum
+struct MomentRow
+{
+	const float* rayX;
+	const float* rayY;
+	const float* rayZ;
+	const float* depth;
+	int numPixels;
+	float reference[3];
+	// Only points with |normal . (point - reference) + offset| < maxDistance
+	float normal[3];
+	float offset;
+	float maxDistance;
+	float lanes[numSums][numLanes];
+};
+
+void momentRowScalar(MomentRow& row, int i)
+{
+	for (; i < row.numPixels; i++)
+	{
+		int lane = i % numLanes;
+		float d = row.depth[i];
+		float px = row.rayX[i] * d - row.reference[0];
+		float py = row.rayY[i] * d - row.reference[1];
+		float pz = row.rayZ[i] * d - row.reference[2];
+		bool valid = d > 0 && std::fabs(row.normal[0] * px + row.normal[1] * py + row.normal[2] * pz + row.offset) < row.maxDistance;
+		float x = valid ? px : 0;
+		float y = valid ? py : 0;
+		float z = valid ? pz : 0;
+		row.lanes[0][lane] += valid ? 1 : 0;
+		row.lanes[1][lane] += x;
+		row.lanes[2][lane] += y;
+		row.lanes[3][lane] += z;
+		row.lanes[4][lane] += x * x;
+		row.lanes[5][lane] += x * y;
+		row.lanes[6][lane] += x * z;
+		row.lanes[7][lane] += y * y;
+		row.lanes[8][lane] += y * z;
+		row.lanes[9][lane] += z * z;
+	}
+}
+
+#ifdef DEPTH_FILTER_X86
+
+// Lanes [lane, lane + 4) of 4 pixels starting at i
+DEPTH_FILTER_TARGET("sse4.1")
+void momentsSSE41(MomentRow& row, __m128* sums, int i)
+{
+	__m128 d = _mm_loadu_ps(row.depth + i);
+	__m128 px = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(row.rayX + i), d), _mm_set1_ps(row.reference[0]));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(row.rayY + i), d), _mm_set1_ps(row.reference[1]));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(row.rayZ + i), d), _mm_set1_ps(row.reference[2]));
+	__m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(row.normal[0]), px), _mm_mul_ps(_mm_set1_ps(row.normal[1]), py)),
+		_mm_mul_ps(_mm_set1_ps(row.normal[2]), pz)), _mm_set1_ps(row.offset));
+	__m128 valid = _mm_and_ps(_mm_cmpgt_ps(d, _mm_setzero_ps()),
+		_mm_cmplt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), distance), _mm_set1_ps(row.maxDistance)));
+	__m128 x = _mm_and_ps(px, valid);
+	__m128 y = _mm_and_ps(py, valid);
+	__m128 z = _mm_and_ps(pz, valid);
+	sums[0] = _mm_add_ps(sums[0], _mm_and_ps(_mm_set1_ps(1), valid));
+	sums[1] = _mm_add_ps(sums[1], x);
+	sums[2] = _mm_add_ps(sums[2], y);
+	sums[3] = _mm_add_ps(sums[3], z);
+	sums[4] = _mm_add_ps(sums[4], _mm_mul_ps(x, x));
+	sums[5] = _mm_add_ps(sums[5], _mm_mul_ps(x, y));
+	sums[6] = _mm_add_ps(sums[6], _mm_mul_ps(x, z));
+	sums[7] = _mm_add_ps(sums[7], _mm_mul_ps(y, y));
+	sums[8] = _mm_add_ps(sums[8], _mm_mul_ps(y, z));
+	sums[9] = _mm_add_ps(sums[9], _mm_mul_ps(z, z));
+}
+
+DEPTH_FILTER_TARGET("sse4.1")
+void momentRowSSE41(MomentRow& row)
+{
+	__m128 low[numSums], high[numSums];
+	for (int s = 0; s < numSums; s++)
+	{
+		low[s] = _mm_setzero_ps();
+		high[s] = _mm_setzero_ps();
+	}
+	int i = 0;
+	for (; i + numLanes <= row.numPixels; i += numLanes)
+	{
+		momentsSSE41(row, low, i);
+		momentsSSE41(row, high, i + 4);
+	}
+	for (int s = 0; s < numSums; s++)
+	{
+		_mm_storeu_ps(row.lanes[s], low[s]);
+		_mm_storeu_ps(row.lanes[s] + 4, high[s]);
+	}
+	momentRowScalar(row, i);
+}
+
+DEPTH_FILTER_TARGET("avx2")
+void momentRowAVX2(MomentRow& row)
+{
+	__m256 sums[numSums];
+	for (int s = 0; s < numSums; s++)
+		sums[s] = _mm256_setzero_ps();
+	const __m256 refX = _mm256_set1_ps(row.reference[0]);
+	const __m256 refY = _mm256_set1_ps(row.reference[1]);
+	const __m256 refZ = _mm256_set1_ps(row.reference[2]);
+	const __m256 normalX = _mm256_set1_ps(row.normal[0]);
+	const __m256 normalY = _mm256_set1_ps(row.normal[1]);
+	const __m256 normalZ = _mm256_set1_ps(row.normal[2]);
+	const __m256 offset = _mm256_set1_ps(row.offset);
+	const __m256 maxDistance = _mm256_set1_ps(row.maxDistance);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 one = _mm256_set1_ps(1);
+	int i = 0;
+	for (; i + numLanes <= row.numPixels; i += numLanes)
+	{
+		__m256 d = _mm256_loadu_ps(row.depth + i);
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(row.rayX + i), d), refX);
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(row.rayY + i), d), refY);
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(row.rayZ + i), d), refZ);
+		__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(normalX, px), _mm256_mul_ps(normalY, py)),
+			_mm256_mul_ps(normalZ, pz)), offset);
+		__m256 valid = _mm256_and_ps(_mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GT_OQ),
+			_mm256_cmp_ps(_mm256_andnot_ps(sign, distance), maxDistance, _CMP_LT_OQ));
+		__m256 x = _mm256_and_ps(px, valid);
+		__m256 y = _mm256_and_ps(py, valid);
+		__m256 z = _mm256_and_ps(pz, valid);
+		sums[0] = _mm256_add_ps(sums[0], _mm256_and_ps(one, valid));
+		sums[1] = _mm256_add_ps(sums[1], x);
+		sums[2] = _mm256_add_ps(sums[2], y);
+		sums[3] = _mm256_add_ps(sums[3], z);
+		sums[4] = _mm256_add_ps(sums[4], _mm256_mul_ps(x, x));
+		sums[5] = _mm256_add_ps(sums[5], _mm256_mul_ps(x, y));
+		sums[6] = _mm256_add_ps(sums[6], _mm256_mul_ps(x, z));
+		sums[7] = _mm256_add_ps(sums[7], _mm256_mul_ps(y, y));
+		sums[8] = _mm256_add_ps(sums[8], _mm256_mul_ps(y, z));
+		sums[9] = _mm256_add_ps(sums[9], _mm256_mul_ps(z, z));
+	}
+	for (int s = 0; s < numSums; s++)
+		_mm256_storeu_ps(row.lanes[s], sums[s]);
+	momentRowScalar(row, i);
+}
+
+#endif
+
+void momentRow(DepthFilterKernel kernel, MomentRow& row)
+{
+#ifdef DEPTH_FILTER_X86
+	if (kernel == DEPTH_FILTER_KERNEL_AVX2)
+	{
+		momentRowAVX2(row);
+		return;
+	}
+	if (kernel == DEPTH_FILTER_KERNEL_SSE41)
+	{
+		momentRowSSE41(row);
+		return;
+	}
+#endif
+	for (int s = 0; s < numSums; s++)
+		std::fill(row.lanes[s], row.lanes[s] + numLanes, 0.0f);
+	momentRowScalar(row, 0);
+}
+
+}
+
+PlaneMoments::PlaneMoments()
+{
+	clear();
+}
+
+void PlaneMoments::clear()
+{
+	reference = ofVec3f(0, 0, 0);
+	count = 0;
+	std::fill(sum, sum + 3, 0.0);
+	std::fill(sumProducts, sumProducts + 6, 0.0);
+}
+
+void PlaneMoments::add(const float* depth, const KinectRayTable& rays, int minX, int minY, int maxX, int maxY, DepthFilterKernel kernel)
+{
+	// A null normal puts every point at distance 0
+	addNear(depth, rays, minX, minY, maxX, maxY, ofVec4f(0, 0, 0, 0), std::numeric_limits<float>::infinity(), kernel);
+}
+
+void PlaneMoments::addNear(const float* depth, const KinectRayTable& rays, int minX, int minY, int maxX, int maxY,
+	const ofVec4f& plane, float maxDistance, DepthFilterKernel kernel)
+{
+	int width = rays.getWidth();
+	minX = std::max(minX, 0);
+	minY = std::max(minY, 0);
+	maxX = std::min(maxX, width);
+	maxY = std::min(maxY, rays.getHeight());
+	if (maxX <= minX)
+		return;
+
+	MomentRow row;
+	row.numPixels = maxX - minX;
+	row.normal[0] = plane.x;
+	row.normal[1] = plane.y;
+	row.normal[2] = plane.z;
+	row.offset = static_cast<float>(double(plane.x) * reference.x + double(plane.y) * reference.y + double(plane.z) * reference.z + plane.w);
+	row.maxDistance = maxDistance;
+	for (int y = minY; y < maxY; y++)
+	{
+		int idx = y * width + minX;
+		if (count == 0)
+		{
+			// The first point of the frame is the reference
+			int i = 0;
+			while (i < row.numPixels && !(depth[idx + i] > 0))
+				i++;
+			if (i == row.numPixels)
+				continue;
+			reference = rays.toWorld(minX + i, y, depth[idx + i]);
+			row.offset = static_cast<float>(double(plane.x) * reference.x + double(plane.y) * reference.y + double(plane.z) * reference.z + plane.w);
+		}
+		row.rayX = rays.getRays(0) + idx;
+		row.rayY = rays.getRays(1) + idx;
+		row.rayZ = rays.getRays(2) + idx;
+		row.depth = depth + idx;
+		row.reference[0] = reference.x;
+		row.reference[1] = reference.y;
+		row.reference[2] = reference.z;
+		momentRow(kernel, row);
+
+		double rowSums[numSums];
+		for (int s = 0; s < numSums; s++)
+		{
+			rowSums[s] = 0;
+			for (int lane = 0; lane < numLanes; lane++)
+				rowSums[s] += row.lanes[s][lane];
+		}
+		count += rowSums[0];
+		for (int axis = 0; axis < 3; axis++)
+			sum[axis] += rowSums[1 + axis];
+		for (int product = 0; product < 6; product++)
+			sumProducts[product] += rowSums[4 + product];
+	}
+}
+
+void PlaneMoments::setReference(const ofVec3f& newReference)
+{
+	// Each point moves by delta = reference - newReference
+	double delta[3] = { double(reference.x) - newReference.x, double(reference.y) - newReference.y, double(reference.z) - newReference.z };
+	int product = 0;
+	for (int a = 0; a < 3; a++)
+		for (int b = a; b < 3; b++)
+			sumProducts[product++] += delta[a] * sum[b] + delta[b] * sum[a] + count * delta[a] * delta[b];
+	for (int axis = 0; axis < 3; axis++)
+		sum[axis] += count * delta[axis];
+	reference = newReference;
+}
+
+void PlaneMoments::merge(const PlaneMoments& other)
+{
+	if (other.count == 0)
+		return;
+	if (count == 0)
+	{
+		*this = other;
+		return;
+	}
+	PlaneMoments shifted = other;
+	shifted.setReference(reference);
+	count += shifted.count;
+	for (int axis = 0; axis < 3; axis++)
+		sum[axis] += shifted.sum[axis];
+	for (int product = 0; product < 6; product++)
+		sumProducts[product] += shifted.sumProducts[product];
+}
+
+PlaneFit PlaneMoments::fit() const
+{
+	PlaneFit result;
+	result.equation = ofVec4f(0, 0, 0, 0);
+	result.numPoints = getNumPoints();
+	result.rmsResidual = 0;
+	if (count < 3)
+		return result;
+
+	// Covariance about the centroid, xx, xy, xz, yy, yz, zz
+	double covariance[6];
+	int product = 0;
+	for (int a = 0; a < 3; a++)
+		for (int b = a; b < 3; b++, product++)
+			covariance[product] = sumProducts[product] - sum[a] * sum[b] / count;
+	ofVec3f centroid = reference + ofVec3f(sum[0] / count, sum[1] / count, sum[2] / count);
+	result.equation = ofxCSG::plane_from_covariance(centroid, covariance[0], covariance[1], covariance[2],
+		covariance[3], covariance[4], covariance[5]);
+	if (result.equation.x == 0 && result.equation.y == 0 && result.equation.z == 0)
+		return result;
+
+	double n[3] = { result.equation.x, result.equation.y, result.equation.z };
+	double squares = n[0] * n[0] * covariance[0] + n[1] * n[1] * covariance[3] + n[2] * n[2] * covariance[5]
+		+ 2 * (n[0] * n[1] * covariance[1] + n[0] * n[2] * covariance[2] + n[1] * n[2] * covariance[4]);
+	result.rmsResidual = static_cast<float>(std::sqrt(std::max(squares, 0.0) / count));
+	return result;
+}
@@ -0,0 +1,72 @@
+/***********************************************************************
+PlaneMoments - Running sums of the world points of a depth frame, fitting
+a plane to them without keeping the points.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "KinectRayTable.h"
+
+// Plane fitted by least squares, as plane_from_points() would to the same points
+struct PlaneFit
+{
+	ofVec4f equation; // Unit normal and offset, all 0 if the points span no plane
+	int numPoints;
+	float rmsResidual; // Root mean square distance of the points to the plane
+};
+
+// The count, sums and sums of products of the coordinates of the points are
+// all a least squares plane needs: the centroid is the mean, the normal the
+// direction of least variance of the covariance, and the mean square
+// distance to the plane is normal' * covariance * normal. They are taken
+// relative to the first point so the float sums of a row stay precise, rows
+// are summed in double. Pixels at depth 0 or NaN are left out. The SIMD
+// kernels do the same float operations as the scalar one in 8 lanes, and
+// PlaneMoments.cpp is compiled without fused multiply adds, so all give the
+// same fit. Moments of disjoint parts of the frame (bands on different
+// threads) can be merged.
+class PlaneMoments {
+public:
+	PlaneMoments();
+
+	void clear();
+	// Add the pixels [minX, maxX) x [minY, maxY) of a depth frame of the
+	// size of the ray table. The rectangle is clipped to the frame
+	void add(const float* depth, const KinectRayTable& rays, int minX, int minY, int maxX, int maxY,
+		DepthFilterKernel kernel = getBestDepthFilterKernel());
+	// Same, only the points closer than maxDistance to plane (unit normal)
+	void addNear(const float* depth, const KinectRayTable& rays, int minX, int minY, int maxX, int maxY,
+		const ofVec4f& plane, float maxDistance, DepthFilterKernel kernel = getBestDepthFilterKernel());
+	void merge(const PlaneMoments& other);
+
+	int getNumPoints() const {
+		return static_cast<int>(count);
+	}
+	PlaneFit fit() const;
+
+private:
+	// Move the reference point the sums are taken relative to
+	void setReference(const ofVec3f& newReference);
+
+	ofVec3f reference;
+	double count;
+	double sum[3]; // x, y, z
+	double sumProducts[6]; // xx, xy, xz, yy, yz, zz
+};
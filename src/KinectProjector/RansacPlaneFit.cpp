@@ -0,0 +1,145 @@
+/***********************************************************************
+RansacPlaneFit - Plane of the sand bed robust to hands, toys and piles,
+from a subsample of the depth frame.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+#include "RansacPlaneFit.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+const int numRefinements = 2;
+
+// Sum of min(distance^2, inlierDistance^2) of the samples, and the inliers
+double scorePlane(const std::vector<ofVec3f>& samples, const ofVec4f& plane, float inlierDistance, int& numInliers)
+{
+	float maxSquare = inlierDistance * inlierDistance;
+	double score = 0;
+	numInliers = 0;
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		float distance = plane.x * samples[i].x + plane.y * samples[i].y + plane.z * samples[i].z + plane.w;
+		float square = distance * distance;
+		if (square < maxSquare)
+		{
+			score += square;
+			numInliers++;
+		}
+		else
+			score += maxSquare;
+	}
+	return score;
+}
+
+}
+
+RansacPlaneFit::RansacPlaneFit()
+:random(5489u),
+numIterations(0),
+inlierFraction(0)
+{
+}
+
+PlaneFit RansacPlaneFit::fit(const float* depth, const KinectRayTable& rays, int minX, int minY, int maxX, int maxY,
+	const RansacParameters& parameters, DepthFilterKernel kernel)
+{
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	numIterations = 0;
+	inlierFraction = 0;
+	PlaneFit result;
+	result.equation = ofVec4f(0, 0, 0, 0);
+	result.numPoints = 0;
+	result.rmsResidual = 0;
+
+	minX = std::max(minX, 0);
+	minY = std::max(minY, 0);
+	maxX = std::min(maxX, rays.getWidth());
+	maxY = std::min(maxY, rays.getHeight());
+	int spacing = std::max(parameters.sampleSpacing, 1);
+	samples.clear();
+	for (int cellY = minY; cellY < maxY; cellY += spacing)
+	{
+		for (int cellX = minX; cellX < maxX; cellX += spacing)
+		{
+			int x = cellX + random() % (std::min(cellX + spacing, maxX) - cellX);
+			int y = cellY + random() % (std::min(cellY + spacing, maxY) - cellY);
+			float d = depth[y * rays.getWidth() + x];
+			if (d > 0)
+				samples.push_back(rays.toWorld(x, y, d));
+		}
+	}
+	int numSamples = static_cast<int>(samples.size());
+	if (numSamples < 3)
+		return result;
+
+	ofVec4f best(0, 0, 0, 0);
+	double bestScore = std::numeric_limits<double>::max();
+	int neededIterations = parameters.maxIterations;
+	std::uniform_int_distribution<int> pick(0, numSamples - 1);
+	while (numIterations < neededIterations
+		&& std::chrono::duration<float, std::milli>(Clock::now() - start).count() < parameters.timeBudget)
+	{
+		numIterations++;
+		const ofVec3f& p0 = samples[pick(random)];
+		const ofVec3f& p1 = samples[pick(random)];
+		const ofVec3f& p2 = samples[pick(random)];
+		ofVec3f normal = (p1 - p0).getCrossed(p2 - p0);
+		float length = normal.length();
+		if (length < 1e-6f) // The same or aligned samples
+			continue;
+		normal /= length;
+		ofVec4f plane(normal.x, normal.y, normal.z, -normal.dot(p0));
+		int numInliers;
+		double score = scorePlane(samples, plane, parameters.inlierDistance, numInliers);
+		if (score >= bestScore)
+			continue;
+		best = plane;
+		bestScore = score;
+		// Draws needed to get three inliers of the best plane at least once
+		double ratio = double(numInliers) / numSamples;
+		double missed = 1 - ratio * ratio * ratio;
+		if (missed <= 0)
+			neededIterations = std::min(neededIterations, numIterations);
+		else if (missed < 1)
+			neededIterations = static_cast<int>(std::min<double>(neededIterations,
+				std::ceil(std::log(1.0 - parameters.confidence) / std::log(missed))));
+	}
+	if (best.x == 0 && best.y == 0 && best.z == 0)
+		return result;
+
+	// Least squares on the pixels near the plane, then near the refined plane
+	for (int refinement = 0; refinement < numRefinements; refinement++)
+	{
+		PlaneMoments inliers;
+		inliers.addNear(depth, rays, minX, minY, maxX, maxY, best, parameters.inlierDistance, kernel);
+		PlaneFit refined = inliers.fit();
+		if (refined.equation.x == 0 && refined.equation.y == 0 && refined.equation.z == 0)
+			break;
+		result = refined;
+		best = refined.equation;
+	}
+	int numInliers;
+	scorePlane(samples, best, parameters.inlierDistance, numInliers);
+	inlierFraction = float(numInliers) / numSamples;
+	return result;
+}
@@ -0,0 +1,73 @@
+/***********************************************************************
+RansacPlaneFit - Plane of the sand bed robust to hands, toys and piles,
+from a subsample of the depth frame.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "PlaneMoments.h"
+#include <random>
+
+struct RansacParameters
+{
+	int sampleSpacing; // Pixels between samples along x and y, one random pixel per cell
+	float inlierDistance; // Maximum distance of a point of the plane to it, in mm
+	float timeBudget; // Maximum time spent trying planes, in ms
+	int maxIterations;
+	float confidence; // Stop once the best plane has been drawn with this probability
+};
+
+// Planes through three random samples are scored by the truncated squared
+// distance of all samples to them (MSAC), for at most the time budget or
+// until enough planes were tried for the inlier ratio of the best one. The
+// best plane is then refined twice by least squares on all the pixels
+// closer to it than inlierDistance, streamed through PlaneMoments. The
+// samples are one random pixel per cell of a sampleSpacing grid, so they
+// cover the whole rectangle. The random sequence is the same for every
+// instance, a fit of the same frame gives the same plane. The kernel only
+// picks the PlaneMoments kernel of the refinements, so it gives the same
+// plane too, with or without -march=native.
+class RansacPlaneFit {
+public:
+	RansacPlaneFit();
+
+	// Fit the pixels [minX, maxX) x [minY, maxY) of a depth frame of the size
+	// of the ray table. The equation is all 0 if no plane was found
+	PlaneFit fit(const float* depth, const KinectRayTable& rays, int minX, int minY, int maxX, int maxY,
+		const RansacParameters& parameters, DepthFilterKernel kernel = getBestDepthFilterKernel());
+
+	// Of the last fit
+	int getNumSamples() const {
+		return static_cast<int>(samples.size());
+	}
+	int getNumIterations() const {
+		return numIterations;
+	}
+	// Share of the samples closer than inlierDistance to the refined plane
+	float getInlierFraction() const {
+		return inlierFraction;
+	}
+
+private:
+	std::vector<ofVec3f> samples; // Kept between fits
+	std::mt19937 random;
+	int numIterations;
+	float inlierFraction;
+};
@@ -0,0 +1,286 @@
+/***********************************************************************
+SeaLevelTracker - Follows the drift of the kinect depth on a background
+thread and corrects the sea level and the ceiling for it.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+#include "SeaLevelTracker.h"
+#include <algorithm>
+#include <cmath>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace {
+
+const float interval = 10; // Seconds between two measures
+const int stableFrames = 15; // Tiles changed more recently (a hand moving) are left out
+const float maxDrift = 3; // Larger depth changes are moved sand, mm
+const float minCoverage = 0.1f; // Share of the ROI needed for a fit
+const float smoothing = 0.3f; // Weight of a new fit
+const float threshold = 1; // Change of the sea level published, mm
+
+// Depth at which the ray of a pixel meets a plane, 0 if it does not
+float planeDepth(const ofVec3f& ray, const ofVec4f& plane)
+{
+	float slope = plane.x * ray.x + plane.y * ray.y + plane.z * ray.z;
+	return slope != 0 ? std::max(-plane.w / slope, 0.0f) : 0;
+}
+
+// The fits run on the cores of the grabber and the worker pool, which must
+// not wait for them. Returns false if the priority was left as it is
+bool lowerThreadPriority()
+{
+#if defined(_WIN32)
+	return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL) != 0;
+#elif defined(__APPLE__)
+	return pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0) == 0;
+#elif defined(__linux__)
+	// Only runs when a core is idle
+	sched_param parameters;
+	parameters.sched_priority = 0;
+	return pthread_setschedparam(pthread_self(), SCHED_IDLE, &parameters) == 0;
+#else
+	return false;
+#endif
+}
+
+}
+
+SeaLevelTracker::SeaLevelTracker()
+:tracking(false),
+lastSubmission(0),
+frameWidth(0),
+frameHeight(0),
+busy(false),
+minX(0),
+minY(0),
+maxX(0),
+maxY(0),
+resetPending(false),
+hasReference(false),
+hasCorrection(false),
+correctionCeilingShift(0)
+{
+	fitParameters.sampleSpacing = 4;
+	fitParameters.inlierDistance = 1;
+	fitParameters.timeBudget = 20;
+	fitParameters.maxIterations = 200;
+	fitParameters.confidence = 0.999f;
+}
+
+SeaLevelTracker::~SeaLevelTracker()
+{
+	stop();
+}
+
+void SeaLevelTracker::start()
+{
+	if (tracking)
+		return;
+	tracking = true;
+	lastSubmission = ofGetElapsedTimef();
+	startThread(true);
+}
+
+void SeaLevelTracker::stop()
+{
+	if (!tracking)
+		return;
+	// Under the mutex so the tracker cannot miss the notification
+	lock();
+	tracking = false;
+	jobQueued.notify_all();
+	unlock();
+	waitForThread(false);
+	busy = false;
+}
+
+void SeaLevelTracker::reset(const KinectRayTable& srays, const ofVec4f& seaLevel)
+{
+	frameWidth = srays.getWidth();
+	frameHeight = srays.getHeight();
+	KinectRayTable newRays = srays; // Copied before taking the lock
+	std::lock_guard<std::mutex> guard(resetMutex);
+	std::swap(pendingRays, newRays);
+	pendingSeaLevel = seaLevel;
+	resetPending.store(true, std::memory_order_release);
+}
+
+void SeaLevelTracker::applyReset()
+{
+	{
+		std::lock_guard<std::mutex> guard(resetMutex);
+		std::swap(rays, pendingRays);
+		tracked = pendingSeaLevel;
+	}
+	smoothed = tracked;
+	published = tracked;
+	hasReference = false;
+	std::lock_guard<std::mutex> guard(correctionMutex);
+	hasCorrection = false;
+	correctionCeilingShift = 0;
+	resetPending.store(false, std::memory_order_release);
+}
+
+void SeaLevelTracker::addFrame(const float* sdepth, const DirtyTiles& changed, const ofRectangle& ROI)
+{
+	if (!tracking)
+		return;
+	int width = changed.getNumTilesX() * DirtyTiles::tileSize;
+	if (tileAges.size() != static_cast<size_t>(changed.getNumTilesX() * changed.getNumTilesY()))
+		tileAges.assign(changed.getNumTilesX() * changed.getNumTilesY(), 0);
+	for (int tileY = 0; tileY < changed.getNumTilesY(); tileY++)
+		for (int tileX = 0; tileX < changed.getNumTilesX(); tileX++)
+		{
+			uint16_t& age = tileAges[tileY * changed.getNumTilesX() + tileX];
+			age = changed.isDirty(tileX, tileY) ? 0 : std::min(age + 1, 0xffff);
+		}
+
+	float now = ofGetElapsedTimef();
+	if (now - lastSubmission < interval || busy.load(std::memory_order_acquire))
+		return;
+	lastSubmission = now;
+
+	// The tracker is idle and does not touch the job until busy is set
+	if (frameWidth == 0 || (frameWidth + DirtyTiles::tileSize - 1) / DirtyTiles::tileSize * DirtyTiles::tileSize != width)
+		return;
+	depth.resize(frameWidth * frameHeight);
+	for (int y = 0; y < frameHeight; y++)
+	{
+		for (int tileX = 0; tileX < changed.getNumTilesX(); tileX++)
+		{
+			int x0 = tileX * DirtyTiles::tileSize;
+			int x1 = std::min(x0 + DirtyTiles::tileSize, frameWidth);
+			bool stable = tileAges[y / DirtyTiles::tileSize * changed.getNumTilesX() + tileX] >= stableFrames;
+			if (stable)
+				std::copy(sdepth + y * frameWidth + x0, sdepth + y * frameWidth + x1, depth.begin() + y * frameWidth + x0);
+			else
+				std::fill(depth.begin() + y * frameWidth + x0, depth.begin() + y * frameWidth + x1, 0.0f);
+		}
+	}
+	minX = static_cast<int>(ROI.getLeft());
+	minY = static_cast<int>(ROI.getTop());
+	maxX = static_cast<int>(ROI.getRight());
+	maxY = static_cast<int>(ROI.getBottom());
+	busy.store(true, std::memory_order_release);
+	jobQueued.notify_one();
+}
+
+bool SeaLevelTracker::fetchCorrection(ofVec4f& seaLevel, float& ceilingShift)
+{
+	// A correction of the sea level before the reset is stale
+	if (resetPending.load(std::memory_order_acquire))
+		return false;
+	std::unique_lock<std::mutex> guard(correctionMutex, std::try_to_lock);
+	if (!guard.owns_lock() || !hasCorrection)
+		return false;
+	seaLevel = correction;
+	ceilingShift = correctionCeilingShift;
+	hasCorrection = false;
+	correctionCeilingShift = 0;
+	return true;
+}
+
+void SeaLevelTracker::threadedFunction()
+{
+	if (!lowerThreadPriority())
+		ofLogVerbose("SeaLevelTracker") << "threadedFunction(): could not lower the thread priority";
+	while (tracking)
+	{
+		lock();
+		if (resetPending.load(std::memory_order_acquire))
+			applyReset();
+		if (!busy.load(std::memory_order_acquire))
+		{
+			if (tracking)
+				jobQueued.wait_for(mutex, std::chrono::milliseconds(100));
+			unlock();
+			continue;
+		}
+		track();
+		busy.store(false, std::memory_order_release);
+		unlock();
+	}
+}
+
+void SeaLevelTracker::track()
+{
+	int width = rays.getWidth();
+	int numPixels = width * rays.getHeight();
+	if (static_cast<int>(depth.size()) != numPixels)
+		return;
+	if (!hasReference)
+	{
+		reference = depth;
+		drifted.resize(numPixels);
+		hasReference = true;
+		return;
+	}
+
+	// Unmoved sand drifted with the sea level
+	int x0 = std::max(minX, 0), x1 = std::min(maxX, width);
+	int y0 = std::max(minY, 0), y1 = std::min(maxY, rays.getHeight());
+	int numUnmoved = 0;
+	std::fill(drifted.begin(), drifted.end(), 0.0f);
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			int idx = y * width + x;
+			float drift = depth[idx] - reference[idx];
+			if (depth[idx] > 0 && reference[idx] > 0 && std::fabs(drift) < maxDrift)
+			{
+				drifted[idx] = planeDepth(rays.getRay(x, y), tracked) + drift;
+				numUnmoved++;
+			}
+		}
+	}
+	reference.swap(depth);
+	if (numUnmoved < minCoverage * (x1 - x0) * (y1 - y0))
+		return;
+	PlaneFit result = fit.fit(drifted.data(), rays, x0, y0, x1, y1, fitParameters);
+	if (result.equation.x == 0 && result.equation.y == 0 && result.equation.z == 0)
+		return;
+	if (ofVec3f(result.equation).dot(ofVec3f(tracked)) < 0)
+		result.equation = -result.equation;
+	tracked = result.equation;
+
+	smoothed = smoothed * (1 - smoothing) + tracked * smoothing;
+	smoothed /= ofVec3f(smoothed).length();
+
+	// Publish when the sea level moved by threshold somewhere in the ROI
+	ofVec3f corners[4] = { rays.getRay(x0, y0), rays.getRay(x1 - 1, y0), rays.getRay(x0, y1 - 1), rays.getRay(x1 - 1, y1 - 1) };
+	float change = 0;
+	for (int i = 0; i < 4; i++)
+		change = std::max(change, std::fabs(planeDepth(corners[i], smoothed) - planeDepth(corners[i], published)));
+	if (change < threshold)
+		return;
+	ofVec3f center = rays.getRay((x0 + x1) / 2, (y0 + y1) / 2);
+	float shift = planeDepth(center, smoothed) - planeDepth(center, published);
+	published = smoothed;
+	ofLogVerbose("SeaLevelTracker") << "track(): sea level moved by up to " << change << " mm";
+
+	std::lock_guard<std::mutex> guard(correctionMutex);
+	hasCorrection = true;
+	correction = published;
+	correctionCeilingShift += shift;
+}
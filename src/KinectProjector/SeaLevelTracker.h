@@ -0,0 +1,102 @@
+/***********************************************************************
+SeaLevelTracker - Follows the drift of the kinect depth on a background
+thread and corrects the sea level and the ceiling for it.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "DirtyTiles.h"
+#include "RansacPlaneFit.h"
+
+// The depth the kinect reports drifts by a few mm as it warms up. Every
+// interval seconds the main loop hands the tracker the depth of the tiles
+// that have not changed for a while. The tracker compares it with the depth
+// it got the time before: where the sand did not move the difference is the
+// drift, which is added to the depth of the sea level at these pixels, and
+// the sea level is fitted again to the result with RansacPlaneFit. The sand
+// may have any shape, only the difference matters. The fitted planes are
+// smoothed and published once they are more than threshold mm away from
+// the sea level in use, anywhere in the ROI.
+class SeaLevelTracker: public ofThread {
+public:
+	SeaLevelTracker();
+	~SeaLevelTracker();
+
+	void start();
+	void stop();
+	bool isTracking() {
+		return tracking;
+	}
+
+	// Forget the drift: the rays or the sea level changed. Never waits for
+	// the tracker, which applies the reset before its next measure
+	void reset(const KinectRayTable& rays, const ofVec4f& seaLevel);
+	// Main loop, with every new depth frame and the tiles that changed. Never
+	// waits: the frame is skipped if the tracker is busy
+	void addFrame(const float* depth, const DirtyTiles& changed, const ofRectangle& ROI);
+	// Main loop. Whether a new sea level was published since the last call,
+	// and how much the ceiling depth moved with it. Never waits
+	bool fetchCorrection(ofVec4f& seaLevel, float& ceilingShift);
+
+private:
+	void threadedFunction() override;
+	void applyReset();
+	void track();
+
+	std::atomic<bool> tracking;
+
+	// Main loop side
+	std::vector<uint16_t> tileAges; // Frames since each tile last changed
+	float lastSubmission; // Seconds
+	int frameWidth, frameHeight; // Of the rays last given to reset()
+	std::condition_variable_any jobQueued;
+
+	// Handed over while idle, set by addFrame() and cleared by the tracker
+	std::atomic<bool> busy;
+	std::vector<float> depth; // Of the stable tiles, 0 elsewhere
+	int minX, minY, maxX, maxY;
+
+	// Reset waiting for the tracker, resetMutex is only held to swap it in
+	std::mutex resetMutex;
+	std::atomic<bool> resetPending;
+	KinectRayTable pendingRays;
+	ofVec4f pendingSeaLevel;
+
+	// Tracker side, under the thread mutex
+	KinectRayTable rays;
+	RansacPlaneFit fit;
+	RansacParameters fitParameters;
+	std::vector<float> reference; // Depth of the previous submission
+	std::vector<float> drifted; // Sea level depth plus drift
+	bool hasReference;
+	ofVec4f tracked; // Latest fit
+	ofVec4f smoothed;
+	ofVec4f published; // Sea level in use in the main loop
+
+	// Correction waiting to be fetched
+	std::mutex correctionMutex;
+	bool hasCorrection;
+	ofVec4f correction;
+	float correctionCeilingShift;
+};
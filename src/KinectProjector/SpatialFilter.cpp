@@ -0,0 +1,181 @@
+/***********************************************************************
+SpatialFilter - Gaussian smoothing of the filtered depth inside the
+kinect ROI, with a cost per pixel that does not depend on the radius.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "SpatialFilter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+const int SpatialFilter::tileWidth; // Bound to references by std::min
+
+SpatialFilter::SpatialFilter()
+{
+	setRadius(1.0f);
+}
+
+void SpatialFilter::setRadius(float sradius)
+{
+	radius = std::max(sradius, 0.0f);
+
+	// Each pass contributes a third of the variance. A box of radius r has
+	// variance r(r+1)/3, the end weight makes up for the rest
+	double variance = radius * radius / numPasses;
+	boxRadius = static_cast<int>(std::floor((std::sqrt(1.0 + 12.0 * variance) - 1.0) / 2.0));
+	double r = boxRadius;
+	endWeight = static_cast<float>((2.0 * r + 1.0) * (variance - r * (r + 1.0) / 3.0) / (2.0 * ((r + 1.0) * (r + 1.0) - variance)));
+}
+
+float SpatialFilter::getWeight(int i, int n)
+{
+	int inside = std::min(i + boxRadius, n - 1) - std::max(i - boxRadius, 0) + 1;
+	int ends = (i - boxRadius - 1 >= 0 ? 1 : 0) + (i + boxRadius + 1 < n ? 1 : 0);
+	return inside + endWeight * ends;
+}
+
+void SpatialFilter::apply(float* image, int stride, int x0, int y0, int x1, int y1, WorkerPool& pool)
+{
+	int width = x1 - x0;
+	int height = y1 - y0;
+	if (width < 2 || height < 2 || (boxRadius == 0 && endWeight == 0))
+		return;
+
+	// Along the rows, in bands of at least 16 rows
+	int numBands = std::max(1, std::min(pool.getNumThreads(), height / 16));
+	rowScratch.resize(numBands * (width + 1));
+	pool.run(numBands, [&](int band) {
+		double* prefix = rowScratch.data() + band * (width + 1);
+		for (int y = y0 + height * band / numBands; y < y0 + height * (band + 1) / numBands; y++)
+			for (int pass = 0; pass < numPasses; pass++)
+				filterRow(image + y * stride + x0, width, prefix);
+	});
+
+	// Along the columns, one tile of columns at a time
+	int numTiles = (width + tileWidth - 1) / tileWidth;
+	int numTasks = std::min(numTiles, pool.getNumThreads());
+	size_t scratchSize = tileWidth * (boxRadius + 3); // Running sums and the last boxRadius+2 rows
+	tileScratch.resize(numTasks * scratchSize);
+	pool.run(numTasks, [&](int task) {
+		float* scratch = tileScratch.data() + task * scratchSize;
+		for (int tile = task; tile < numTiles; tile += numTasks)
+		{
+			int tx0 = x0 + tile * tileWidth;
+			filterTile(image + y0 * stride + tx0, stride, height, std::min(tileWidth, x1 - tx0), scratch);
+		}
+	});
+}
+
+void SpatialFilter::filterRow(float* row, int n, double* prefix)
+{
+	const int r = boxRadius;
+	const double a = endWeight;
+
+	prefix[0] = 0;
+	for (int i = 0; i < n; i++)
+		prefix[i + 1] = prefix[i] + row[i];
+
+	// The values are recovered from the prefix sums, so the row can be overwritten as we go
+	int interiorStart = std::min(r + 1, n);
+	int interiorEnd = std::max(n - r - 1, interiorStart);
+	for (int i = 0; i < interiorStart; i++)
+	{
+		double sum = prefix[std::min(i + r, n - 1) + 1] - prefix[std::max(i - r, 0)];
+		if (i + r + 1 < n)
+			sum += a * (prefix[i + r + 2] - prefix[i + r + 1]);
+		row[i] = static_cast<float>(sum / getWeight(i, n));
+	}
+	const double invWeight = 1.0 / (2 * r + 1 + 2 * a);
+	for (int i = interiorStart; i < interiorEnd; i++)
+		row[i] = static_cast<float>((prefix[i + r + 1] - prefix[i - r] + a * (prefix[i - r] - prefix[i - r - 1] + prefix[i + r + 2] - prefix[i + r + 1])) * invWeight);
+	for (int i = interiorEnd; i < n; i++)
+	{
+		double sum = prefix[n] - prefix[std::max(i - r, 0)];
+		if (i - r - 1 >= 0)
+			sum += a * (prefix[i - r] - prefix[i - r - 1]);
+		row[i] = static_cast<float>(sum / getWeight(i, n));
+	}
+}
+
+// Slide a window of rows down the tile. The rows above the current one are
+// already filtered, so their unfiltered values are kept in a ring of
+// boxRadius+2 rows
+void SpatialFilter::filterTile(float* image, int stride, int numRows, int tileCols, float* scratch)
+{
+	const int r = boxRadius;
+	const float a = endWeight;
+	const int ringRows = r + 2;
+	float* sums = scratch;
+	float* ring = scratch + tileWidth;
+
+	for (int pass = 0; pass < numPasses; pass++)
+	{
+		std::fill(sums, sums + tileCols, 0.0f);
+		for (int y = 0; y <= std::min(r, numRows - 1); y++)
+		{
+			const float* row = image + y * stride;
+			for (int x = 0; x < tileCols; x++)
+				sums[x] += row[x];
+		}
+
+		for (int y = 0; y < numRows; y++)
+		{
+			float* row = image + y * stride;
+			const float* above = y - r - 1 >= 0 ? ring + ((y - r - 1) % ringRows) * tileWidth : nullptr;
+			const float* below = y + r + 1 < numRows ? image + (y + r + 1) * stride : nullptr;
+			memcpy(ring + (y % ringRows) * tileWidth, row, tileCols * sizeof(float));
+
+			const float invWeight = 1.0f / getWeight(y, numRows);
+			if (above && below)
+			{
+				for (int x = 0; x < tileCols; x++)
+					row[x] = (sums[x] + a * (above[x] + below[x])) * invWeight;
+			}
+			else if (above)
+			{
+				for (int x = 0; x < tileCols; x++)
+					row[x] = (sums[x] + a * above[x]) * invWeight;
+			}
+			else if (below)
+			{
+				for (int x = 0; x < tileCols; x++)
+					row[x] = (sums[x] + a * below[x]) * invWeight;
+			}
+			else
+			{
+				for (int x = 0; x < tileCols; x++)
+					row[x] = sums[x] * invWeight;
+			}
+
+			// Move the window one row down
+			if (below)
+			{
+				for (int x = 0; x < tileCols; x++)
+					sums[x] += below[x];
+			}
+			if (y - r >= 0)
+			{
+				const float* leaving = ring + ((y - r) % ringRows) * tileWidth;
+				for (int x = 0; x < tileCols; x++)
+					sums[x] -= leaving[x];
+			}
+		}
+	}
+}
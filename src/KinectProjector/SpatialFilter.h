@@ -0,0 +1,69 @@
+/***********************************************************************
+SpatialFilter - Gaussian smoothing of the filtered depth inside the
+kinect ROI, with a cost per pixel that does not depend on the radius.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <vector>
+
+#include "WorkerPool.h"
+
+// The Gaussian is approximated by three passes of an extended box filter
+// (a box whose two end samples have a fractional weight, Gwosdek et al.
+// 2011) along the rows and then along the columns. Each box is evaluated
+// with running sums, so any radius costs the same. Only the pixels of the
+// rectangle are read and written; near its border the kernel is cut off
+// and renormalised.
+//
+// The row passes use prefix sums per row. The column passes walk down
+// tiles of a few dozen columns, keeping the running column sums and the
+// last unfiltered rows of the tile in cache, with inner loops over
+// consecutive pixels that the compiler vectorizes. Rows and tiles are
+// spread over the worker pool; the result does not depend on the number
+// of threads.
+class SpatialFilter {
+public:
+	SpatialFilter();
+
+	// Standard deviation of the Gaussian in pixels. 1 matches the former
+	// two passes of a [1 2 1] kernel
+	void setRadius(float radius);
+	float getRadius() const {
+		return radius;
+	}
+
+	// Smooth the rectangle [x0, x1) x [y0, y1) of image (stride floats per row) in place
+	void apply(float* image, int stride, int x0, int y0, int x1, int y1, WorkerPool& pool);
+
+private:
+	static const int numPasses = 3;
+	static const int tileWidth = 64; // Columns per tile of the column passes
+
+	void filterRow(float* row, int n, double* prefix);
+	void filterTile(float* image, int stride, int numRows, int tileCols, float* scratch);
+	float getWeight(int i, int n); // Sum of the kernel weights inside [0, n) around i
+
+	float radius;
+	int boxRadius; // Samples on each side with weight 1
+	float endWeight; // Weight of the sample just outside, in [0, 1)
+
+	std::vector<double> rowScratch;
+	std::vector<float> tileScratch;
+};
@@ -0,0 +1,83 @@
+/***********************************************************************
+SummedAreaTable - Counts and sums of the valid depth values of any
+rectangle of the kinect ROI in constant time.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+
+#include "SummedAreaTable.h"
+#include <algorithm>
+
+SummedAreaTable::SummedAreaTable()
+:left(0),
+top(0),
+tableWidth(0)
+{
+}
+
+void SummedAreaTable::build(const float* image, int stride, int x0, int y0, int x1, int y1, float invalidValue, WorkerPool& pool)
+{
+	int width = std::max(x1 - x0, 0);
+	int height = std::max(y1 - y0, 0);
+	left = x0;
+	top = y0;
+	tableWidth = width + 1;
+	counts.resize(tableWidth * (height + 1));
+	sums.resize(tableWidth * (height + 1));
+	std::fill(counts.begin(), counts.begin() + tableWidth, 0);
+	std::fill(sums.begin(), sums.begin() + tableWidth, 0.0);
+	if (width == 0 || height == 0)
+		return;
+
+	// Prefix sums along each row, in bands of rows
+	int numBands = std::max(1, std::min(pool.getNumThreads(), height / 16));
+	pool.run(numBands, [&](int band) {
+		for (int y = height * band / numBands; y < height * (band + 1) / numBands; y++)
+		{
+			const float* row = image + (y0 + y) * stride + x0;
+			int* c = counts.data() + (y + 1) * tableWidth;
+			double* s = sums.data() + (y + 1) * tableWidth;
+			c[0] = 0;
+			s[0] = 0;
+			for (int x = 0; x < width; x++)
+			{
+				bool valid = row[x] != 0 && row[x] != invalidValue;
+				c[x + 1] = c[x] + (valid ? 1 : 0);
+				s[x + 1] = s[x] + (valid ? row[x] : 0.0);
+			}
+		}
+	});
+
+	// Then down each column, in strips of columns
+	int numStrips = std::max(1, std::min(pool.getNumThreads(), tableWidth / 64));
+	pool.run(numStrips, [&](int strip) {
+		int start = tableWidth * strip / numStrips;
+		int end = tableWidth * (strip + 1) / numStrips;
+		for (int y = 1; y <= height; y++)
+		{
+			int* c = counts.data() + y * tableWidth;
+			double* s = sums.data() + y * tableWidth;
+			for (int x = start; x < end; x++)
+			{
+				c[x] += c[x - tableWidth];
+				s[x] += s[x - tableWidth];
+			}
+		}
+	});
+}
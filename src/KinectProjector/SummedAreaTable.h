@@ -0,0 +1,67 @@
+/***********************************************************************
+SummedAreaTable - Counts and sums of the valid depth values of any
+rectangle of the kinect ROI in constant time.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+
+#pragma once
+#include <vector>
+
+#include "WorkerPool.h"
+
+// Tables of the number of valid pixels and of the sum of their depths over
+// every rectangle starting at the top left corner of the built rectangle.
+// A pixel is valid when its depth is neither 0 nor invalidValue.
+// Counts are exact and sums are accumulated in double precision, so the
+// tables do not depend on the number of threads that built them.
+class SummedAreaTable {
+public:
+	SummedAreaTable();
+
+	// Build the tables of [x0, x1) x [y0, y1) of image (stride floats per row)
+	void build(const float* image, int stride, int x0, int y0, int x1, int y1, float invalidValue, WorkerPool& pool);
+
+	// Valid pixels of [x0, x1) x [y0, y1), in image coordinates. The
+	// rectangle has to lie inside the built one
+	int getCount(int x0, int y0, int x1, int y1) const {
+		const int* t = counts.data();
+		return t[index(x1, y1)] - t[index(x0, y1)] - t[index(x1, y0)] + t[index(x0, y0)];
+	}
+	double getSum(int x0, int y0, int x1, int y1) const {
+		const double* t = sums.data();
+		return t[index(x1, y1)] - t[index(x0, y1)] - t[index(x1, y0)] + t[index(x0, y0)];
+	}
+	int getTotalCount() const {
+		return counts.empty() ? 0 : counts.back();
+	}
+	double getTotalSum() const {
+		return sums.empty() ? 0 : sums.back();
+	}
+
+private:
+	int index(int x, int y) const {
+		return (y - top) * tableWidth + x - left;
+	}
+
+	int left, top;
+	int tableWidth; // Built width + 1, the first row and column are 0
+	std::vector<int> counts;
+	std::vector<double> sums;
+};
@@ -0,0 +1,167 @@
+/***********************************************************************
+TemporalFilterWorker - Runs the temporal filter of the colour frames
+used for calibration in its own thread.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+#include "TemporalFilterWorker.h"
+
+namespace {
+
+// Frames in the buffer, as the defaults of CTemporalFrameFilter
+const int medianFrames = 15;
+const int averageFrames = 50;
+
+}
+
+TemporalFilterWorker::TemporalFilterWorker()
+:filtering(false),
+type(1),
+generation(0),
+numFrames(0),
+busy(false),
+width(0),
+height(0),
+filterGeneration(0),
+hasImage(false),
+imageGeneration(0)
+{
+}
+
+TemporalFilterWorker::~TemporalFilterWorker()
+{
+	stop();
+}
+
+void TemporalFilterWorker::start(int stype)
+{
+	if (filtering)
+	{
+		if (stype == type)
+			return;
+		stop();
+	}
+	type = stype;
+	busy = false;
+	restart();
+	filtering = true;
+	startThread(true);
+}
+
+void TemporalFilterWorker::stop()
+{
+	if (!filtering)
+		return;
+	// Under the mutex so the worker cannot miss the notification
+	lock();
+	filtering = false;
+	frameQueued.notify_all();
+	unlock();
+	waitForThread(false);
+	busy = false;
+	std::lock_guard<std::mutex> guard(imageMutex);
+	hasImage = false;
+}
+
+void TemporalFilterWorker::restart()
+{
+	generation++;
+	numFrames = 0;
+}
+
+void TemporalFilterWorker::addFrame(const ofPixels& color)
+{
+	if (!filtering || !color.isAllocated() || color.getNumChannels() != 3 || busy.load(std::memory_order_acquire))
+		return;
+	// The worker is idle and does not touch the frame until busy is set
+	if (frame.getWidth() != color.getWidth() || frame.getHeight() != color.getHeight() || frame.getNumChannels() != color.getNumChannels())
+		frame.allocate(color.getWidth(), color.getHeight(), color.getNumChannels());
+	memcpy(frame.getData(), color.getData(), color.size());
+	busy.store(true, std::memory_order_release);
+	frameQueued.notify_one();
+}
+
+bool TemporalFilterWorker::fetchImage(ofPixels& simage)
+{
+	std::unique_lock<std::mutex> guard(imageMutex, std::try_to_lock);
+	if (!guard.owns_lock() || !hasImage || imageGeneration != generation)
+		return false;
+	simage.swap(image);
+	hasImage = false;
+	return true;
+}
+
+int TemporalFilterWorker::getBufferSize()
+{
+	return type == 0 ? medianFrames : averageFrames;
+}
+
+void TemporalFilterWorker::threadedFunction()
+{
+	while (filtering)
+	{
+		lock();
+		if (!busy.load(std::memory_order_acquire))
+		{
+			if (filtering)
+				frameQueued.wait_for(mutex, std::chrono::milliseconds(100));
+			unlock();
+			continue;
+		}
+		filter();
+		busy.store(false, std::memory_order_release);
+		unlock();
+	}
+}
+
+void TemporalFilterWorker::filter()
+{
+	int filterType = type;
+	int bufferSize = getBufferSize();
+	int frameWidth = frame.getWidth();
+	int frameHeight = frame.getHeight();
+	if (frameWidth != width || frameHeight != height || bufferSize != frameFilter.getBufferSize())
+	{
+		frameFilter.Init(frameWidth, frameHeight, bufferSize);
+		width = frameWidth;
+		height = frameHeight;
+	}
+	unsigned int currentGeneration = generation;
+	if (currentGeneration != filterGeneration)
+	{
+		filterGeneration = currentGeneration;
+		numFrames = 0;
+	}
+
+	if (filterType == 0)
+		frameFilter.NewFrame(frame.getData(), width, height, bufferSize);
+	else
+		frameFilter.NewColFrame(frame.getData(), width, height, bufferSize);
+	if (++numFrames < settleFrames + bufferSize)
+		return;
+
+	// The whole buffer was refilled since the last restart
+	unsigned char* filtered = filterType == 0 ? frameFilter.getMedianFilteredImage() : frameFilter.getAverageFilteredColImage();
+	if (!filtered)
+		return;
+	std::lock_guard<std::mutex> guard(imageMutex);
+	image.setFromPixels(filtered, width, height, 1);
+	hasImage = true;
+	imageGeneration = currentGeneration;
+	numFrames = settleFrames; // The next image from a refilled buffer again
+}
@@ -0,0 +1,90 @@
+/***********************************************************************
+TemporalFilterWorker - Runs the temporal filter of the colour frames
+used for calibration in its own thread.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "TemporalFrameFilter.h"
+
+// The grabber thread hands every colour frame to addFrame(), which copies it
+// if the worker is idle and drops it otherwise. The worker feeds the frames
+// to a CTemporalFrameFilter, and once its whole buffer was refilled since
+// the last restart() computes the filtered gray image, which the main loop
+// fetches. It only runs while something needs the image.
+class TemporalFilterWorker: public ofThread {
+public:
+	TemporalFilterWorker();
+	~TemporalFilterWorker();
+
+	// type: 0 temporal median of the gray frames, 1 gray of the average colour
+	void start(int type);
+	void stop();
+	bool isFiltering() {
+		return filtering;
+	}
+
+	// Main loop. The next image is only made of frames received after
+	// settleFrames more ones, e.g. once a new chessboard is projected. Never waits
+	void restart();
+	// Called from the grabber thread, never waits
+	void addFrame(const ofPixels& color);
+	// Main loop. Whether an image was finished since the last call and the
+	// last restart(). Never waits
+	bool fetchImage(ofPixels& image);
+
+	// Frames filtered since the last restart()
+	int getNumFrames() {
+		return numFrames;
+	}
+	// Frames in a filtered image
+	int getBufferSize();
+
+	static const int settleFrames = 4; // Projector and camera latency
+
+private:
+	void threadedFunction() override;
+	void filter();
+
+	std::atomic<bool> filtering;
+	std::atomic<int> type;
+	std::atomic<unsigned int> generation; // Incremented by restart()
+	std::atomic<int> numFrames;
+	std::condition_variable_any frameQueued;
+
+	// Handed over while idle, set by addFrame() and cleared by the worker
+	std::atomic<bool> busy;
+	ofPixels frame;
+
+	// Worker side, under the thread mutex
+	CTemporalFrameFilter frameFilter;
+	int width, height; // Of the frames in frameFilter
+	unsigned int filterGeneration;
+
+	// Image waiting to be fetched
+	std::mutex imageMutex;
+	bool hasImage;
+	unsigned int imageGeneration;
+	ofPixels image;
+};
@@ -0,0 +1,82 @@
+/***********************************************************************
+TripleBuffer - Lock-free handoff of the latest value from one producer
+thread to one consumer thread.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <atomic>
+
+// Three slots: the producer fills the back slot, the consumer reads the
+// front slot and the middle slot holds the latest published value.
+// publish() and fetch() only swap slot indices with the middle one, so
+// neither side ever blocks, allocates or copies, and the front slot cannot
+// change while the consumer holds it. Frames published while the consumer
+// is busy are overwritten: the consumer always gets the latest one.
+template <typename T>
+class TripleBuffer {
+public:
+	TripleBuffer()
+	:back(0),
+	middle(1),
+	front(2)
+	{
+	}
+
+	// Producer thread: slot to fill, then publish() it
+	T& getBack(){
+		return slots[back];
+	}
+	// Returns true when the value published before was never fetched and
+	// is now overwritten, false when the consumer took it
+	bool publish(){
+		unsigned int previous = middle.exchange(back | newFlag, std::memory_order_acq_rel);
+		back = previous & indexMask;
+		return (previous & newFlag) != 0;
+	}
+
+	// Consumer thread: take the latest published value if there is one
+	// newer than the current front slot
+	bool fetch(){
+		if ((middle.load(std::memory_order_relaxed) & newFlag) == 0)
+			return false;
+		front = middle.exchange(front, std::memory_order_acq_rel) & indexMask;
+		return true;
+	}
+	const T& getFront() const {
+		return slots[front];
+	}
+
+	// Direct access to all slots, only while neither thread uses the buffer
+	T& getSlot(int i){
+		return slots[i];
+	}
+
+private:
+	TripleBuffer(const TripleBuffer&);
+	TripleBuffer& operator=(const TripleBuffer&);
+
+	static const unsigned int indexMask = 3;
+	static const unsigned int newFlag = 4; // Set in middle when it was published but not fetched yet
+
+	T slots[3];
+	unsigned int back; // Only used by the producer
+	std::atomic<unsigned int> middle;
+	unsigned int front; // Only used by the consumer
+};
@@ -159,7 +159,7 @@ namespace ofxCSG
     
     static ofVec4f getPlaneEquation(ofVec3f basePlanePos, ofVec3f basePlaneNormal){
         ofVec4f basePlaneEq = basePlaneNormal/basePlaneNormal.length(); // Vecteur normal au plan normalisé
-        basePlaneEq.w=-basePlaneNormal.dot(basePlanePos);
+        basePlaneEq.w=-ofVec3f(basePlaneEq).dot(basePlanePos); // Of the unit normal, like x, y and z
         return basePlaneEq;
     }
 	
@@ -368,35 +368,9 @@ namespace ofxCSG
 		return false;
 	}
     
-    // Compute plane equation from point cloud
-    static ofVec4f plane_from_points(ofVec3f* points, int n) {
-        if (n < 3){
-            ofLogVerbose("GreatSand") << "At least three points required" << endl;
-            return ofVec3f();
-        }
-        
-        ofVec3f sum = ofVec3f(0,0,0);
-        for (int i = 0; i < n; i++) {
-            sum = sum + points[i];
-        }
-        ofVec3f centroid = sum/n;
-        
-        ofLogVerbose("GreatSand") << "Centroid coordinates : " << centroid << endl;
-
-        // Calc full 3x3 covariance matrix, excluding symmetries:
-        float xx = 0.0; float xy = 0.0; float xz = 0.0;
-        float yy = 0.0; float yz = 0.0; float zz = 0.0;
-        
-        for (int i = 0; i < n; i++) {
-            ofVec3f r = points[i] - centroid;
-            xx += r.x * r.x;
-            xy += r.x * r.y;
-            xz += r.x * r.z;
-            yy += r.y * r.y;
-            yz += r.y * r.z;
-            zz += r.z * r.z;
-        }
-        
+    // Plane through the centroid of points with this (unnormalized) 3x3
+    // covariance matrix, normal to its direction of least variance
+    static ofVec4f plane_from_covariance(ofVec3f centroid, float xx, float xy, float xz, float yy, float yz, float zz) {
         float det_x = yy*zz - yz*yz;
         float det_y = xx*zz - xz*xz;
         float det_z = xx*yy - xy*xy;
@@ -431,4 +405,36 @@ namespace ofxCSG
         
         return getPlaneEquation(centroid,dir);
     }
+
+    // Compute plane equation from point cloud
+    static ofVec4f plane_from_points(ofVec3f* points, int n) {
+        if (n < 3){
+            ofLogVerbose("GreatSand") << "At least three points required" << endl;
+            return ofVec3f();
+        }
+        
+        ofVec3f sum = ofVec3f(0,0,0);
+        for (int i = 0; i < n; i++) {
+            sum = sum + points[i];
+        }
+        ofVec3f centroid = sum/n;
+        
+        ofLogVerbose("GreatSand") << "Centroid coordinates : " << centroid << endl;
+
+        // Calc full 3x3 covariance matrix, excluding symmetries:
+        float xx = 0.0; float xy = 0.0; float xz = 0.0;
+        float yy = 0.0; float yz = 0.0; float zz = 0.0;
+        
+        for (int i = 0; i < n; i++) {
+            ofVec3f r = points[i] - centroid;
+            xx += r.x * r.x;
+            xy += r.x * r.y;
+            xz += r.x * r.z;
+            yy += r.y * r.y;
+            yz += r.y * r.z;
+            zz += r.z * r.z;
+        }
+        
+        return plane_from_covariance(centroid, xx, xy, xz, yy, yz, zz);
+    }
 }
\ No newline at end of file
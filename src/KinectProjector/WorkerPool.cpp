@@ -0,0 +1,117 @@
+/***********************************************************************
+WorkerPool - A fixed set of threads sharing the work of one job, used to
+split the depth filtering of a frame into bands of rows.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "WorkerPool.h"
+#include <algorithm>
+
+WorkerPool::WorkerPool()
+:job(nullptr),
+numTasks(0),
+nextTask(0),
+busyWorkers(0),
+generation(0),
+quit(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	stopWorkers();
+}
+
+void WorkerPool::setNumThreads(int numThreads)
+{
+	if (numThreads <= 0)
+		numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+	if (numThreads == getNumThreads())
+		return;
+
+	stopWorkers();
+	quit = false;
+	for (int i = 1; i < numThreads; i++)
+		workers.push_back(std::thread(&WorkerPool::workerFunction, this, generation));
+}
+
+void WorkerPool::stopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	jobReady.notify_all();
+	for (auto & worker : workers)
+		worker.join();
+	workers.clear();
+}
+
+void WorkerPool::run(int snumTasks, const std::function<void(int)>& task)
+{
+	if (workers.empty() || snumTasks <= 1)
+	{
+		for (int i = 0; i < snumTasks; i++)
+			task(i);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &task;
+		numTasks = snumTasks;
+		nextTask = 0;
+		busyWorkers = static_cast<int>(workers.size());
+		generation++;
+	}
+	jobReady.notify_all();
+
+	runTasks();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	jobDone.wait(lock, [this]() { return busyWorkers == 0; });
+	job = nullptr;
+}
+
+void WorkerPool::runTasks()
+{
+	int task;
+	while ((task = nextTask++) < numTasks)
+		(*job)(task);
+}
+
+void WorkerPool::workerFunction(unsigned int seenGeneration)
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			jobReady.wait(lock, [&]() { return quit || generation != seenGeneration; });
+			if (quit)
+				return;
+			seenGeneration = generation;
+		}
+
+		runTasks();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--busyWorkers == 0)
+			jobDone.notify_one();
+	}
+}
@@ -0,0 +1,66 @@
+/***********************************************************************
+WorkerPool - A fixed set of threads sharing the work of one job, used to
+split the depth filtering of a frame into bands of rows.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The thread calling run() works on the tasks too, so a pool of N threads
+// starts N-1 workers and a pool of 1 thread runs everything inline.
+class WorkerPool {
+public:
+	WorkerPool();
+	~WorkerPool();
+
+	// Total number of threads including the caller. 0 picks one per core, leaving one core free
+	void setNumThreads(int numThreads);
+	int getNumThreads() const {
+		return static_cast<int>(workers.size()) + 1;
+	}
+
+	// Call task(0) ... task(numTasks-1) spread over the threads and wait for all of them
+	void run(int numTasks, const std::function<void(int)>& task);
+
+private:
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+
+	void stopWorkers();
+	void workerFunction(unsigned int seenGeneration);
+	void runTasks();
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable jobReady;
+	std::condition_variable jobDone;
+
+	const std::function<void(int)>* job;
+	int numTasks;
+	std::atomic<int> nextTask;
+	int busyWorkers;
+	unsigned int generation; // Incremented for every job so workers notice new ones
+	bool quit;
+};
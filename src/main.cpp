@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ofMain.h"
 #include "ofApp.h"
+#include "KinectProjector/FilterBenchmark.h"
 
 const std::string MagicSandVersion = "1.5.4.2";
 
@@ -63,7 +64,38 @@ bool setWindowDimensions(ofGLFWWindowSettings& settings, int windowsNum) {
 }
 
 //========================================================================
-int main() {
+// Command line: Magic-Sand [--replay recording.msd [--replay-mode realtime|fast|step]]
+//               Magic-Sand --benchmark [options], see FilterBenchmark.h
+int main(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::string(argv[i]) == "--benchmark")
+		{
+			FilterBenchmark benchmark; // Headless, no windows are created
+			return benchmark.run(argc, argv);
+		}
+	}
+
+	std::string replayFile;
+	RecordedFrameSource::Playback_mode replayMode = RecordedFrameSource::PLAYBACK_REALTIME;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--replay" && i + 1 < argc)
+		{
+			replayFile = argv[++i];
+		}
+		else if (arg == "--replay-mode" && i + 1 < argc)
+		{
+			std::string mode = argv[++i];
+			if (mode == "fast")
+				replayMode = RecordedFrameSource::PLAYBACK_FULL_SPEED;
+			else if (mode == "step")
+				replayMode = RecordedFrameSource::PLAYBACK_STEP;
+		}
+	}
+
+
 	ofGLFWWindowSettings settings;
 //	setFirstWindowDimensions(settings);
 	//settings.width = 1200;
@@ -90,6 +122,8 @@ int main() {
 	shared_ptr<ofApp> mainApp(new ofApp);
 	ofAddListener(secondWindow->events().draw, mainApp.get(), &ofApp::drawProjWindow);
 	mainApp->projWindow = secondWindow;
+	mainApp->replayFile = replayFile;
+	mainApp->replayMode = replayMode;
 		
 	ofRunApp(mainWindow, mainApp);
 	ofRunMainLoop();
@@ -34,6 +34,8 @@ void ofApp::setup() {
 
 	// Setup kinectProjector
 	kinectProjector = std::make_shared<KinectProjector>(projWindow);
+	if (!replayFile.empty())
+		kinectProjector->setReplayFile(replayFile, replayMode);
 	kinectProjector->setup(true);
 	
 	// Setup sandSurfaceRenderer
@@ -65,6 +67,7 @@ void ofApp::update() {
     // Call kinectProjector->update() first during the update function()
 	kinectProjector->update();
    	sandSurfaceRenderer->update();
+	kinectProjector->traceLatency(LATENCY_STAGE_CONTOURS);
     
     //if (kinectProjector->isROIUpdated())
 	if (kinectProjector->getKinectROI() != mapGameController.getKinectROI())
@@ -104,6 +107,7 @@ void ofApp::drawProjWindow(ofEventArgs &args)
 		boidGameController.drawProjectorWindow();
 	}
 	kinectProjector->drawProjectorWindow();
+	kinectProjector->traceLatency(LATENCY_STAGE_PROJECTED);
 }
 
 void ofApp::keyPressed(int key) 
@@ -116,6 +120,10 @@ void ofApp::keyPressed(int key)
 	{
 		kinectProjector->SaveFilteredDepthImage();
 	}
+	else if (key == 'l')
+	{
+		kinectProjector->SaveLatencyTrace();
+	}
 	else if (key == ' ')
 	{
 		if (kinectProjector->GetApplicationState() == KinectProjector::APPLICATION_STATE_RUNNING && 
@@ -202,6 +210,10 @@ void ofApp::keyPressed(int key)
 		mapGameController.setDebug(kinectProjector->getDumpDebugFiles());
 		mapGameController.DebugTestMe();
 	}
+	else if (key == 'n') // Next frame when replaying a recording in step mode
+	{
+		kinectProjector->stepReplay(1);
+	}
 }
 
 void ofApp::keyReleased(int key) {
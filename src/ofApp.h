@@ -52,6 +52,10 @@ public:
 
 	std::shared_ptr<ofAppBaseWindow> projWindow;
 
+	// Optional recorded session to use instead of the live Kinect
+	std::string replayFile;
+	RecordedFrameSource::Playback_mode replayMode;
+
 private:
 	std::shared_ptr<KinectProjector> kinectProjector;
 	SandSurfaceRenderer* sandSurfaceRenderer;